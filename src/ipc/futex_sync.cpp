@@ -0,0 +1,39 @@
+#include "futex_sync.hpp"
+
+#include <climits>
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+long futex(std::atomic<uint32_t>* word, int op, uint32_t val, const struct timespec* timeout) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, val, timeout, nullptr, 0);
+}
+
+} // namespace
+
+int futex_spin_limit() {
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? FUTEX_SPIN_ITERATIONS : 0;
+}
+
+void FutexCounter::wake() {
+    // Pairs with the sleepers increment in park(): either we see the sleeper, or its FUTEX_WAIT sees the new value
+    if (sleepers.load(std::memory_order_seq_cst) != 0) {
+        futex(&value, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+}
+
+bool FutexCounter::park(uint32_t expected) {
+    struct timespec timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_nsec = FUTEX_PARK_TIMEOUT_MS * 1000000L;
+
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    long rc = futex(&value, FUTEX_WAIT, expected, &timeout);    // returns at once (EAGAIN) if value already moved on
+    int err = errno;
+    sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    return !(rc == -1 && err == EINTR);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+constexpr int FUTEX_SPIN_ITERATIONS = 256;  // busy polls before parking, the peer usually answers within a few microseconds
+constexpr long FUTEX_PARK_TIMEOUT_MS = 100; // parked waiters re-check their condition at least this often (shutdown flag)
+
+// 32-bit counter on its own cache line that any process mapping it can sleep on. Loads and stores are plain atomics,
+// so the uncontended path makes no syscall: FUTEX_WAKE is only issued when a waiter announced itself in `sleepers`.
+// Lives in shared memory, so it uses the process-shared futex operations (no FUTEX_PRIVATE_FLAG).
+struct alignas(CACHE_LINE_SIZE) FutexCounter {
+    std::atomic<uint32_t> value{0};
+    std::atomic<uint32_t> sleepers{0};
+
+    uint32_t load() const { return value.load(std::memory_order_acquire); }
+    void store(uint32_t v) {
+        value.store(v, std::memory_order_seq_cst);
+        wake();
+    }
+
+    // Wake every parked waiter, if any. Also used without changing the value, for shutdown.
+    void wake();
+
+    // Sleep while value still equals expected, bounded by FUTEX_PARK_TIMEOUT_MS. Returns false when interrupted by a signal.
+    bool park(uint32_t expected);
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+              "futex word must be a plain 32-bit integer");
+
+// FUTEX_SPIN_ITERATIONS, or 0 on a single CPU where spinning only delays the peer we are waiting for
+int futex_spin_limit();
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Block until ready() holds. ready() may only change together with counter's value (or with a flag whose writer calls
+// counter.wake()). Spins first, then parks on the futex. With interruptible set, a signal returns ready() to the caller,
+// so e.g. a worker can notice SIGTERM.
+template <typename Ready>
+bool futex_wait_until(FutexCounter& counter, Ready&& ready, bool interruptible = false) {
+    static const int spin_limit = futex_spin_limit();
+    for (int i = 0; i < spin_limit; ++i) {
+        if (ready()) return true;
+        cpu_relax();
+    }
+    while (true) {
+        uint32_t seen = counter.value.load(std::memory_order_seq_cst);
+        if (ready()) return true;
+        if (!counter.park(seen) && interruptible) return ready();
+    }
+}
@@ -6,6 +6,7 @@
 #include <thread>
 #include <chrono>
 #include <time.h>
+#include <algorithm>
 
 
 #ifdef DEBUG_PRINT
@@ -20,55 +21,13 @@
 /* -----------------------------------------------------------------Constructor and Destructor section----------------------------------------------------------------------------------*/
 
 IPCManager::IPCManager(bool server, int worker_idx) 
-    : shared_mem_ptr(nullptr), shared_mem_file_descriptor(-1), is_server(server), worker_index(worker_idx) {
+    : shared_mem_ptr(nullptr), shared_mem_size(0), shared_mem_file_descriptor(-1), is_server(server), worker_index(worker_idx), response_notify_fd(-1) {
     std::cout << "Building IPCManager with: server=" << server << ", worker_idx=" << worker_idx << std::endl;
-    // Initialize semaphore arrays to null
-    for (int i = 0; i < MAX_WORKERS; ++i) {
-        sem_request_items[i] = nullptr;
-        sem_req_space[i] = nullptr;
-        sem_resp[i] = nullptr;
-        sem_resp_consumed[i] = nullptr;
-    }
 }
 
 IPCManager::~IPCManager() {
-    for (int i = 0; i < MAX_WORKERS; ++i) {
-        if (sem_request_items[i] != nullptr && sem_request_items[i] != SEM_FAILED) {
-            sem_close(sem_request_items[i]);
-            if (is_server) {
-                std::ostringstream ss;
-                ss << get_sem_req_items_prefix() << i;
-                sem_unlink(ss.str().c_str());
-            }
-        }
-        if (sem_req_space[i] != nullptr && sem_req_space[i] != SEM_FAILED) {
-            sem_close(sem_req_space[i]);
-            if (is_server) {
-                std::ostringstream ss;
-                ss << get_sem_req_space_prefix() << i;
-                sem_unlink(ss.str().c_str());
-            }
-        }
-        if (sem_resp[i] != nullptr && sem_resp[i] != SEM_FAILED) {
-            sem_close(sem_resp[i]);
-            if (is_server) {
-                std::ostringstream ss;
-                ss << get_sem_resp_prefix() << i;
-                sem_unlink(ss.str().c_str());
-            }
-        }
-        if (sem_resp_consumed[i] != nullptr && sem_resp_consumed[i] != SEM_FAILED) {
-            sem_close(sem_resp_consumed[i]);
-            if (is_server) {
-                std::ostringstream ss;
-                ss << get_sem_resp_consumed_prefix() << i;
-                sem_unlink(ss.str().c_str());
-            }
-        }
-    }
-    
     if (shared_mem_ptr != nullptr && shared_mem_ptr != MAP_FAILED) {
-        munmap(shared_mem_ptr, SHARED_MEM_SIZE);
+        munmap(shared_mem_ptr, shared_mem_size);
     }
     
     if (shared_mem_file_descriptor != -1) {
@@ -80,261 +39,476 @@ IPCManager::~IPCManager() {
     std::cout << "IPCManager cleaned up successfully" << std::endl;
 }
 
+// Ask for transparent huge pages on a shared memory mapping. Needs shmem THP set to "advise" (or better) in
+// /sys/kernel/mm/transparent_hugepage/shmem_enabled; otherwise this does nothing and 4 KB pages are used.
+static void advise_huge_pages(void* addr, size_t length) {
+#ifdef MADV_HUGEPAGE
+    if (madvise(addr, length, MADV_HUGEPAGE) != 0) {
+        std::cerr << "madvise(MADV_HUGEPAGE) failed, using regular pages: " << strerror(errno) << std::endl;
+    }
+#endif
+}
+
 bool IPCManager::initialize() {
-    // On server startup, clean up any orphaned IPC objects from a previous run.
+    // On server startup, clean up orphaned shared memory from a previous run.
     if (is_server) {
-        shm_unlink(get_shm_name()); // Unlink shared memory
-        for (int i = 0; i < MAX_WORKERS; ++i) {
-            std::ostringstream sem_req_items_name, sem_req_space_name, sem_resp_name, sem_resp_consumed_name;
-            sem_req_items_name << get_sem_req_items_prefix() << i;
-            sem_req_space_name << get_sem_req_space_prefix() << i;
-            sem_resp_name << get_sem_resp_prefix() << i;
-            sem_resp_consumed_name << get_sem_resp_consumed_prefix() << i;
-            sem_unlink(sem_req_items_name.str().c_str());
-            sem_unlink(sem_req_space_name.str().c_str());
-            sem_unlink(sem_resp_name.str().c_str());
-            sem_unlink(sem_resp_consumed_name.str().c_str());
-        }
+        shm_unlink(get_shm_name());
     }
 
     // Create or open shared memory
     if (is_server) {
+        AppConfig& config = AppConfig::get_instance();
+        uint32_t max_workers = static_cast<uint32_t>(std::max(1, config.get_int("MAX_WORKERS_DYNAMIC", DEFAULT_MAX_WORKERS)));
+        uint32_t ring_capacity = 1;
+        while (ring_capacity < static_cast<uint32_t>(std::max(1, config.get_int("QUEUE_DEPTH", DEFAULT_QUEUE_DEPTH)))) {
+            ring_capacity <<= 1;    // ring indices wrap at 2^32, the capacity has to divide it
+        }
+        shared_mem_size = SharedMem::size_for(max_workers, ring_capacity);
+        bool huge_pages = config.get_int("HUGE_PAGES", 0) != 0;
+        if (huge_pages) {
+            shared_mem_size = align_up(shared_mem_size, HUGE_PAGE_SIZE);
+        }
+
         shared_mem_file_descriptor = shm_open(get_shm_name(), O_CREAT | O_RDWR, 0666);
         if (shared_mem_file_descriptor == -1) {
             std::cerr << "Failed to create shared memory: " << strerror(errno) << std::endl;
             return false;
         }
-        if (ftruncate(shared_mem_file_descriptor, SHARED_MEM_SIZE) == -1) {
+        if (ftruncate(shared_mem_file_descriptor, shared_mem_size) == -1) {
             std::cerr << "Failed to set shared memory size: " << strerror(errno) << std::endl;
             return false;
         }
+        shared_mem_ptr = static_cast<SharedMem*>(mmap(nullptr, shared_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_mem_file_descriptor, 0));
+        if (shared_mem_ptr == MAP_FAILED) {
+            std::cerr << "Failed to map shared memory: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (huge_pages) {
+            advise_huge_pages(shared_mem_ptr, shared_mem_size);    // before the constructors below fault the pages in
+        }
+        new (shared_mem_ptr) SharedMem(max_workers, ring_capacity);   // All ring counters start at zero, every slot free
+        shared_mem_ptr->total_size = shared_mem_size;
+        shared_mem_ptr->huge_pages = huge_pages ? 1 : 0;
+        shared_mem_ptr->resp_flush_tokens = static_cast<uint32_t>(std::max(1, config.get_int("RESP_FLUSH_TOKENS", 1)));
+        shared_mem_ptr->resp_flush_interval_us = static_cast<uint32_t>(std::max(0, config.get_int("RESP_FLUSH_INTERVAL_US", 0)));
+        enqueue_mutex = std::make_unique<std::mutex[]>(max_workers);
+        std::atomic_thread_fence(std::memory_order_release);
+        shared_mem_ptr->magic = SHM_MAGIC;  // complete, workers may use it
+        std::cout << "Shared memory: " << max_workers << " worker queues of " << ring_capacity << " slots, " << shared_mem_size / 1024 << " KB"
+                  << (huge_pages ? ", huge pages advised" : "") << std::endl;
     } else {
         shared_mem_file_descriptor = shm_open(get_shm_name(), O_RDWR, 0666);
         if (shared_mem_file_descriptor == -1) {
             std::cerr << "Failed to open shared memory: " << strerror(errno) << std::endl;
             return false;
         }
-    }
-    
-    // Map shared memory
-    shared_mem_ptr = static_cast<SharedMem*>(mmap(nullptr, SHARED_MEM_SIZE,PROT_READ | PROT_WRITE, MAP_SHARED, shared_mem_file_descriptor, 0));
-    if (shared_mem_ptr == MAP_FAILED) {
-        std::cerr << "Failed to map shared memory: " << strerror(errno) << std::endl;
-        return false;
-    }
-    
-    if (is_server) {
-        new (shared_mem_ptr) SharedMem();
-    }
-    
-    // Open semaphores
-    for (int i = 0; i < MAX_WORKERS; ++i) {
-        std::ostringstream sem_req_items_name, sem_req_space_name, sem_resp_name, sem_resp_consumed_name;
-        sem_req_items_name << get_sem_req_items_prefix() << i;
-        sem_req_space_name << get_sem_req_space_prefix() << i;
-        sem_resp_name << get_sem_resp_prefix() << i;
-        sem_resp_consumed_name << get_sem_resp_consumed_prefix() << i;
 
-        if (is_server) {
-            auto create_semaphore = [&](const char* name, int value) -> sem_t* {
-                sem_t* sem = sem_open(name, O_CREAT | O_EXCL, 0666, value);
-                if (sem == SEM_FAILED && errno == EEXIST) {
-                    DEBUG_COUT("Semaphore " << name << " already exists, unlinking and recreating.");
-                    sem_unlink(name);
-                    sem = sem_open(name, O_CREAT, 0666, value);
-                }
-                return sem;
-            };
-
-            sem_request_items[i] = create_semaphore(sem_req_items_name.str().c_str(), 0);
-            sem_req_space[i] = create_semaphore(sem_req_space_name.str().c_str(), RING_CAP_PER_WORKER);
-            sem_resp[i] = create_semaphore(sem_resp_name.str().c_str(), 0);
-            sem_resp_consumed[i] = create_semaphore(sem_resp_consumed_name.str().c_str(), 1);
-        } else {
-            sem_request_items[i] = sem_open(sem_req_items_name.str().c_str(), 0);
-            sem_req_space[i] = sem_open(sem_req_space_name.str().c_str(), 0);
-            sem_resp[i] = sem_open(sem_resp_name.str().c_str(), 0);
-            sem_resp_consumed[i] = sem_open(sem_resp_consumed_name.str().c_str(), 0);
+        // Map the header alone first, it tells how large the whole mapping is
+        struct stat shm_stat;
+        if (fstat(shared_mem_file_descriptor, &shm_stat) == -1 || static_cast<size_t>(shm_stat.st_size) < sizeof(SharedMem)) {
+            std::cerr << "Shared memory is not initialized yet" << std::endl;
+            return false;
+        }
+        void* header_map = mmap(nullptr, sizeof(SharedMem), PROT_READ, MAP_SHARED, shared_mem_file_descriptor, 0);
+        if (header_map == MAP_FAILED) {
+            std::cerr << "Failed to map shared memory header: " << strerror(errno) << std::endl;
+            return false;
         }
+        const SharedMem* header = static_cast<const SharedMem*>(header_map);
+        uint32_t magic = header->magic, version = header->version, max_workers = header->max_workers;
+        shared_mem_size = header->total_size;
+        munmap(header_map, sizeof(SharedMem));
 
-        if (sem_request_items[i] == SEM_FAILED || sem_req_space[i] == SEM_FAILED || sem_resp[i] == SEM_FAILED || sem_resp_consumed[i] == SEM_FAILED) {
-            std::cerr << "Failed to open semaphore for worker " << i << ": " << strerror(errno) << std::endl;
+        if (magic != SHM_MAGIC || version != SHM_LAYOUT_VERSION) {
+            std::cerr << "Shared memory layout mismatch: magic " << std::hex << magic << std::dec << " version " << version
+                      << ", this worker expects version " << SHM_LAYOUT_VERSION << std::endl;
             return false;
         }
+        if (worker_index < 0 || worker_index >= static_cast<int>(max_workers)) {
+            std::cerr << "Worker index " << worker_index << " out of range, shared memory has " << max_workers << " queues" << std::endl;
+            return false;
+        }
+        shared_mem_ptr = static_cast<SharedMem*>(mmap(nullptr, shared_mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, shared_mem_file_descriptor, 0));
+        if (shared_mem_ptr == MAP_FAILED) {
+            std::cerr << "Failed to map shared memory: " << strerror(errno) << std::endl;
+            return false;
+        }
+        if (shared_mem_ptr->huge_pages) {
+            advise_huge_pages(shared_mem_ptr, shared_mem_size);    // each process's page tables map the huge pages separately
+        }
     }
+    
     std::cout << "IPCManager initialized successfully" << std::endl;
     return true;
 }
 
 /* ---------------------------------------------------------------Main Methood section-----------------------------------------------------------*/
 
-// Putting task into worker's request queue. max total task in the queue is RING_CAP_PER_WORKER * MAX_WORKERS
-bool IPCManager::enqueue_request(int worker_idx, const std::string& message, uint64_t& task_id) {
-    if (message.length() >= CHUNK_SIZE) {   // Keep this check as sometimes client send long prompt, next is implement multi chunk enqueue.
-        DEBUG_CERR("Message too large: " << message.length() << " >= " << CHUNK_SIZE);
+// Putting task into worker's request queue. max total task in the queue is QUEUE_DEPTH * MAX_WORKERS_DYNAMIC
+bool IPCManager::enqueue_request(int worker_idx, std::string_view header, std::string_view body, uint64_t& task_id, uint32_t& slot_idx,
+                                 PayloadKind kind, uint64_t deadline_ns, uint64_t arrival_ns, bool traced) {
+    size_t payload_len = header.length() + body.length();
+    if (payload_len > MAX_PAYLOAD_SIZE) {
+        DEBUG_CERR("Payload too large: " << payload_len << " > " << MAX_PAYLOAD_SIZE);
         return false;
     }
-    // sem_req_space is RING_CAP_PER_WORKER,
-    if (sem_wait(sem_req_space[worker_idx]) == -1) {DEBUG_CERR("Failed to wait for space on worker " << worker_idx << ": " << strerror(errno));return false;}
+    std::lock_guard<std::mutex> lock(enqueue_mutex[worker_idx]);   // one producer per ring
+
+    RequestQueue& queue = worker_queue(worker_idx);
+    uint32_t head_val = queue.head.load();
+    slot_idx = head_val & (queue.capacity - 1);
+    FutexCounter& busy = queue.busy(slot_idx);
+
+    // Ring full: wait until the server thread of the oldest task drained its response and released the slot,
+    // and until the payload of the slot's previous task is freed (with stealing, payloads are not freed in slot order).
+    futex_wait_until(busy, [&] { return busy.load() == 0 || is_shutdown_requested(); });
+    futex_wait_until(queue.payload_freed, [&] { return head_val - queue.payload_freed.load() < queue.capacity || is_shutdown_requested(); });
+    if (busy.load() != 0 || head_val - queue.payload_freed.load() >= queue.capacity) {DEBUG_CERR("Shutdown while waiting for space on worker " << worker_idx); return false;}
+
+    // Arena allocation, contiguous and aligned. Skip to the start of the ring if the payload does not fit before its end.
+    uint32_t alloc_len = static_cast<uint32_t>((payload_len + PAYLOAD_ALIGN - 1) & ~(PAYLOAD_ALIGN - 1));
+    uint32_t arena_pos = queue.arena_head % PAYLOAD_ARENA_SIZE;
+    uint32_t skip = (arena_pos + alloc_len > PAYLOAD_ARENA_SIZE) ? static_cast<uint32_t>(PAYLOAD_ARENA_SIZE) - arena_pos : 0;
+    futex_wait_until(queue.arena_tail, [&] { return PAYLOAD_ARENA_SIZE - (queue.arena_head - queue.arena_tail.load()) >= skip + alloc_len || is_shutdown_requested(); });
+    if (PAYLOAD_ARENA_SIZE - (queue.arena_head - queue.arena_tail.load()) < skip + alloc_len) {DEBUG_CERR("Shutdown while waiting for arena space on worker " << worker_idx); return false;}
+    uint32_t payload_offset = (arena_pos + skip) % PAYLOAD_ARENA_SIZE;
+    queue.arena_head += skip + alloc_len;
+
+    std::memcpy(queue.arena() + payload_offset, header.data(), header.length());
+    std::memcpy(queue.arena() + payload_offset + header.length(), body.data(), body.length());
     
     task_id = get_next_task_id();       // get unique task id.
     
-    RequestQueue& queue = shared_mem_ptr->worker_queues[worker_idx];
-    size_t head_val = queue.head.load();
-    ReqSlot& slot = queue.req[head_val % RING_CAP_PER_WORKER];  // Get refference for the nect ReqSlot in the ring buffer.
-    
+    ReqSlot& slot = queue.req(slot_idx);  // Get refference for the nect ReqSlot in the ring buffer.
     slot.task_id = task_id;
-    slot.len = static_cast<uint32_t>(message.length());
-    std::memcpy(slot.data, message.c_str(), message.length());
-    slot.data[message.length()] = '\0';
-    
-    queue.head.store(head_val + 1);  // Increment the ring buffer head tracker
+    slot.kind = kind;
+    slot.len = static_cast<uint32_t>(payload_len);
+    slot.payload_offset = payload_offset;
+    slot.payload_end = queue.arena_head;
+    slot.deadline_ns = deadline_ns;
+    slot.arrival_ns = arrival_ns;
+    slot.traced = traced;
+    slot.enqueued_ns = traced ? Trace::now_ns() : 0;
+    slot.released_pos.store(head_val);   // anything but head_val + 1, the payload is in use
+    slot.is_canceled.store(false);
+
+    // Fresh response stream, nobody waits on it: its previous task was fully drained before the slot was released
+    RespSlot& resp = queue.resp(slot_idx);
+    resp.task_id.store(task_id);
+    resp.published.store(0);
+    resp.consumed.store(0);
+    resp.write_pos = 0;
+    resp.unflushed_pieces = 0;
+    resp.last_flush_ns = 0;
     
-    sem_post(sem_request_items[worker_idx]);
+    busy.store(1);
+    queue.head.store(head_val + 1);  // Publish the slot, wakes the worker only if it is parked
+
+    // The owner is not parked, so it is busy generating: let an idle worker steal the request instead of waiting behind it
+    if (queue.head.sleepers.load() == 0) {
+        wake_idle_worker(worker_idx);
+    }
     
     return true;
 }
 
-// Dequeues a request for a specific worker. Worker use this to get the prompt data from server. the data is in ReqSlot. This is blocking call.
-bool IPCManager::dequeue_request(int worker_idx, ReqSlot& slot) {
-    if (sem_wait(sem_request_items[worker_idx]) == -1) {    // Block until there is an item available
-        // EINTR is ok, it means the wait was interrupted by a signal (e.g., SIGTERM)
-        if (errno != EINTR) {std::cerr << "Worker " << worker_idx << " failed to wait for items: " << strerror(errno) << std::endl;}
+// Claim the oldest request of a ring. The owner and stealing workers race for it through the CAS on tail, the winner owns
+// the slot until it ends the response stream. The payload is read in place from the ring's arena.
+bool IPCManager::claim_request(int queue_idx, RequestView& request, uint32_t& slot_idx) {
+    RequestQueue& queue = worker_queue(queue_idx);
+    uint32_t tail_val = queue.tail.load();
+    do {
+        if (queue.head.load() == tail_val) {return false;}
+    } while (!queue.tail.value.compare_exchange_weak(tail_val, tail_val + 1, std::memory_order_acq_rel, std::memory_order_acquire));
+
+    slot_idx = tail_val & (queue.capacity - 1);
+    const ReqSlot& req_slot = queue.req(slot_idx);
+    request.task_id = req_slot.task_id;
+    request.kind = req_slot.kind;
+    request.is_canceled = req_slot.is_canceled.load();
+    request.deadline_ns = req_slot.deadline_ns;
+    request.arrival_ns = req_slot.arrival_ns;
+    request.traced = req_slot.traced;
+    request.enqueued_ns = req_slot.enqueued_ns;
+    request.payload = std::string_view(queue.arena() + req_slot.payload_offset, req_slot.len);
+    request.queue_idx = queue_idx;
+    request.ring_pos = tail_val;
+    return true;
+}
+
+// Ring of another worker with the longest backlog, -1 when every other ring is drained. A backlog means its owner is busy
+// (or dead), the requests would otherwise wait behind the generation in progress.
+int IPCManager::find_steal_victim(int worker_idx) const {
+    int victim = -1;
+    uint32_t longest = 0;
+    for (uint32_t i = 0; i < shared_mem_ptr->max_workers; ++i) {
+        if (static_cast<int>(i) == worker_idx) continue;
+        const RequestQueue& queue = worker_queue(i);
+        uint32_t backlog = queue.head.load() - queue.tail.load();
+        if (backlog > longest) {
+            longest = backlog;
+            victim = static_cast<int>(i);
+        }
+    }
+    return victim;
+}
+
+// Wake one worker parked on its empty ring so it re-checks the other rings. Each ring has a single waiter, its owner.
+void IPCManager::wake_idle_worker(int busy_worker_idx) {
+    for (uint32_t i = 0; i < shared_mem_ptr->max_workers; ++i) {
+        if (static_cast<int>(i) == busy_worker_idx) continue;
+        FutexCounter& head = worker_queue(i).head;
+        if (head.sleepers.load() != 0) {
+            head.wake();
+            return;
+        }
+    }
+}
+
+// Dequeues a request for a specific worker: its own ring first, then the oldest request of the longest other ring. This is blocking call.
+// Parks on the worker's own ring, enqueue_request wakes it as well when a request lands behind a busy worker.
+bool IPCManager::dequeue_request(int worker_idx, RequestView& request, uint32_t& slot_idx) {
+    RequestQueue& queue = worker_queue(worker_idx);
+    while (true) {
+        if (claim_request(worker_idx, request, slot_idx)) {return true;}
+        int victim = find_steal_victim(worker_idx);
+        if (victim >= 0) {
+            if (claim_request(victim, request, slot_idx)) {
+                DEBUG_CERR("Worker " << worker_idx << " stole task " << request.task_id << " from worker " << victim);
+                return true;
+            }
+            continue;   // lost the race for it, look again
+        }
+
+        // Block until there is an item available. Returns early on a signal (e.g., SIGTERM) or shutdown, the caller checks for both.
+        bool ready = futex_wait_until(queue.head, [&] { return queue.head.load() != queue.tail.load() || find_steal_victim(worker_idx) >= 0 || is_shutdown_requested(); }, true);
+        if (!ready || is_shutdown_requested()) {return false;}
+    }
+}
+
+// The arena is a FIFO, but with stealing the payloads are released out of order. The arena tail only moves over the released
+// prefix: whoever takes release_lock advances it for every worker, the others return at once and never wait for the lock.
+// Wakes the server if it waits for arena space or for a slot.
+void IPCManager::release_request_payload(const RequestView& request) {
+    RequestQueue& queue = worker_queue(request.queue_idx);
+    const uint32_t mask = queue.capacity - 1;
+    queue.req(request.ring_pos & mask).released_pos.store(request.ring_pos + 1);
+
+    while (queue.release_lock.exchange(1) == 0) {
+        uint32_t freed = queue.payload_freed.load();
+        uint32_t arena_tail = queue.arena_tail.load();
+        bool moved = false;
+        while (queue.req(freed & mask).released_pos.load() == freed + 1) {
+            arena_tail = queue.req(freed & mask).payload_end;
+            ++freed;
+            moved = true;
+        }
+        if (moved) {
+            queue.arena_tail.store(arena_tail);
+            queue.payload_freed.store(freed);
+        }
+        queue.release_lock.store(0);
+        // A release that found the lock taken after our last check relies on us: look once more
+        if (queue.req(freed & mask).released_pos.load() != freed + 1) {return;}
+    }
+}
+
+// Make everything appended to the stream visible to the server thread, waking it if it is parked
+static void publish_response_stream(RespSlot& slot, bool is_last, uint64_t now_ns) {
+    slot.published.store(slot.write_pos | (is_last ? RESP_STREAM_FINISHED : 0));
+    slot.unflushed_pieces = 0;
+    slot.last_flush_ns = now_ns;
+}
+
+static uint64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Used by worker to append a piece to the task's response stream. Does not wait for the server thread unless the ring is full,
+// the bytes are published per the flush policy and always with the last piece.
+bool IPCManager::send_response_chunk(int queue_idx, uint32_t slot_idx, uint64_t task_id, std::string_view chunk, bool is_last, bool publish_now) {
+    RespSlot& slot = worker_queue(queue_idx).resp(slot_idx);
+    if (slot.task_id.load() != task_id) {
+        DEBUG_CERR("Response stream " << slot_idx << " of ring " << queue_idx << " belongs to task " << slot.task_id.load() << ", not " << task_id);
         return false;
     }
-    
-    RequestQueue& queue = shared_mem_ptr->worker_queues[worker_idx];
-    size_t tail_val = queue.tail.fetch_add(1);
-    ReqSlot& req_slot = queue.req[tail_val % RING_CAP_PER_WORKER];
-    
-    // Manually copy data since std::atomic makes ReqSlot non-copyable
-    slot.task_id = req_slot.task_id;
-    slot.len = req_slot.len;
-    std::memcpy(slot.data, req_slot.data, slot.len);
-    slot.data[slot.len] = '\0';
-    slot.is_canceled.store(req_slot.is_canceled.load());
 
+    size_t offset = 0;
+    while (offset < chunk.length()) {
+        uint32_t free_bytes = RESP_STREAM_SIZE - (slot.write_pos - slot.consumed.load());
+        if (free_bytes == 0) {
+            // Ring full: hand over what we have and wait for the server thread to drain it. A slow client can take its
+            // time, the worker is not stalled meanwhile
+            publish_response_stream(slot, false, slot.last_flush_ns);
+            notify_response_ready();
+            WorkerTelemetry& telemetry = worker_queue(worker_index).telemetry;
+            uint32_t state = telemetry.state.load(std::memory_order_relaxed);
+            telemetry.state.store(static_cast<uint32_t>(WorkerState::OutputWait), std::memory_order_release);
+            futex_wait_until(slot.consumed, [&] { return slot.write_pos - slot.consumed.load() < RESP_STREAM_SIZE || is_shutdown_requested(); });
+            telemetry.heartbeat_ns.store(steady_now_ns(), std::memory_order_relaxed);
+            telemetry.state.store(state, std::memory_order_release);     // after the heartbeat, a reader never pairs it with the old one
+            if (is_shutdown_requested()) {DEBUG_CERR("Shutdown while waiting for response consumption on ring " << queue_idx << " slot " << slot_idx); return false;}
+            continue;
+        }
+        size_t n = std::min<size_t>(free_bytes, chunk.length() - offset);
+        size_t pos = slot.write_pos % RESP_STREAM_SIZE;
+        size_t first = std::min(n, RESP_STREAM_SIZE - pos);
+        std::memcpy(slot.data + pos, chunk.data() + offset, first);
+        std::memcpy(slot.data, chunk.data() + offset + first, n - first);
+        slot.write_pos += static_cast<uint32_t>(n);
+        offset += n;
+    }
+
+    ++slot.unflushed_pieces;
+    uint32_t interval_us = shared_mem_ptr->resp_flush_interval_us;
+    uint64_t now_ns = interval_us ? steady_now_ns() : 0;
+    if (is_last || publish_now || slot.unflushed_pieces >= shared_mem_ptr->resp_flush_tokens ||
+        (interval_us && now_ns - slot.last_flush_ns >= interval_us * 1000ull)) {
+        publish_response_stream(slot, is_last, now_ns);
+        notify_response_ready();
+    }
     return true;
 }
 
-// Used by worker to send response chunk to server. Wait server to post sem_resp_consumed, then Load shared memory response slot, then fill up RespSlot
-bool IPCManager::send_response_chunk(int worker_idx, uint64_t task_id, const std::string& chunk, bool is_last) {
-    // wait until sem_resp_consumed gets posted by the server, then we send another chunk
-    if (sem_wait(sem_resp_consumed[worker_idx]) == -1) {DEBUG_CERR("Failed to wait for response consumption signal from worker " << worker_idx << ": " << strerror(errno)); return false;}
-    RespSlot& slot = shared_mem_ptr->resp_slots[worker_idx];
-    slot.task_id.store(task_id);
-    slot.len = static_cast<uint32_t>(chunk.length());
-    slot.is_last_piece = is_last;
-    std::memcpy(slot.data, chunk.c_str(), chunk.length());
-    slot.data[chunk.length()] = '\0';
-    
-    sem_post(sem_resp[worker_idx]);
+// published is stored seq_cst before the flag is read here, and the pump arms before its last scan: either the pump's scan sees
+// the bytes, or we see the flag and wake it.
+void IPCManager::notify_response_ready() {
+    if (response_notify_fd != -1 && shared_mem_ptr->response_notify_armed.load(std::memory_order_seq_cst)) {
+        uint64_t one = 1;
+        ssize_t written = write(response_notify_fd, &one, sizeof(one));    // EAGAIN only when the counter is saturated, the pump wakes anyway
+        (void)written;
+    }
+}
+
+void IPCManager::arm_response_notify(bool armed) {
+    shared_mem_ptr->response_notify_armed.store(armed ? 1 : 0, std::memory_order_seq_cst);
+}
+
+
+// Hands out everything the worker published since the last consume as one chunk, so a slow reader catches up in a single pass.
+// Each queue slot has its own response stream and only the reader of the task that enqueued it touches it.
+bool IPCManager::peek_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, struct iovec parts[2], int& part_count, uint32_t& end, bool& is_last, bool& ready) {
+    RespSlot& slot = worker_queue(worker_idx).resp(slot_idx);
+    if (slot.task_id.load() != task_id) {
+        // Cannot happen while the slot is only released after its final chunk, treat it as a broken stream
+        DEBUG_CERR("Response stream " << slot_idx << " of worker " << worker_idx << " carries task " << slot.task_id.load() << ", expected " << task_id);
+        return false;
+    }
+    uint32_t consumed = slot.consumed.load();
+    uint32_t published = slot.published.load();
+    ready = published != consumed;     // new bytes, or the finished bit
+    if (!ready) {return true;}
+
+    end = published & ~RESP_STREAM_FINISHED;
+    size_t n = end - consumed;
+    size_t pos = consumed % RESP_STREAM_SIZE;
+    size_t first = std::min(n, RESP_STREAM_SIZE - pos);
+    parts[0].iov_base = slot.data + pos;
+    parts[0].iov_len = first;
+    parts[1].iov_base = slot.data;
+    parts[1].iov_len = n - first;
+    part_count = (n - first) ? 2 : (first ? 1 : 0);
+    is_last = (published & RESP_STREAM_FINISHED) != 0;
     return true;
 }
 
+// Frees ring space, wakes the worker only if it is parked on a full ring
+void IPCManager::consume_response_chunk(int worker_idx, uint32_t slot_idx, uint32_t end) {
+    worker_queue(worker_idx).resp(slot_idx).consumed.store(end);
+}
+
+bool IPCManager::try_read_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, std::string& chunk, bool& is_last, bool& ready) {
+    struct iovec parts[2];
+    int part_count = 0;
+    uint32_t end = 0;
+    if (!peek_response_chunk(worker_idx, slot_idx, task_id, parts, part_count, end, is_last, ready)) {return false;}
+    if (!ready) {return true;}
+    chunk.assign(static_cast<const char*>(parts[0].iov_base), parts[0].iov_len);
+    chunk.append(static_cast<const char*>(parts[1].iov_base), parts[1].iov_len);
+    consume_response_chunk(worker_idx, slot_idx, end);
+    return true;
+}
 
 // Used by client to wait get the token chunk from worker. This is blocking call
-// It works by loading worker response slot, then match the task_id. if not match, wake up another thread, hopefully the owner of correct task_id, then sleep this thread.
-// bool IPCManager::wait_for_response_chunk(int worker_idx, uint64_t task_id, std::string& chunk, bool& is_last, const std::function<bool(const std::string&)>& on_timeout_callback, bool& client_disconnected) {
-//     int multiplier = 0;
-//     while (true) {
-//         struct timespec ts;
-//         if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-//             DEBUG_CERR("clock_gettime failed: " << strerror(errno));
-//             return false;
-//         }
-//         ts.tv_sec += 1; // 1-second timeout from now
-
-//         if (sem_timedwait(sem_resp[worker_idx], &ts) == -1) {
-//             if (errno == ETIMEDOUT) {
-//                 if (on_timeout_callback) {
-//                     std::cout << "On timeout callback" <<task_id<< std::endl;
-//                     if (!on_timeout_callback("{\"chunk\": \"" + std::string("+") + "\", \"is_last\": " + std::string("false") + "}")) { // Callback returns false on client disconnect
-//                         client_disconnected = true;
-//                         return false;
-//                     }
-//                 }
-//                 continue; // Continue waiting, jump to the top of the loop
-//             }
-//             DEBUG_CERR("Failed to wait for response from worker " << worker_idx << ": " << strerror(errno));
-//             return false;
-//         }
-        
-//         RespSlot& slot = shared_mem_ptr->resp_slots[worker_idx];
-//         uint64_t received_task_id = slot.task_id.load();
-        
-//         if (received_task_id == task_id) {
-//             chunk.assign(slot.data, slot.len);
-//             is_last = slot.is_last_piece;
-//             sem_post(sem_resp_consumed[worker_idx]); // Signal worker: chunk consumed, you can now write the next one. worker wait for this to be posted before sending another chunk
-//             return true;
-//         } else {
-//             // This is not the chunk we are looking for. Post back to the response semaphore to wake up another waiting thread.
-//             sem_post(sem_resp[worker_idx]);
-//             // Yield to give other threads a chance to run and check the chunk.
-//             std::this_thread::sleep_for(std::chrono::milliseconds(25));
-//             multiplier++;
-//             if (multiplier%5 == 0) {
-//                 if (!on_timeout_callback("{\"chunk\": \"" + std::string("+") + "\", \"is_last\": " + std::string("false") + "}")) { // Callback returns false on client disconnect
-//                     client_disconnected = true;
-//                     return false;
-//                 }
-//             }
-//         }
-//     }
-// }
-
-
-bool IPCManager::wait_for_response_chunk(int worker_idx, uint64_t task_id, std::string& chunk, bool& is_last, const std::function<bool(const std::string&)>& on_timeout_callback, bool& client_disconnected) {
-    while (true) {
-        if (sem_wait(sem_resp[worker_idx]) == -1) {DEBUG_CERR("Failed to wait for response from worker " << worker_idx << ": " << strerror(errno));return false;}
-        
-        RespSlot& slot = shared_mem_ptr->resp_slots[worker_idx];
-        uint64_t received_task_id = slot.task_id.load();
-        
-        if (received_task_id == task_id) {
-            chunk.assign(slot.data, slot.len);
-            is_last = slot.is_last_piece;
-            sem_post(sem_resp_consumed[worker_idx]); // Signal worker: chunk consumed, you can now write the next one. worker wait for this to be posted before sending another chunk
-            return true;
-        } else {
-            // This is not the chunk we are looking for. Post back to the response semaphore to wake up another waiting thread.
-            sem_post(sem_resp[worker_idx]);
-            // Yield to give other threads a chance to run and check the chunk.
-            std::this_thread::sleep_for(std::chrono::milliseconds(25));
-        }
-    }
+bool IPCManager::wait_for_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, std::string& chunk, bool& is_last, const std::function<bool(const std::string&)>& on_timeout_callback, bool& client_disconnected) {
+    RespSlot& slot = worker_queue(worker_idx).resp(slot_idx);
+    uint32_t consumed = slot.consumed.load();
+    futex_wait_until(slot.published, [&] { return slot.published.load() != consumed || slot.task_id.load() != task_id; });
+
+    bool ready = false;
+    return try_read_response_chunk(worker_idx, slot_idx, task_id, chunk, is_last, ready) && ready;
+}
+
+// Called by the server thread after it consumed the final chunk of its task. Releasing here rather than from the worker
+// guarantees a slot, and so its response stream, is only handed to the next task once nobody waits on it anymore.
+void IPCManager::release_request_slot(int worker_idx, uint32_t slot_idx) {
+    worker_queue(worker_idx).busy(slot_idx).store(0);
 }
 /* -----------------------------------------------------------------Utility section----------------------------------------------------------------------------------*/
 
 // Get the number of requests in the worker's request queue. Mainly for load balancing, looking for worker with the least requests in queue.
 bool IPCManager::get_request_queue_size(int worker_idx, int& size) const {
-    if (sem_getvalue(sem_request_items[worker_idx], &size) == -1) {return false;}// sem_getvalue returns -1 on error
+    if (!shared_mem_ptr) return false;
+    const RequestQueue& queue = worker_queue(worker_idx);
+    size = static_cast<int>(queue.head.load() - queue.tail.load());
     return true;
 }
 
-void IPCManager::cancel_request(int worker_idx, uint64_t task_id) {
+// Flag the task for the worker. The slot stays busy until this task's server thread releases it, so the task_id check only guards misuse.
+void IPCManager::cancel_request(int worker_idx, uint32_t slot_idx, uint64_t task_id) {
     if (!shared_mem_ptr) return;
 
-    RequestQueue& queue = shared_mem_ptr->worker_queues[worker_idx];
-    
-    // This is a best-effort cancellation. We search for the task in the queue.
-    // There's a chance the worker has already dequeued it.
-    size_t head = queue.head.load();
-    size_t tail = queue.tail.load();
-
-    for (size_t i = tail; i < head; ++i) {
-        ReqSlot& slot = queue.req[i % RING_CAP_PER_WORKER];
-        if (slot.task_id == task_id) {
-            slot.is_canceled.store(true);
-            break;
-        }
+    ReqSlot& slot = worker_queue(worker_idx).req(slot_idx);
+    if (slot.task_id == task_id) {
+        slot.is_canceled.store(true, std::memory_order_relaxed);
     }
 }
 
-// Signaling that a request has been handled. Worker use this to signal the server that it has finished processing the request. increment sem_req_space.
-void IPCManager::signal_request_handled(int worker_idx) {
-    sem_post(sem_req_space[worker_idx]);
+void IPCManager::abandon_task(int queue_idx, uint32_t ring_pos, uint64_t task_id) {
+    if (!shared_mem_ptr || queue_idx < 0 || queue_idx >= get_max_workers()) return;
+
+    RequestQueue& queue = worker_queue(queue_idx);
+    RespSlot& slot = queue.resp(ring_pos & (queue.capacity - 1));
+    if (slot.published.load() & RESP_STREAM_FINISHED) return;      // the worker got to the end after all
+    uint64_t expected = task_id;
+    // The slot stays busy until its server thread saw the end of the stream, so a matching task_id is still this task
+    if (!slot.task_id.compare_exchange_strong(expected, 0)) return;
+    RequestView request{};
+    request.queue_idx = queue_idx;
+    request.ring_pos = ring_pos;
+    release_request_payload(request);   // marking it released again is harmless
+}
+
+bool IPCManager::is_task_canceled(int queue_idx, uint32_t slot_idx) const {
+    return worker_queue(queue_idx).req(slot_idx).is_canceled.load(std::memory_order_relaxed);
+}
+
+void IPCManager::record_cancellation(int worker_idx) {
+    worker_queue(worker_idx).canceled_tasks.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t IPCManager::get_canceled_count(int worker_idx) const {
+    if (!shared_mem_ptr) return 0;
+    return worker_queue(worker_idx).canceled_tasks.load(std::memory_order_relaxed);
+}
+
+void IPCManager::record_expiry(int worker_idx) {
+    worker_queue(worker_idx).expired_tasks.fetch_add(1, std::memory_order_relaxed);
+}
+
+void IPCManager::record_generated_tokens(int worker_idx, uint32_t tokens) {
+    worker_queue(worker_idx).generated_tokens.fetch_add(tokens, std::memory_order_relaxed);
+}
+
+uint64_t IPCManager::get_expired_count(int worker_idx) const {
+    if (!shared_mem_ptr) return 0;
+    return worker_queue(worker_idx).expired_tasks.load(std::memory_order_relaxed);
+}
+
+uint64_t IPCManager::get_generated_tokens(int worker_idx) const {
+    if (!shared_mem_ptr) return 0;
+    return worker_queue(worker_idx).generated_tokens.load(std::memory_order_relaxed);
 }
 
 // Check if the server has requested a shutdown. Used by worker to check if it should shutdown.
@@ -346,9 +520,14 @@ bool IPCManager::is_shutdown_requested() const {
 void IPCManager::request_shutdown() {
     if (shared_mem_ptr) {
         shared_mem_ptr->shutdown_flag.store(true);   // command the workers to shutdown
-        // Wake up all waiting workers process, 
-        for (int i = 0; i < MAX_WORKERS; ++i) {
-            sem_post(sem_request_items[i]);
+        // Wake up all parked workers and producers, they re-check the flag
+        for (uint32_t i = 0; i < shared_mem_ptr->max_workers; ++i) {
+            RequestQueue& queue = worker_queue(i);
+            queue.head.wake();
+            for (uint32_t j = 0; j < queue.capacity; ++j) {
+                queue.busy(j).wake();
+                queue.resp(j).consumed.wake();
+            }
         }
     }
 }
@@ -357,3 +536,150 @@ uint64_t IPCManager::get_next_task_id() {
     if (!shared_mem_ptr) return 0;
     return shared_mem_ptr->next_task_id.fetch_add(1);
 }
+
+
+#ifdef IPC_BENCHMARK
+#include <semaphore.h>
+#include <sys/wait.h>
+#include <vector>
+
+// Round trip latency of one request and one single chunk response between the server and a forked worker process:
+// the futex rings above against the semaphore handshake they replaced (named sem_req_space / sem_request_items plus
+// process shared ready / consumed semaphores per response channel). Uses the default SHM_NAME, so stop the server first.
+
+constexpr size_t LEGACY_CHUNK_SIZE = 4096;
+
+// The replaced protocol, one request ring slot and one response channel
+struct LegacyChannel {
+    uint32_t req_len;
+    char req[LEGACY_CHUNK_SIZE];
+    sem_t ready;
+    sem_t consumed;
+    uint32_t resp_len;
+    char resp[LEGACY_CHUNK_SIZE];
+};
+
+static void print_latency(const char* name, std::vector<double>& samples_us) {
+    std::sort(samples_us.begin(), samples_us.end());
+    double sum = 0.0;
+    for (double s : samples_us) sum += s;
+    auto percentile = [&](double p) { return samples_us[static_cast<size_t>(p * (samples_us.size() - 1))]; };
+    std::cout << name << ": mean " << sum / samples_us.size() << " us, p50 " << percentile(0.50)
+              << " us, p99 " << percentile(0.99) << " us, max " << samples_us.back() << " us" << std::endl;
+}
+
+static std::vector<double> bench_legacy(int iterations, const std::string& message, const std::string& reply) {
+    const char* items_name = "/ipc_bench_req_items";
+    const char* space_name = "/ipc_bench_req_space";
+    sem_unlink(items_name);
+    sem_unlink(space_name);
+    sem_t* items = sem_open(items_name, O_CREAT | O_EXCL, 0666, 0);
+    sem_t* space = sem_open(space_name, O_CREAT | O_EXCL, 0666, DEFAULT_QUEUE_DEPTH);
+    auto* channel = static_cast<LegacyChannel*>(mmap(nullptr, sizeof(LegacyChannel), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+    if (items == SEM_FAILED || space == SEM_FAILED || channel == MAP_FAILED) {
+        std::cerr << "legacy setup failed: " << strerror(errno) << std::endl;
+        return {};
+    }
+    sem_init(&channel->ready, 1, 0);
+    sem_init(&channel->consumed, 1, 1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        char request[LEGACY_CHUNK_SIZE];
+        for (int i = 0; i < iterations; ++i) {
+            sem_wait(items);
+            std::memcpy(request, channel->req, channel->req_len);
+            sem_wait(&channel->consumed);
+            channel->resp_len = static_cast<uint32_t>(reply.size());
+            std::memcpy(channel->resp, reply.data(), reply.size());
+            sem_post(&channel->ready);
+        }
+        _exit(0);
+    }
+
+    std::vector<double> samples_us;
+    samples_us.reserve(iterations);
+    std::string chunk;
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        sem_wait(space);
+        channel->req_len = static_cast<uint32_t>(message.size());
+        std::memcpy(channel->req, message.data(), message.size());
+        sem_post(items);
+        sem_wait(&channel->ready);
+        chunk.assign(channel->resp, channel->resp_len);
+        sem_post(&channel->consumed);
+        sem_post(space);
+        samples_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    waitpid(pid, nullptr, 0);
+
+    sem_destroy(&channel->ready);
+    sem_destroy(&channel->consumed);
+    munmap(channel, sizeof(LegacyChannel));
+    sem_close(items);
+    sem_close(space);
+    sem_unlink(items_name);
+    sem_unlink(space_name);
+    return samples_us;
+}
+
+static std::vector<double> bench_futex(int iterations, const std::string& message, const std::string& reply) {
+    IPCManager server(true);
+    if (!server.initialize()) return {};
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        IPCManager worker(false, 0);
+        if (!worker.initialize()) _exit(1);
+        RequestView request;
+        uint32_t slot_idx;
+        while (!worker.is_shutdown_requested()) {
+            if (worker.dequeue_request(0, request, slot_idx)) {
+                worker.release_request_payload(request);
+                worker.send_response_chunk(0, slot_idx, request.task_id, reply, true);
+            }
+        }
+        _exit(0);
+    }
+
+    std::vector<double> samples_us;
+    samples_us.reserve(iterations);
+    std::string chunk;
+    bool is_last = false, client_disconnected = false;
+    auto no_callback = [](const std::string&) { return true; };
+    for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t task_id;
+        uint32_t slot_idx;
+        if (!server.enqueue_request(0, {}, message, task_id, slot_idx) ||
+            !server.wait_for_response_chunk(0, slot_idx, task_id, chunk, is_last, no_callback, client_disconnected)) {
+            std::cerr << "futex round trip " << i << " failed" << std::endl;
+            break;
+        }
+        server.release_request_slot(0, slot_idx);
+        samples_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+    server.request_shutdown();
+    waitpid(pid, nullptr, 0);
+    return samples_us;
+}
+
+// usage: ipc_bench [iterations]
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::max(1, std::atoi(argv[1])) : 20000;
+    const std::string message = "50\x01Once upon a time, there was a little girl named Lily. She loved to play outside.";
+    const std::string reply = " lily";
+
+    std::cout << "IPC round trip, " << iterations << " iterations, " << message.size() << " B request, "
+              << reply.size() << " B response, " << std::thread::hardware_concurrency() << " CPUs" << std::endl;
+
+    std::vector<double> legacy = bench_legacy(iterations, message, reply);
+    std::vector<double> futex = bench_futex(iterations, message, reply);
+    if (legacy.empty() || futex.empty()) return 1;
+
+    print_latency("semaphores ", legacy);
+    print_latency("futex rings", futex);
+    return 0;
+}
+#endif
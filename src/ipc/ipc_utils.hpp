@@ -2,58 +2,121 @@
 
 #include "shared_mem.hpp"
 #include <string>
+#include <string_view>
 #include <functional>
+#include <memory>
+#include <mutex>
 
-#include <semaphore.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-// IPC Manager class for handling shared memory and semaphores
+// A request as the worker sees it after dequeue_request. payload points into the payload arena of queue_idx and stays valid
+// until release_request_payload.
+struct RequestView {
+    uint64_t task_id;
+    PayloadKind kind;
+    bool is_canceled;
+    uint64_t deadline_ns;       // steady_clock, 0 = none
+    uint64_t arrival_ns;        // steady_clock time the request reached the server, 0 = unknown
+    bool traced;                // record the task's spans in the worker's TraceRing
+    uint64_t enqueued_ns;       // steady_clock time of the enqueue, traced tasks only
+    std::string_view payload;
+    int queue_idx;              // ring the request was claimed from, another worker's when it was stolen. Answer on this ring
+    uint32_t ring_pos;          // position claimed in that ring
+};
+
+// IPC Manager class for handling shared memory and the futex based rings inside it
 class IPCManager {
 private:
     SharedMem* shared_mem_ptr;
+    size_t shared_mem_size;     // bytes mapped, SharedMem::total_size once initialized
     int shared_mem_file_descriptor;
     
-    // Semaphores, auto increment by sem_post, auto decrement by sem_wait.
-    sem_t* sem_request_items[MAX_WORKERS]; // Counts tasks in the queue. Acting as the counter for the number of requests in the queue. decrement by worker, increment by server.
-    sem_t* sem_req_space[MAX_WORKERS]; // Counts empty slots in the queue. Counting down from RING_CAP_PER_WORKER to 0.
-    sem_t* sem_resp[MAX_WORKERS];      // Counts responses from the worker.
-    sem_t* sem_resp_consumed[MAX_WORKERS]; // Counts consumed response chunks.
+    // Server side only: connection threads enqueueing to the same worker take turns, so each request ring has a single producer.
+    std::unique_ptr<std::mutex[]> enqueue_mutex;
     
     bool is_server;
     int worker_index; // Only used by worker
+    int response_notify_fd;   // Only used by worker: eventfd the server's response pump listens on, -1 when none
 
 public:
     IPCManager(bool server = true, int worker_idx = -1);
     ~IPCManager();
     
-    // Initialize shared memory and semaphores
+    // Initialize shared memory. The server sizes it from MAX_WORKERS_DYNAMIC and QUEUE_DEPTH in config.txt,
+    // a worker maps whatever the server's header describes.
     bool initialize();
         
     // Server operations
-    // Enqueue a request for a specific worker
-    bool enqueue_request(int worker_idx, const std::string& message, uint64_t& task_id);
+    // Enqueue a request for a specific worker. The payload is header followed by body, copied once into the worker's payload arena.
+    // slot_idx receives the queue slot, whose response stream carries this task's chunks. A worker dequeuing the task after
+    // deadline_ns (steady_clock, 0 = none) drops it without generating. arrival_ns is when the request reached the server.
+    bool enqueue_request(int worker_idx, std::string_view header, std::string_view body, uint64_t& task_id, uint32_t& slot_idx,
+                         PayloadKind kind = PayloadKind::Text, uint64_t deadline_ns = 0, uint64_t arrival_ns = 0, bool traced = false);
     
-    // Wait for a response chunk from a specific worker
-    bool wait_for_response_chunk(int worker_idx, uint64_t task_id, std::string& chunk, bool& is_last, const std::function<bool(const std::string&)>& on_timeout_callback, bool& client_disconnected);
+    // Zero-copy read of the stream of slot_idx: points parts at everything published since the last consume, two pieces
+    // when the ring wraps. The bytes stay put until consume_response_chunk(end). ready is false when nothing new was published.
+    // Returns false when the stream does not belong to task_id.
+    bool peek_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, struct iovec parts[2], int& part_count, uint32_t& end, bool& is_last, bool& ready);
+    void consume_response_chunk(int worker_idx, uint32_t slot_idx, uint32_t end);
+
+    // Copying variant of peek_response_chunk + consume_response_chunk. ready is false when nothing new
+    // was published. Returns false when the stream does not belong to task_id.
+    bool try_read_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, std::string& chunk, bool& is_last, bool& ready);
+
+    // Blocking variant of try_read_response_chunk, parks on the stream until the worker publishes.
+    bool wait_for_response_chunk(int worker_idx, uint32_t slot_idx, uint64_t task_id, std::string& chunk, bool& is_last, const std::function<bool(const std::string&)>& on_timeout_callback, bool& client_disconnected);
+
+    // Give the queue slot (and its response stream) back once the final chunk was consumed
+    void release_request_slot(int worker_idx, uint32_t slot_idx);
     
+    // Response pump: arm before scanning the streams and sleeping in epoll_wait, disarm once awake
+    void arm_response_notify(bool armed);
+
     // Get the current size of a worker's request queue
     bool get_request_queue_size(int worker_idx, int& size) const;
 
-    // Cancel a request
-    void cancel_request(int worker_idx, uint64_t task_id);
+    // Cancel the task in slot_idx, queued or mid-generation. The worker still ends its stream, within one decode step.
+    void cancel_request(int worker_idx, uint32_t slot_idx, uint64_t task_id);
+
+    // Number of tasks the worker aborted because of cancel_request
+    uint64_t get_canceled_count(int worker_idx) const;
+    // Number of tasks the worker dropped past their deadline, and tokens it generated
+    uint64_t get_expired_count(int worker_idx) const;
+    uint64_t get_generated_tokens(int worker_idx) const;
+    // Latency histograms of a worker, recorded by the worker itself (single writer) and read by the server
+    WorkerMetrics& worker_metrics(int worker_idx) const { return worker_queue(worker_idx).metrics; }
+    // Live state of a worker, kept by the worker itself, see WorkerTelemetry
+    WorkerTelemetry& worker_telemetry(int worker_idx) const { return worker_queue(worker_idx).telemetry; }
+    TraceRing& worker_trace(int worker_idx) const { return worker_queue(worker_idx).trace; }
+    // Once the worker running it is gone (killed or crashed): free the task's payload if it still holds it and detach its
+    // response stream, so the task's server thread finishes it as broken and releases the slot.
+    void abandon_task(int queue_idx, uint32_t ring_pos, uint64_t task_id);
 
     // Worker operations
-    // Dequeue a request for this worker
-    bool dequeue_request(int worker_idx, ReqSlot& slot);
+    // Dequeue a request for this worker: the oldest of its own ring, or else the oldest waiting behind another (busy) worker.
+    // slot_idx receives the slot of request.queue_idx to answer on. The payload is read in place.
+    bool dequeue_request(int worker_idx, RequestView& request, uint32_t& slot_idx);
+
+    // Free the payload of a dequeued request as soon as it is no longer read, the producer of its ring may be waiting for arena space
+    void release_request_payload(const RequestView& request);
+
+    // Polled by the worker between decode steps. record_cancellation counts a task it abandoned.
+    bool is_task_canceled(int queue_idx, uint32_t slot_idx) const;
+    void record_cancellation(int worker_idx);
+    // Worker statistics, counted on the worker's own ring whichever ring the task came from
+    void record_expiry(int worker_idx);
+    void record_generated_tokens(int worker_idx, uint32_t tokens);
     
-    // Send a response chunk from this worker
-    bool send_response_chunk(int worker_idx, uint64_t task_id, const std::string& chunk, bool is_last);
+    // Worker side: eventfd to signal the response pump with, handed over at spawn
+    void set_response_notify_fd(int fd) { response_notify_fd = fd; }
 
-    // Signal that the worker has finished handling a request
-    void signal_request_handled(int worker_idx);
+    // Append a response piece to the stream of slot_idx in ring queue_idx without waiting for the server, published per the flush policy,
+    // or right away with publish_now. Every dequeued task must end with is_last.
+    bool send_response_chunk(int queue_idx, uint32_t slot_idx, uint64_t task_id, std::string_view chunk, bool is_last, bool publish_now = false);
     
     // Utility functions
     bool is_shutdown_requested() const;
@@ -62,4 +125,16 @@ public:
     
     // Getters
     SharedMem* get_shared_mem() const { return shared_mem_ptr; }
+    int get_max_workers() const { return shared_mem_ptr ? static_cast<int>(shared_mem_ptr->max_workers) : 0; }
+
+private:
+    RequestQueue& worker_queue(int worker_idx) const { return shared_mem_ptr->worker_queue(worker_idx); }
+
+    // Work stealing helpers: claim the oldest request of a ring, and pick the ring with the longest backlog besides our own
+    bool claim_request(int queue_idx, RequestView& request, uint32_t& slot_idx);
+    int find_steal_victim(int worker_idx) const;
+    void wake_idle_worker(int busy_worker_idx);
+
+    // Signal the response pump after publishing, only if it armed the notification
+    void notify_response_ready();
 };
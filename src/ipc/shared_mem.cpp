@@ -1,27 +1,107 @@
 #include "shared_mem.hpp"
 #include "../utils/config.hpp"
+#include <new>
 
 const char* get_shm_name() {
     static const std::string name = AppConfig::get_instance().get_string("SHM_NAME", "/inference_shm");
     return name.c_str();
 }
 
-const char* get_sem_req_items_prefix() {
-    static const std::string name = AppConfig::get_instance().get_string("SEM_REQ_ITEMS_PREFIX", "/sem_req_items_");
-    return name.c_str();
+void WorkerTelemetry::reset(WorkerState new_state, uint32_t new_pid, uint64_t now_ns) {
+    heartbeat_ns.store(now_ns, std::memory_order_relaxed);
+    started_ns.store(now_ns, std::memory_order_relaxed);
+    task_id.store(0, std::memory_order_relaxed);
+    step_ns_avg.store(0, std::memory_order_relaxed);
+    rss_bytes.store(0, std::memory_order_relaxed);
+    pid.store(new_pid, std::memory_order_relaxed);
+    tasks_done.store(0, std::memory_order_relaxed);
+    sequence_length.store(0, std::memory_order_relaxed);
+    batch_size.store(0, std::memory_order_relaxed);
+    task_queue.store(-1, std::memory_order_relaxed);
+    task_ring_pos.store(0, std::memory_order_relaxed);
+    state.store(static_cast<uint32_t>(new_state), std::memory_order_release);
 }
 
-const char* get_sem_req_space_prefix() {
-    static const std::string name = AppConfig::get_instance().get_string("SEM_REQ_SPACE_PREFIX", "/sem_req_space_");
-    return name.c_str();
+RequestQueue::RequestQueue(uint32_t slots) : capacity(slots), arena_head(0), release_lock(0), canceled_tasks(0), expired_tasks(0), generated_tokens(0) {
+    metrics.reset();
+    telemetry.reset(WorkerState::Offline, 0, 0);
+    trace.reset();
+    for (uint32_t i = 0; i < capacity; ++i) {
+        new (&busy(i)) FutexCounter();
+        new (&req(i)) ReqSlot();
+        new (&resp(i)) RespSlot();
+    }
 }
 
-const char* get_sem_resp_prefix() {
-    static const std::string name = AppConfig::get_instance().get_string("SEM_RESP_PREFIX", "/sem_resp_");
-    return name.c_str();
+SharedMem::SharedMem(uint32_t workers, uint32_t slots)
+    : magic(0), version(SHM_LAYOUT_VERSION), max_workers(workers), ring_capacity(slots),
+      queue_stride(RequestQueue::stride(slots)), total_size(size_for(workers, slots)),
+      huge_pages(0), shutdown_flag(false), resp_flush_tokens(1), resp_flush_interval_us(0), next_task_id(1), response_notify_armed(0) {
+    for (uint32_t i = 0; i < max_workers; ++i) {
+        new (&worker_queue(i)) RequestQueue(slots);
+    }
 }
 
-const char* get_sem_resp_consumed_prefix() {
-    static const std::string name = AppConfig::get_instance().get_string("SEM_RESP_CONSUMED_PREFIX", "/sem_resp_consumed_");
-    return name.c_str();
+
+#ifdef SHM_LAYOUT_BENCHMARK
+// False sharing benchmark for the layout rule in shared_mem.hpp. Two processes share a MAP_SHARED page and each stores
+// to its own counter, once with both counters in one cache line (how head/tail and task_id/write_pos used to sit) and
+// once with a line each, as FutexCounter and the alignas'd fields now do. The gap only shows when both processes run
+// at the same time, i.e. on more than one CPU.
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct PackedCounters {
+    std::atomic<uint32_t> server;
+    std::atomic<uint32_t> worker;
+};
+
+struct PaddedCounters {
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> server;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> worker;
+};
+
+// ns per store, both processes storing concurrently
+template <typename Counters>
+static double bench_counters(uint32_t iterations) {
+    void* mem = mmap(nullptr, sizeof(Counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        std::cerr << "mmap failed" << std::endl;
+        std::exit(1);
+    }
+    Counters* counters = new (mem) Counters();
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (uint32_t i = 0; i < iterations; ++i) counters->worker.store(i, std::memory_order_release);
+        _exit(0);
+    }
+    for (uint32_t i = 0; i < iterations; ++i) counters->server.store(i, std::memory_order_release);
+    waitpid(pid, nullptr, 0);
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    munmap(mem, sizeof(Counters));
+    return elapsed / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t iterations = argc > 1 ? static_cast<uint32_t>(std::strtoul(argv[1], nullptr, 10)) : 100000000u;
+
+    std::cout << "ReqSlot " << sizeof(ReqSlot) << " B, RespSlot " << sizeof(RespSlot) << " B (data at +" << offsetof(RespSlot, data)
+              << "), RequestQueue header " << sizeof(RequestQueue) << " B, SharedMem header " << sizeof(SharedMem) << " B" << std::endl;
+    std::cout << "Online CPUs: " << sysconf(_SC_NPROCESSORS_ONLN) << ", " << iterations << " stores per process" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (int round = 0; round < 3; ++round) {
+        double packed = bench_counters<PackedCounters>(iterations);
+        double padded = bench_counters<PaddedCounters>(iterations);
+        std::cout << "same line: " << packed << " ns/store, own lines: " << padded << " ns/store, ratio " << packed / padded << std::endl;
+    }
+    return 0;
 }
+#endif
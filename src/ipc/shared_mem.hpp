@@ -3,70 +3,231 @@
 #include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include "futex_sync.hpp"
 #include "../utils/config.hpp"
+#include "../utils/metrics.hpp"
+#include "../utils/trace.hpp"
 
-// Configuration constants
-constexpr size_t CHUNK_SIZE = 4096;        // Maximum message size
-constexpr size_t MAX_WORKERS = 5;          // Maximum number of worker processes.
-constexpr size_t RING_CAP_PER_WORKER = 32; // Capacity of each worker's request queue, MUST be a power of 2
+// Configuration constants. Worker count and queue depth are runtime sizes, see SharedMem.
+constexpr uint32_t DEFAULT_MAX_WORKERS = 4;     // MAX_WORKERS_DYNAMIC when config.txt does not set it
+constexpr uint32_t DEFAULT_QUEUE_DEPTH = 32;    // QUEUE_DEPTH (slots per worker ring) when config.txt does not set it
+constexpr size_t PAYLOAD_ARENA_SIZE = 64 * 1024;            // Request payload bytes per worker, MUST be a power of 2
+constexpr size_t MAX_PAYLOAD_SIZE = PAYLOAD_ARENA_SIZE / 2; // Largest single payload, at most half the arena so it always fits once the arena drains
+constexpr size_t PAYLOAD_ALIGN = 8;                         // Payloads start aligned, token ids are read in place as int32_t
 
 // Shared memory object names
 const char* get_shm_name();
-const char* get_sem_req_items_prefix();
-const char* get_sem_req_space_prefix();
-const char* get_sem_resp_prefix();
-const char* get_sem_resp_consumed_prefix();
 
+// Header identification, a worker refuses a mapping written by a server with a different layout
+constexpr uint32_t SHM_MAGIC = 0x4D4C4C54;      // "TLLM"
+constexpr uint32_t SHM_LAYOUT_VERSION = 9;      // bump on any change to the structures in this file
 
-// Request slot structure,
-struct ReqSlot {
-    std::atomic<bool> is_canceled;  // flag in case of request cancellation (e.g. client disconnect). as signal for worker to pass this ReqSlot inside the ring buffer
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;  // with HUGE_PAGES=1 the mapping is rounded up to this and advised for transparent huge pages
+
+// Layout rule for everything below: fields written by different processes never share a cache line. Producer (server)
+// owned, consumer (worker) owned and read-mostly fields each get their own line, and bulk data starts on a fresh one.
+
+constexpr size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+
+// Format of a request payload
+enum class PayloadKind : uint32_t {
+    Text = 0,       // "max_tokens\x01prompt", the worker tokenizes the prompt
+    Tokens = 1,     // TokenPayloadHeader followed by n_tokens int32_t prompt ids, already tokenized by the server
+    Batch = 2,      // BatchPayloadHeader, n_items BatchPayloadItem, then the prompts as text, one task for several prompts
+};
+
+// Header of a PayloadKind::Tokens request, generation parameters first so the layout can grow at the end.
+struct TokenPayloadHeader {
+    uint32_t max_tokens;
+    uint32_t n_tokens;
+};
+
+constexpr size_t MAX_PAYLOAD_TOKENS = (MAX_PAYLOAD_SIZE - sizeof(TokenPayloadHeader)) / sizeof(int32_t);   // prompt ids that fit in one payload
+
+// Header of a PayloadKind::Batch request. The worker generates its prompts side by side and answers with one NDJSON line per
+// prompt (HttpUtils::append_batch_result_line), in the order they finish.
+struct BatchPayloadHeader {
+    uint32_t n_items;
+};
+
+struct BatchPayloadItem {
+    uint32_t index;             // position in the client's request, echoed in the prompt's line
+    uint32_t max_tokens;
+    uint32_t prompt_offset;     // from the start of the payload
+    uint32_t prompt_length;
+};
+
+constexpr uint32_t MAX_BATCH_TASK_ITEMS = 64;     // prompts in one batch task
+
+// Request slot structure, the payload itself lives in the worker's payload arena.
+// One cache line per slot: the server fills the next slot while the worker polls is_canceled of the one it runs.
+struct alignas(CACHE_LINE_SIZE) ReqSlot {
+    std::atomic<bool> is_canceled;  // set by the server when the client disconnects, the worker checks it before every decode step and ends the task
+    bool traced;                // sampled for tracing, the worker records its spans in RequestQueue::trace
     uint64_t task_id;           // Unique task, identifier, unique per client / thread that execute it
-    uint32_t len;               // Message length
-    char data[CHUNK_SIZE];      // Message data, this is client's prompt
-    ReqSlot() : task_id(0), len(0), is_canceled(false) {
-        data[0] = '\0';        // treat the data as empty null-terminated string
-    }
+    PayloadKind kind;           // How to read the payload
+    uint32_t len;               // Payload length
+    uint32_t payload_offset;    // Start of the payload in RequestQueue::arena()
+    uint32_t payload_end;       // Arena position just past the payload, the arena tail moves here once the payload is freed
+    uint64_t deadline_ns;       // steady_clock time after which the task is dropped instead of started, 0 = none
+    uint64_t arrival_ns;        // steady_clock time the request reached the server, for the time to first token. 0 = unknown
+    uint64_t enqueued_ns;       // steady_clock time the slot was published, traced tasks only
+    std::atomic<uint32_t> released_pos;     // ring position + 1 once the worker that claimed the task is done reading the payload
+    ReqSlot() : is_canceled(false), traced(false), task_id(0), kind(PayloadKind::Text), len(0), payload_offset(0), payload_end(0), deadline_ns(0),
+                arrival_ns(0), enqueued_ns(0), released_pos(0) {}
 };
 
-// written by worker, read by client
+constexpr size_t RESP_STREAM_SIZE = 1024;                 // Bytes in each response stream ring, MUST be a power of 2
+constexpr uint32_t RESP_STREAM_FINISHED = 0x80000000u;    // Set in RespSlot::published together with the final bytes
+
+// Response stream of one in-flight task, written by worker, read by the server thread that owns the task.
+// Single producer / single consumer byte ring: the worker appends decoded pieces without waiting for the server and
+// publishes them per the flush policy in SharedMem, the server thread drains everything published so far as one chunk.
+// The counters count bytes of the current task, the server resets the whole slot when it enqueues a task into it.
 struct RespSlot {
-    std::atomic<uint64_t> task_id;
-    uint32_t len;               // Chunk length
-    char data[CHUNK_SIZE];      // Result data, written by worker, response token chunks
-    bool is_last_piece;         // True if this is the last piece of the result
+    FutexCounter published;     // Bytes visible to the server, | RESP_STREAM_FINISHED after the last piece. The server thread parks on it
+    FutexCounter consumed;      // Bytes drained by the server thread. The worker parks on it only while the ring is full
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> task_id;  // Task owning the stream, set at enqueue, read by both sides
+
+    // Worker private, written for every piece
+    alignas(CACHE_LINE_SIZE) uint32_t write_pos;    // Bytes appended, published or not
+    uint32_t unflushed_pieces;  // Pieces appended since the last publish
+    uint64_t last_flush_ns;     // steady_clock time of the last publish, 0 so the first piece of a task goes out at once
+
+    alignas(CACHE_LINE_SIZE) char data[RESP_STREAM_SIZE];
     
-    RespSlot() : task_id(0), len(0), is_last_piece(false) {
-        data[0] = '\0'; // treat the data as empty null-terminated string
+    RespSlot() : task_id(0), write_pos(0), unflushed_pieces(0), last_flush_ns(0) {}
+};
+
+// Latency histograms of one worker, written by that worker only (HistogramCounters::record_single_writer) and read by
+// the server for /metrics. Microseconds unless noted.
+struct WorkerMetrics {
+    HistogramCounters time_to_first_token;  // from arrival at the server to the first generated token sent
+    HistogramCounters prefill;              // from dequeue to the first token computed (tokenizing and the prompt's forward pass)
+    HistogramCounters inter_token;          // between consecutive decode steps of a task
+    HistogramCounters tokens_generated;     // tokens per finished request, TOKEN_COUNT_BOUNDS
+
+    void reset() {
+        time_to_first_token.reset();
+        prefill.reset();
+        inter_token.reset();
+        tokens_generated.reset();
     }
 };
 
-// A request queue for a single worker
+// What a worker is doing, WorkerTelemetry::state
+enum class WorkerState : uint32_t {
+    Offline = 0,    // no process in this slot
+    Starting = 1,   // spawned, loading the model
+    Idle = 2,       // parked on its ring
+    Prefill = 3,    // dequeued a task, tokenizing and running the prompt
+    Decode = 4,     // generating
+    OutputWait = 5, // response stream full, waiting for the server to drain it (a slow client, not a stall)
+};
+
+// Live state of one worker, written by that worker with relaxed stores (a handful per decode step, never a read-modify-write
+// on a line another process writes) and read at any time by the server and tinyllm-top. The server writes it only while no
+// process runs in the slot, at spawn and after terminating it. steady_clock is CLOCK_MONOTONIC, the same in every process.
+struct WorkerTelemetry {
+    std::atomic<uint64_t> heartbeat_ns;     // last state change or decode step. Stale while Prefill/Decode means the worker hangs
+    std::atomic<uint64_t> started_ns;       // spawn time
+    std::atomic<uint64_t> task_id;          // task being run, 0 when none
+    std::atomic<uint64_t> step_ns_avg;      // moving average of a decode step, the worker's tokens/s is 1e9 over it
+    std::atomic<uint64_t> rss_bytes;        // resident set, sampled at most once a second
+    std::atomic<uint32_t> pid;
+    std::atomic<uint32_t> state;            // WorkerState
+    std::atomic<uint32_t> tasks_done;
+    std::atomic<uint16_t> sequence_length;  // tokens in the model context of the task (the longest one of a batch)
+    std::atomic<uint16_t> batch_size;       // sequences in the current forward pass
+    std::atomic<int32_t> task_queue;        // ring the task was claimed from, with task_ring_pos: lets the server end it if the worker dies
+    std::atomic<uint32_t> task_ring_pos;
+
+    void reset(WorkerState new_state, uint32_t new_pid, uint64_t now_ns);
+};
+
+// Lock-free request ring of a single worker. The server serializes its connection threads per worker before touching head,
+// so there is exactly one producer. Consumers claim positions by CAS on tail: the owning worker, or an idle worker stealing
+// the oldest request when the owner is stuck in a long generation.
+// head and tail are free running, wrapping is fine as capacity is a power of 2 and so divides 2^32.
+// The slot arrays and the payload arena are sized at startup and laid out right behind this header:
+//   busy[capacity] | req[capacity] | resp[capacity] | arena[PAYLOAD_ARENA_SIZE], each cache line aligned.
 struct RequestQueue {
-    ReqSlot req[RING_CAP_PER_WORKER];   // ring buffer
-    std::atomic<size_t> head; // written by server, tracking the next position to write, loop back with % RING_CAP_PER_WORKER
-    std::atomic<size_t> tail; // written by worker, tracking the next position to read, loop back with % RING_CAP_PER_WORKER
+    FutexCounter head;      // written by server, the next position to write. The worker parks on it while the ring is empty
+    FutexCounter tail;      // next position to claim, advanced by CAS from any worker
+    FutexCounter arena_tail;        // arena bytes freed. The producer parks on it while the arena is full
+    FutexCounter payload_freed;     // ring position up to which payloads are freed, a slot is only reused behind it
+    alignas(CACHE_LINE_SIZE) uint32_t capacity;     // slots in the ring, a power of 2. Read-only after construction
+    alignas(CACHE_LINE_SIZE) uint32_t arena_head;   // written by server only, arena bytes allocated
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> release_lock;   // held by the worker moving arena_tail and payload_freed, never waited on
+    std::atomic<uint64_t> canceled_tasks;   // tasks this worker aborted or skipped because their client went away
+    std::atomic<uint64_t> expired_tasks;    // tasks this worker dropped because their deadline passed before they started
+    std::atomic<uint64_t> generated_tokens; // tokens this worker generated, the server derives its throughput from it
+    alignas(CACHE_LINE_SIZE) WorkerMetrics metrics;     // written by this worker for every token
+    alignas(CACHE_LINE_SIZE) WorkerTelemetry telemetry; // written by this worker on every decode step
+    alignas(CACHE_LINE_SIZE) TraceRing trace;           // spans of the traced tasks this worker ran, kept across its restarts
+
+    explicit RequestQueue(uint32_t slots);
+
+    // busy(i) is 1 from enqueue until the server thread drained the response, the producer parks on it while the ring is full
+    FutexCounter& busy(uint32_t i) { return reinterpret_cast<FutexCounter*>(base() + busy_offset())[i]; }
+    ReqSlot& req(uint32_t i) { return reinterpret_cast<ReqSlot*>(base() + req_offset(capacity))[i]; }
+    // resp(i) is the response stream of the task in req(i), only its server thread waits on it
+    RespSlot& resp(uint32_t i) { return reinterpret_cast<RespSlot*>(base() + resp_offset(capacity))[i]; }
+    // Payload arena, a byte ring allocated by the server in enqueue order and freed in the same order, see release_request_payload.
+    // A payload never wraps: when it does not fit before the end, the rest of the ring is skipped.
+    char* arena() { return base() + arena_offset(capacity); }
+
+    static size_t busy_offset() { return align_up(sizeof(RequestQueue), CACHE_LINE_SIZE); }
+    static size_t req_offset(uint32_t slots) { return align_up(busy_offset() + slots * sizeof(FutexCounter), CACHE_LINE_SIZE); }
+    static size_t resp_offset(uint32_t slots) { return align_up(req_offset(slots) + slots * sizeof(ReqSlot), CACHE_LINE_SIZE); }
+    static size_t arena_offset(uint32_t slots) { return align_up(resp_offset(slots) + slots * sizeof(RespSlot), CACHE_LINE_SIZE); }
+    static size_t stride(uint32_t slots) { return align_up(arena_offset(slots) + PAYLOAD_ARENA_SIZE, CACHE_LINE_SIZE); }
+
+private:
+    char* base() { return reinterpret_cast<char*>(this); }
 };
 
-// Main shared memory structure
+// Main shared memory structure, a versioned header followed by max_workers RequestQueue blocks of queue_stride bytes.
+// Written once by the server at startup, workers validate it and map total_size bytes.
 struct SharedMem {
-    // Per-worker request queues
-    RequestQueue worker_queues[MAX_WORKERS];
-
-    // Response slots - one for each worker
-    RespSlot resp_slots[MAX_WORKERS];
-    
-    // Global state
-    std::atomic<uint64_t> next_task_id;
+    // Read-mostly: written before the workers start (shutdown_flag once more at the end), read on every decode step
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_workers;           // number of worker queues
+    uint32_t ring_capacity;         // slots per worker queue
+    uint64_t queue_stride;          // bytes per worker queue, including its arrays and arena
+    uint64_t total_size;            // bytes of the whole mapping
+    uint32_t huge_pages;            // HUGE_PAGES, the workers advise their mapping too
     std::atomic<bool> shutdown_flag;
 
-    SharedMem() : next_task_id(1), shutdown_flag(false) {
-        for (int i = 0; i < MAX_WORKERS; ++i) {
-            worker_queues[i].head.store(0);
-            worker_queues[i].tail.store(0);
-        }
+    // Response flush policy, written by the server before any worker starts. A worker publishes its stream after
+    // resp_flush_tokens pieces, or on the first piece once resp_flush_interval_us passed since the last publish (0 = off).
+    uint32_t resp_flush_tokens;
+    uint32_t resp_flush_interval_us;
+
+    // Server only, bumped for every request
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> next_task_id;
+
+    // Set by the server's response pump while it is about to sleep in epoll_wait. Only then does a worker write its
+    // eventfd after publishing, a busy pump picks the bytes up on its next scan without any syscall on the worker side.
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> response_notify_armed;
+
+    SharedMem(uint32_t workers, uint32_t slots);
+
+    // Per-worker request queues, each with one response stream per queue slot
+    RequestQueue& worker_queue(int worker_idx) {
+        return *reinterpret_cast<RequestQueue*>(reinterpret_cast<char*>(this) + queues_offset() + worker_idx * queue_stride);
     }
+
+    static size_t queues_offset() { return align_up(sizeof(SharedMem), CACHE_LINE_SIZE); }
+    static size_t size_for(uint32_t workers, uint32_t slots) { return queues_offset() + workers * RequestQueue::stride(slots); }
 };
 
-// Calculate total shared memory size
-constexpr size_t SHARED_MEM_SIZE = sizeof(SharedMem);
+static_assert(sizeof(WorkerTelemetry) <= CACHE_LINE_SIZE, "worker telemetry must fit the single line its worker writes");
+static_assert(sizeof(ReqSlot) == CACHE_LINE_SIZE, "a request slot must fill exactly one cache line");
+static_assert(offsetof(RespSlot, data) % CACHE_LINE_SIZE == 0, "response bytes must not share a line with the stream counters");
+static_assert(offsetof(RequestQueue, arena_head) / CACHE_LINE_SIZE != offsetof(RequestQueue, release_lock) / CACHE_LINE_SIZE,
+              "producer and consumer fields of a queue must live on different lines");
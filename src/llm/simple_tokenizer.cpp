@@ -5,8 +5,11 @@
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
+#include <array>
+#include <cstdint>
 #include "simple_tokenizer.hpp"
 
 
@@ -30,91 +33,177 @@ std::string unescape_json_string(const std::string& s) {
     return res;
 }
 
-std::string HybridTokenizer::to_lower(const std::string& str) {
-    std::string s = str;
-    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
-    return s;
+namespace {
+
+// Byte classes for the encode scanner. Mirrors the training-time python tokenizer: whitespace as
+// understood by `stream >> word`, and the punctuation set [.,!?;:"'-()[]{}] which is split out as its own token.
+enum : uint8_t {
+    BYTE_SPACE   = 1 << 0,
+    BYTE_PUNCT   = 1 << 1,
+    BYTE_REWRITE = 1 << 2,  // word byte that changes under normalization: 'A'-'Z' and the '<' that can open <|endoftext|>
+};
+
+constexpr std::array<uint8_t, 256> make_byte_class_table() {
+    std::array<uint8_t, 256> table{};
+    for (const char* c = " \t\n\v\f\r"; *c; ++c) table[static_cast<unsigned char>(*c)] = BYTE_SPACE;
+    for (const char* c = ".,!?;:\"'-()[]{}"; *c; ++c) table[static_cast<unsigned char>(*c)] = BYTE_PUNCT;
+    for (int c = 'A'; c <= 'Z'; ++c) table[c] = BYTE_REWRITE;
+    table['<'] = BYTE_REWRITE;
+    return table;
+}
+
+constexpr std::array<uint8_t, 256> byte_class = make_byte_class_table();
+
+constexpr std::string_view endoftext_marker = "<|endoftext|>";
+
+inline char ascii_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
 }
 
-std::string HybridTokenizer::replace(const std::string& str, const std::string& from, const std::string& to) {
-    std::string result = str;
-    size_t pos = 0;
-    while ((pos = result.find(from, pos)) != std::string::npos) {
-        result.replace(pos, from.length(), to);
-        pos += to.length();
+// Case-insensitive prefix test, equivalent to searching for the marker after lowercasing the whole text.
+inline bool starts_with_endoftext(std::string_view s) {
+    if (s.size() < endoftext_marker.size()) return false;
+    for (size_t k = 0; k < endoftext_marker.size(); ++k) {
+        if (ascii_lower(s[k]) != endoftext_marker[k]) return false;
     }
-    return result;
+    return true;
 }
 
-std::vector<std::string> HybridTokenizer::tokenize_words(const std::string& text) {
-    std::regex punct_regex(R"([.,!?;:"\'\-\(\)\[\]{}])");
-    std::string spaced = std::regex_replace(text, punct_regex, " $& ");
-    std::vector<std::string> tokens;
-    std::stringstream ss(spaced);
-    std::string token;
-    while (ss >> token) {
-        if (!token.empty()) tokens.push_back(token);
+} // namespace
+
+// One pass over the text: skip whitespace, emit punctuation as single byte words, and emit everything in between as a word.
+// This reproduces lowercase -> replace("<|endoftext|>", "<EOS>") -> regex punctuation padding -> whitespace split without building
+// any of the intermediate strings. The marker contains neither whitespace nor punctuation, so it can only appear inside a word.
+template <typename OnWord>
+void HybridTokenizer::scan_words(std::string_view text, bool normalize, std::string& scratch, OnWord&& on_word) const {
+    const size_t n = text.size();
+    size_t i = 0;
+    while (i < n) {
+        uint8_t cls = byte_class[static_cast<unsigned char>(text[i])];
+        if (cls & BYTE_SPACE) {
+            ++i;
+            continue;
+        }
+        if (cls & BYTE_PUNCT) {
+            on_word(text.substr(i, 1));
+            ++i;
+            continue;
+        }
+
+        size_t start = i;
+        bool needs_rewrite = false;
+        while (i < n) {
+            cls = byte_class[static_cast<unsigned char>(text[i])];
+            if (cls & (BYTE_SPACE | BYTE_PUNCT)) break;
+            needs_rewrite |= (cls & BYTE_REWRITE) != 0;
+            ++i;
+        }
+
+        std::string_view word = text.substr(start, i - start);
+        if (normalize && needs_rewrite) {
+            scratch.clear();
+            for (size_t j = 0; j < word.size();) {
+                if (word[j] == '<' && starts_with_endoftext(word.substr(j))) {
+                    scratch += "<EOS>";
+                    j += endoftext_marker.size();
+                } else {
+                    scratch += ascii_lower(word[j]);
+                    ++j;
+                }
+            }
+            word = scratch;
+        }
+        on_word(word);
     }
+}
+
+std::vector<std::string> HybridTokenizer::tokenize_words(const std::string& text) const {
+    std::vector<std::string> tokens;
+    std::string scratch;
+    scan_words(text, false, scratch, [&tokens](std::string_view word) { tokens.emplace_back(word); });
     return tokens;
 }
 
-std::vector<int> HybridTokenizer::encode_word_or_chars(const std::string& word) {
-    auto it = word_to_id.find(word);
-    if (it != word_to_id.end()) {
+std::vector<int> HybridTokenizer::encode_word_or_chars(const std::string& word) const {
+    std::vector<int> ids;
+    encode_word_or_chars(std::string_view(word), ids);
+    return ids;
+}
+
+void HybridTokenizer::encode_word_or_chars(std::string_view word, std::vector<int>& out) const {
+    auto it = word_index.find(word);
+    if (it != word_index.end()) {
         // The word exists in the main vocabulary, return its ID.
-        return {it->second};
-    } else {
-        // The word is not in the vocabulary, so we encode it character by character.
-        std::vector<int> char_ids = {char_start_id};
-    
-        // Use an index-based loop to handle multi-byte characters.
-        for (size_t i = 0; i < word.length(); ) {
-            bool found_char = false;
-    
-            // Greedily check for the longest possible character match first.
-            // Most UTF-8 characters are 4 bytes or less. Let's check from 4 down to 1.
-            for (int len = 4; len > 0; --len) {
-                if (i + len <= word.length()) {
-                    std::string sub = word.substr(i, len);
-                    auto cit = char_to_id.find(sub);
-                    if (cit != char_to_id.end()) {
-                        // Found a valid character in our map
-                        char_ids.push_back(cit->second + static_cast<int>(word_to_id.size()));
-                        i += len; // Advance the index by the length of the matched character
-                        found_char = true;
-                        break; // Exit the inner loop and continue with the next character
-                    }
+        out.push_back(it->second);
+        return;
+    }
+
+    // The word is not in the vocabulary, so we encode it character by character.
+    out.push_back(char_start_id);
+
+    // Use an index-based loop to handle multi-byte characters.
+    for (size_t i = 0; i < word.length(); ) {
+        bool found_char = false;
+
+        // Greedily check for the longest possible character match first.
+        // Most UTF-8 characters are 4 bytes or less. Let's check from 4 down to 1.
+        for (size_t len = 4; len > 0; --len) {
+            if (i + len <= word.length()) {
+                auto cit = char_index.find(word.substr(i, len));
+                if (cit != char_index.end()) {
+                    // Found a valid character in our map
+                    out.push_back(cit->second + char_id_offset);
+                    i += len; // Advance the index by the length of the matched character
+                    found_char = true;
+                    break; // Exit the inner loop and continue with the next character
                 }
             }
-            // If no character (of length 4, 3, 2, or 1) was found at the current position
-            if (!found_char) {
-                char_ids.push_back(unk_id);
-                i += 1; // Move past the unknown byte and continue
-            }
         }
-    
-        char_ids.push_back(char_end_id);
-        return char_ids;
+        // If no character (of length 4, 3, 2, or 1) was found at the current position
+        if (!found_char) {
+            out.push_back(unk_id);
+            i += 1; // Move past the unknown byte and continue
+        }
     }
+
+    out.push_back(char_end_id);
 }
 
-std::string HybridTokenizer::decode(const std::vector<int>& token_ids) {
+std::string_view HybridTokenizer::word_piece(int token_id, bool leading_space) const {
+    std::string_view piece = (token_id >= 0 && token_id < char_id_offset) ? id_to_piece[token_id] : unk_piece;
+    return leading_space ? piece : piece.substr(1);
+}
+
+std::string_view HybridTokenizer::char_piece(int token_id, bool leading_space) const {
+    std::string_view piece = (token_id >= char_id_offset && token_id < static_cast<int>(id_to_piece.size())) ? id_to_piece[token_id] : unk_piece;
+    return leading_space ? piece : piece.substr(1);
+}
+
+std::string HybridTokenizer::decode(const std::vector<int>& token_ids) const {
     std::string text;
-    for (int token_id : token_ids) {
-        text += " " + id_to_word[token_id];
+    for (size_t i = 0; i < token_ids.size(); ++i) {
+        int token_id = token_ids[i];
+        if (token_id == char_start_id) {
+            // Reassemble the character sequence up to <CHAR_END> as a single word
+            bool first_char = true;
+            for (++i; i < token_ids.size() && token_ids[i] != char_end_id; ++i) {
+                text += char_piece(token_ids[i], first_char && !text.empty());
+                first_char = false;
+            }
+            continue;
+        }
+        if (token_id == pad_id || token_id == bos_id || token_id == eos_id || token_id == char_end_id) continue;
+        text += word_piece(token_id, !text.empty());
     }
     return text;
 }
 
-std::vector<int> HybridTokenizer::encode(const std::string& text, bool add_special_tokens) {
-    std::string preprocessed = replace(to_lower(text), "<|endoftext|>", "<EOS>");
-    auto words = tokenize_words(preprocessed);
+std::vector<int> HybridTokenizer::encode(std::string_view text, bool add_special_tokens) const {
     std::vector<int> token_ids;
+    token_ids.reserve(text.size() / 4 + 2);     // roughly one token per short word, avoids most regrowth
+    std::string scratch;                        // only used by words that need lowercasing, reused across words
     if (add_special_tokens) token_ids.push_back(bos_id);
-    for (const auto& word : words) {
-        auto ids = encode_word_or_chars(word);
-        token_ids.insert(token_ids.end(), ids.begin(), ids.end());
-    }
+    scan_words(text, true, scratch, [&](std::string_view word) { encode_word_or_chars(word, token_ids); });
     if (add_special_tokens) token_ids.push_back(eos_id);
     return token_ids;
 }
@@ -243,13 +332,170 @@ void HybridTokenizer::load_vocab(const std::string& filepath) {
             vocab_size = std::stoi(num_str);
         }
     }
+
+    // Build the string_view lookup tables used by encode. Keys point into the nodes of word_to_id / char_to_id, which stay put.
+    word_index.clear();
+    word_index.reserve(word_to_id.size());
+    for (const auto& [word, id] : word_to_id) word_index.emplace(word, id);
+    char_index.clear();
+    char_index.reserve(char_to_id.size());
+    for (const auto& [ch, id] : char_to_id) char_index.emplace(ch, id);
+    char_id_offset = static_cast<int>(word_to_id.size());
+
+    // Build the flat detokenization table: ids [0, char_id_offset) are words, the char ids follow. Every entry carries its
+    // leading space so streaming can hand out " word" without concatenating. Offsets first, views once the pool stops growing.
+    const int total_ids = char_id_offset + static_cast<int>(char_to_id.size());
+    std::vector<std::pair<size_t, size_t>> spans(total_ids);
+    piece_pool.clear();
+    auto append_piece = [this](const std::string& text) {
+        std::pair<size_t, size_t> span(piece_pool.size(), text.size() + 1);
+        piece_pool += ' ';
+        piece_pool += text;
+        return span;
+    };
+    for (int id = 0; id < total_ids; ++id) {
+        const auto& table = id < char_id_offset ? id_to_word : id_to_char;
+        auto it = table.find(id < char_id_offset ? id : id - char_id_offset);
+        spans[id] = append_piece(it != table.end() ? it->second : "<UNK>");
+    }
+    auto unk_span = append_piece("<UNK>");
+    id_to_piece.resize(total_ids);
+    for (int id = 0; id < total_ids; ++id) {
+        id_to_piece[id] = std::string_view(piece_pool).substr(spans[id].first, spans[id].second);
+    }
+    unk_piece = std::string_view(piece_pool).substr(unk_span.first, unk_span.second);
+}
+
+void StreamingDetokenizer::reset(bool separate_first_word) {
+    in_char_word = false;
+    at_word_start = true;
+    emitted_any = false;
+    separate_first = separate_first_word;
+}
+
+std::string_view StreamingDetokenizer::step(int token_id) {
+    if (token_id == tokenizer.char_start_id) {
+        in_char_word = true;
+        at_word_start = true;
+        return {};
+    }
+    if (token_id == tokenizer.char_end_id) {
+        in_char_word = false;
+        at_word_start = true;
+        return {};
+    }
+    if (!in_char_word && (token_id == tokenizer.pad_id || token_id == tokenizer.bos_id || token_id == tokenizer.eos_id)) {
+        return {};
+    }
+
+    bool leading_space = at_word_start && (emitted_any || separate_first);
+    std::string_view piece = in_char_word ? tokenizer.char_piece(token_id, leading_space) : tokenizer.word_piece(token_id, leading_space);
+    at_word_start = !in_char_word;  // a word token is complete on its own, a char only continues the current word
+    emitted_any = true;
+    return piece;
 }
 
 #ifdef TOKENIZER_DEBUG
+#include <chrono>
+#include <iomanip>
 
-int main(void){
+// Reference implementation of the original regex based encode path, kept here so the benchmark can check that the
+// single pass scanner produces identical ids and report the speedup against it.
+static std::vector<int> legacy_encode(const HybridTokenizer& tokenizer, const std::string& text) {
+    std::string lowered = text;
+    std::transform(lowered.begin(), lowered.end(), lowered.begin(), ::tolower);
+    std::string preprocessed = lowered;
+    const std::string from = "<|endoftext|>", to = "<EOS>";
+    for (size_t pos = 0; (pos = preprocessed.find(from, pos)) != std::string::npos; pos += to.length()) {
+        preprocessed.replace(pos, from.length(), to);
+    }
+    std::regex punct_regex(R"([.,!?;:"\'\-\(\)\[\]{}])");
+    std::stringstream ss(std::regex_replace(preprocessed, punct_regex, " $& "));
+
+    const int unk = tokenizer.word_to_id.at("<UNK>");
+    std::vector<int> ids = {tokenizer.word_to_id.at("<BOS>")};
+    std::string word;
+    while (ss >> word) {
+        auto it = tokenizer.word_to_id.find(word);
+        if (it != tokenizer.word_to_id.end()) {
+            ids.push_back(it->second);
+            continue;
+        }
+        ids.push_back(tokenizer.word_to_id.at("<CHAR_START>"));
+        for (size_t i = 0; i < word.length();) {
+            bool found_char = false;
+            for (int len = 4; len > 0; --len) {
+                if (i + len <= word.length()) {
+                    auto cit = tokenizer.char_to_id.find(word.substr(i, len));
+                    if (cit != tokenizer.char_to_id.end()) {
+                        ids.push_back(cit->second + static_cast<int>(tokenizer.word_to_id.size()));
+                        i += len;
+                        found_char = true;
+                        break;
+                    }
+                }
+            }
+            if (!found_char) {
+                ids.push_back(unk);
+                i += 1;
+            }
+        }
+        ids.push_back(tokenizer.word_to_id.at("<CHAR_END>"));
+    }
+    ids.push_back(tokenizer.word_to_id.at("<EOS>"));
+    return ids;
+}
+
+// Encode throughput benchmark. usage: tok [vocab_path] [corpus_file], one prompt per corpus line.
+static void run_encode_benchmark(const HybridTokenizer& tokenizer, const std::string& corpus_path) {
+    std::vector<std::string> lines;
+    if (!corpus_path.empty()) {
+        std::ifstream corpus(corpus_path);
+        std::string line;
+        while (std::getline(corpus, line)) lines.push_back(line);
+    }
+    if (lines.empty()) {
+        const std::vector<std::string> samples = {
+            "Once upon a time, there was a little girl named Lily. She loved to play outside in the sunshine.",
+            "Tom said, \"Can I have the red ball?\" His mom smiled and said, \"Yes, you can!\"",
+            "The Zyzzyva-bug crawled over [the] {blue} rock; it was (very) slow... <|endoftext|>",
+            "Ben found a shiny “coin” in the sand — it was worth 100 dollars… WOW!",
+            "one day,\ta bird flew\r\ninto the house<|EndOfText|>and the cat ran away.",
+        };
+        for (int i = 0; i < 4000; ++i) lines.push_back(samples[i % samples.size()]);
+    }
+
+    size_t total_bytes = 0, mismatches = 0;
+    for (const auto& line : lines) {
+        total_bytes += line.size();
+        if (tokenizer.encode(line) != legacy_encode(tokenizer, line)) {
+            if (mismatches++ < 5) std::cout << "MISMATCH: " << line << std::endl;
+        }
+    }
+    std::cout << "Equivalence check: " << lines.size() - mismatches << "/" << lines.size() << " lines identical" << std::endl;
+
+    auto bench = [&](const char* name, int iterations, auto&& encode_fn) {
+        size_t tokens = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int it = 0; it < iterations; ++it) {
+            for (const auto& line : lines) tokens += encode_fn(line).size();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double mb_per_s = (double)total_bytes * iterations / seconds / 1e6;
+        std::cout << name << ": " << std::fixed << std::setprecision(2) << mb_per_s << " MB/s, "
+                  << (double)tokens / seconds / 1e6 << " M tokens/s" << std::endl;
+        return mb_per_s;
+    };
+    double legacy = bench("legacy regex encode ", 1, [&](const std::string& line) { return legacy_encode(tokenizer, line); });
+    double scanner = bench("single pass encode  ", 20, [&](const std::string& line) { return tokenizer.encode(line); });
+    std::cout << "Speedup: " << std::fixed << std::setprecision(1) << scanner / legacy << "x" << std::endl;
+}
+
+int main(int argc, char* argv[]){
+    std::string vocab_path = argc > 1 ? argv[1] : "model/tinystories_tokenizer_vocab.json";
+    std::string corpus_path = argc > 2 ? argv[2] : "";
     HybridTokenizer tokenizer;
-    tokenizer.load_vocab("model/tinystories_tokenizer_vocab.json");
+    tokenizer.load_vocab(vocab_path);
     int n = 0;
     std::cout << "================================================" << tokenizer.word_to_id.size() << std::endl;
     for(auto& [key, value] : tokenizer.word_to_id){
@@ -286,6 +532,19 @@ int main(void){
     std::string decoded_text = tokenizer.decode(token_ids);
     std::cout << "Decoded text: " << decoded_text << std::endl;
 
+    // Out of vocabulary words go through the char level path, check both decoders put them back together
+    std::string oov_text = "the zyzzyva, “flew” away";
+    std::vector<int> oov_ids = tokenizer.encode(oov_text, false);
+    StreamingDetokenizer detokenizer(tokenizer);
+    detokenizer.reset(false);
+    std::string streamed;
+    for (int token_id : oov_ids) streamed += detokenizer.step(token_id);
+    std::cout << "Decoded: " << tokenizer.decode(oov_ids) << std::endl;
+    std::cout << "Streamed: " << streamed << std::endl;
+
+    std::cout << "================================================" << std::endl;
+    run_encode_benchmark(tokenizer, corpus_path);
+
     return 0;
 }
 
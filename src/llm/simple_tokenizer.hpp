@@ -4,10 +4,9 @@
 #include <algorithm>
 #include <cctype>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
-#include <regex>
-#include <sstream>
 
 class HybridTokenizer {
 public:
@@ -17,25 +16,66 @@ public:
     std::unordered_map<std::string, int> char_to_id;
     std::unordered_map<int, std::string> id_to_char;
 
-    std::vector<std::string> tokenize_words(const std::string& text);
+    std::vector<std::string> tokenize_words(const std::string& text) const;
 
-    std::vector<int> encode_word_or_chars(const std::string& word);
+    std::vector<int> encode_word_or_chars(const std::string& word) const;
 
-    std::string decode(const std::vector<int>& token_ids);
+    // Full decode: words joined by single spaces, <CHAR_START> ... <CHAR_END> runs reassembled into one word, PAD/BOS/EOS dropped.
+    std::string decode(const std::vector<int>& token_ids) const;
 
-    std::vector<int> encode(const std::string& text, bool add_special_tokens = true);
+    std::vector<int> encode(std::string_view text, bool add_special_tokens = true) const;
  
     void load_vocab(const std::string& filepath);
 
 private:
-    std::string to_lower(const std::string& str);
+    // Single pass scanner shared by encode and tokenize_words. Calls on_word once per word / punctuation token, in order.
+    // With normalize set, words are lowercased and <|endoftext|> becomes <EOS>, like encode always did before splitting.
+    // Words that need lowercasing or <|endoftext|> rewriting are materialized in `scratch`, everything else is a view into `text`.
+    template <typename OnWord>
+    void scan_words(std::string_view text, bool normalize, std::string& scratch, OnWord&& on_word) const;
 
-    std::string replace(const std::string& str, const std::string& from, const std::string& to);
+    // Append the ids for one word (or its <CHAR_START> ... <CHAR_END> spelling) to `out`, no temporary allocation.
+    void encode_word_or_chars(std::string_view word, std::vector<int>& out) const;
 
     std::string extract_object(const std::string& content, const std::string& key);
 
+    // Text of a token for decoding. Word ids map to the word, char ids (offset by char_id_offset) to the character, anything
+    // else to <UNK>. With leading_space the view starts with the separating space, without it the space is sliced off.
+    std::string_view word_piece(int token_id, bool leading_space) const;
+    std::string_view char_piece(int token_id, bool leading_space) const;
+
+    // Flat id -> " text" table for every word and char id, views into one contiguous pool. Built once by load_vocab.
+    std::string piece_pool;
+    std::vector<std::string_view> id_to_piece;
+    std::string_view unk_piece;
+
+    friend class StreamingDetokenizer;
+
+    // Views over the keys of word_to_id / char_to_id, so lookups never copy the probed bytes into a std::string.
+    std::unordered_map<std::string_view, int> word_index;
+    std::unordered_map<std::string_view, int> char_index;
+    int char_id_offset = 0;     // char ids are stored after the word ids, offset by word_to_id.size()
 
     int pad_id, unk_id, bos_id, eos_id, char_start_id, char_end_id;
 };
 
+// Incremental decoder for generated tokens, one call per step. Returns the text to append to what has been streamed so far,
+// including the separating space, so pieces can be forwarded as they are. Character level words are emitted char by char
+// between <CHAR_START> and <CHAR_END>. The returned view points into the tokenizer's table and never allocates.
+class StreamingDetokenizer {
+public:
+    explicit StreamingDetokenizer(const HybridTokenizer& tokenizer) : tokenizer(tokenizer) {}
+
+    // Start a new sequence. separate_first_word puts a space before the first word, for output streamed after the prompt.
+    void reset(bool separate_first_word = true);
+    std::string_view step(int token_id);
+
+private:
+    const HybridTokenizer& tokenizer;
+    bool in_char_word = false;      // between <CHAR_START> and <CHAR_END>
+    bool at_word_start = true;      // next emitted piece begins a new word
+    bool emitted_any = false;
+    bool separate_first = true;
+};
+
 #endif // SIMPLE_TOKENIZER_HPP
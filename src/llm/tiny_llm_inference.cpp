@@ -12,51 +12,76 @@ const std::string TransformerParameters::model_path = AppConfig::get_instance().
 const std::string TransformerParameters::tokenizer_path = AppConfig::get_instance().get_string("TOKENIZER_PATH", "model/tinystories_tokenizer_vocab.json");
 
 TinyLLM::TinyLLM()
-    : tokenizer(nullptr), transformer(nullptr) {
+    : tokenizer(nullptr), detokenizer(nullptr), transformer(nullptr) {
     transformer = new Transformer(TransformerParameters::vocab_size, TransformerParameters::n_embd,
                                  TransformerParameters::n_head, TransformerParameters::n_layer,
                                  TransformerParameters::max_context, TransformerParameters::dropout);
     tokenizer = new HybridTokenizer();
     tokenizer->load_vocab(TransformerParameters::tokenizer_path);
+    detokenizer = new StreamingDetokenizer(*tokenizer);
     transformer->load_weights(TransformerParameters::model_path);
 }
 
 TinyLLM::~TinyLLM() {
+    delete detokenizer;
     delete tokenizer;
     delete transformer;
 }
 
-void TinyLLM::init(const std::string& initial_prompt) {
+void TinyLLM::init(std::string_view initial_prompt) {
     if (!initial_prompt.empty()) {
         token_ids = tokenizer->encode(initial_prompt);
     }
+    detokenizer->reset();   // generated text is streamed after the prompt, so the first word gets a leading space too
+}
+
+void TinyLLM::init(const int32_t* prompt_token_ids, size_t n_tokens) {
+    token_ids.assign(prompt_token_ids, prompt_token_ids + n_tokens);
+    detokenizer->reset();
+}
+
+// Greedy pick from one row of logits
+static int argmax_token(const float* row) {
+    int max_index = 0;
+    float max_value = row[0];
+    for (int i = 1; i < TransformerParameters::vocab_size; i++) {
+        if (row[i] > max_value) {
+            max_value = row[i];
+            max_index = i;
+        }
+    }
+    return max_index;
 }
 
 int TinyLLM::inference(int latest_token) {
     if (latest_token != -1) {
         token_ids.push_back(latest_token);
     }
+    std::vector<int> next_token;
+    inference_batch({&token_ids}, next_token);     // logits of the last position only
+    return next_token[0];
+}
 
-    Tensor logits;
-    transformer->forward(token_ids, logits, false);
-
-    int start_index = logits.shape[1] * (logits.shape[0] - 1);
-    int max_index = 0;
-    float max_value = logits.data[start_index];
+std::vector<int> TinyLLM::encode(std::string_view text) const {
+    return tokenizer->encode(text);
+}
 
-    for (int i = start_index; i < start_index + TransformerParameters::vocab_size; i++) {
-        if (logits.data[i] > max_value) {
-            max_value = logits.data[i];
-            max_index = i;
-        }
+void TinyLLM::inference_batch(const std::vector<const std::vector<int>*>& sequences, std::vector<int>& next_tokens) {
+    Tensor logits;
+    transformer->forward_batch(sequences, logits);
+    next_tokens.resize(sequences.size());
+    for (size_t s = 0; s < sequences.size(); ++s) {
+        next_tokens[s] = argmax_token(&logits.data[s * TransformerParameters::vocab_size]);
     }
-    max_index = max_index - start_index;
-    return max_index;
 }
 
 std::string TinyLLM::decode(int token_id) {
     return tokenizer->decode({token_id});
 }
+
+std::string_view TinyLLM::decode_next(int token_id) {
+    return detokenizer->step(token_id);
+}
 #if defined(SINGGLE_INFERENCE)
 #include <iostream>
 
@@ -106,8 +131,7 @@ int main() {
             break;
         }
 
-        std::string new_token_str = llm.decode(next_token);
-        std::cout << new_token_str << std::flush;
+        std::cout << llm.decode_next(next_token) << std::flush;
 
         generated_tokens++;
     }
@@ -116,3 +140,72 @@ int main() {
     return 0;
 }
 #endif
+
+
+#if defined(BATCH_INFERENCE_BENCHMARK)
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+// Tokens/sec of the same prompts generated one after another (inference) and side by side (inference_batch, 8 at a time,
+// refilled as they finish like the worker does). Also checks that both produce the same tokens.
+int main(int argc, char* argv[]) {
+    TinyLLM llm;
+    const int n_prompts = argc > 1 ? std::atoi(argv[1]) : 16;
+    const int max_tokens = argc > 2 ? std::atoi(argv[2]) : 20;
+    const size_t width = argc > 3 ? std::atoi(argv[3]) : 8;
+    const char* stems[] = {"Lily and Tom", "One day a little girl", "the cat saw a dog", "once upon a time there was"};
+
+    std::vector<std::vector<int>> prompts;
+    for (int i = 0; i < n_prompts; ++i) {
+        prompts.push_back(llm.encode(std::string(stems[i % 4]) + " " + std::to_string(i)));
+    }
+
+    // Every prompt generates max_tokens, EOS or not, so both runs do the same work
+    std::vector<std::vector<int>> sequential(prompts.size());
+    auto start = std::chrono::steady_clock::now();
+    for (size_t p = 0; p < prompts.size(); ++p) {
+        llm.init(prompts[p].data(), prompts[p].size());
+        int next_token = -1;
+        for (int t = 0; t < max_tokens; ++t) {
+            next_token = llm.inference(next_token);
+            sequential[p].push_back(next_token);
+        }
+    }
+    double sequential_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<std::vector<int>> batched(prompts);
+    std::vector<size_t> active;
+    std::vector<const std::vector<int>*> inputs;
+    std::vector<int> next_tokens;
+    size_t next_waiting = 0;
+    start = std::chrono::steady_clock::now();
+    while (true) {
+        while (active.size() < width && next_waiting < batched.size()) active.push_back(next_waiting++);
+        if (active.empty()) break;
+        inputs.clear();
+        for (size_t p : active) inputs.push_back(&batched[p]);
+        llm.inference_batch(inputs, next_tokens);
+        size_t kept = 0;
+        for (size_t k = 0; k < active.size(); ++k) {
+            std::vector<int>& sequence = batched[active[k]];
+            sequence.push_back(next_tokens[k]);
+            if (sequence.size() - prompts[active[k]].size() < static_cast<size_t>(max_tokens)) active[kept++] = active[k];
+        }
+        active.resize(kept);
+    }
+    double batched_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    bool same = true;
+    for (size_t p = 0; p < prompts.size(); ++p) {
+        same = same && std::equal(sequential[p].begin(), sequential[p].end(), batched[p].begin() + prompts[p].size());
+    }
+    double tokens = static_cast<double>(n_prompts) * max_tokens;
+    std::cout << n_prompts << " prompts x " << max_tokens << " tokens, batch width " << width << std::endl;
+    std::cout << "sequential: " << sequential_s << " s, " << tokens / sequential_s << " tokens/s" << std::endl;
+    std::cout << "batched:    " << batched_s << " s, " << tokens / batched_s << " tokens/s" << std::endl;
+    std::cout << "same tokens: " << (same ? "yes" : "NO") << std::endl;
+    return same ? 0 : 1;
+}
+#endif
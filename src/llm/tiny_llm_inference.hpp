@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
 struct TransformerParameters {
@@ -15,6 +18,7 @@ struct TransformerParameters {
 };
 
 class HybridTokenizer;
+class StreamingDetokenizer;
 class Transformer;
 
 class TinyLLM {
@@ -22,12 +26,26 @@ public:
     TinyLLM();
     ~TinyLLM();
 
-    void init(const std::string& initial_prompt);
+    void init(std::string_view initial_prompt);
+    // Start from a prompt that was already tokenized (by the server), same ids encode() would produce.
+    void init(const int32_t* prompt_token_ids, size_t n_tokens);
     int inference(int latest_token);
+    // Prompt ids as init() tokenizes them, for sequences the caller runs through inference_batch
+    std::vector<int> encode(std::string_view text) const;
+    // One forward pass over several independent, non-empty sequences. next_tokens[i] is the greedy next token of
+    // sequences[i], the one inference() would pick for it alone. The sequences are not modified.
+    void inference_batch(const std::vector<const std::vector<int>*>& sequences, std::vector<int>& next_tokens);
+    // Vocabulary for a StreamingDetokenizer per sequence of a batch
+    const HybridTokenizer& vocabulary() const { return *tokenizer; }
     std::string decode(int token_id);
+    // Text to stream for the next generated token, joined onto everything streamed since init(). Valid until the next call.
+    std::string_view decode_next(int token_id);
+    // Prompt plus generated tokens so far, has to stay within TransformerParameters::max_context
+    size_t context_length() const { return token_ids.size(); }
 
 private:
     HybridTokenizer* tokenizer;
+    StreamingDetokenizer* detokenizer;
     Transformer* transformer;
     std::vector<int> token_ids;
 };
@@ -107,14 +107,14 @@ Block::Block(int n_embd, int n_head, float dropout = 0.0) : n_embd(n_embd), n_he
 
 Block::~Block() {}
 
-void Block::forward(Tensor& inp_out) {
+void Block::forward(Tensor& inp_out, const std::vector<int>& bounds) {
     DEBUG_COUT("Block Forward:"<<std::endl);
     DEBUG_COUT_FIXED;
     Tensor norm1;
     ln1.forward(inp_out, norm1);
     DEBUG_COUT("Norm1 Forward shape:"<<norm1.shape[0]<< " " <<norm1.shape[1]<< " size:" <<norm1.data.size()<<" sum:" <<norm1.sum()<< " norm:" <<norm1.norm()<< std::endl);
     Tensor attn;
-    sa.forward(norm1, attn);
+    sa.forward(norm1, attn, bounds);
     for (size_t i = 0; i < inp_out.data.size(); ++i) {
         inp_out.data[i] += attn.data[i];
     }
@@ -258,7 +258,33 @@ void Linear::forward(const Tensor& input, Tensor& output) {
     int seq = input.shape[0];
     output.shape = {seq, out_features};
     output.data.resize(seq * out_features);
-    for (int t = 0; t < seq; ++t) {
+    // Four rows share each pass over a weight row: the weights are streamed a quarter as often, and the four sums are
+    // independent chains the CPU overlaps. Every sum still adds in input order, the results do not change.
+    int t = 0;
+    for (; t + 4 <= seq; t += 4) {
+        const float* x0 = &input.data[t * in_features];
+        const float* x1 = x0 + in_features;
+        const float* x2 = x1 + in_features;
+        const float* x3 = x2 + in_features;
+        for (int o = 0; o < out_features; ++o) {
+            const float* w = &weight.data[o * in_features];
+            float val0 = 0.0f, val1 = 0.0f, val2 = 0.0f, val3 = 0.0f;
+            for (int i = 0; i < in_features; ++i) {
+                val0 += x0[i] * w[i];
+                val1 += x1[i] * w[i];
+                val2 += x2[i] * w[i];
+                val3 += x3[i] * w[i];
+            }
+            if (use_bias) {
+                val0 += bias.data[o]; val1 += bias.data[o]; val2 += bias.data[o]; val3 += bias.data[o];
+            }
+            output.data[t * out_features + o] = val0;
+            output.data[(t + 1) * out_features + o] = val1;
+            output.data[(t + 2) * out_features + o] = val2;
+            output.data[(t + 3) * out_features + o] = val3;
+        }
+    }
+    for (; t < seq; ++t) {
         for (int o = 0; o < out_features; ++o) {
             float val = 0.0f;
             for (int i = 0; i < in_features; ++i) {
@@ -277,9 +303,8 @@ Head::Head(int head_size, int n_embd, float dropout) : head_size(head_size), dro
 
 Head::~Head() {}
 
-void Head::forward(const Tensor& x, Tensor& out) {
+void Head::forward(const Tensor& x, Tensor& out, const std::vector<int>& bounds) {
     int seq = x.shape[0];
-    int embd = x.shape[1];
     Tensor k, q, v;
     key.forward(x, k);
     query.forward(x, q);
@@ -288,51 +313,47 @@ void Head::forward(const Tensor& x, Tensor& out) {
     DEBUG_COUT("Head Key shape:" << k.shape[0]<< " " << k.shape[1]<< " size:" << k.data.size()<<" sum:" << k.sum()<< " norm:" <<k.norm()<< std::endl);
     DEBUG_COUT("Head Query shape:" << q.shape[0]<< " " << q.shape[1]<< " size:" << q.data.size()<<" sum:" << q.sum()<< " norm:" <<q.norm()<< std::endl);
     DEBUG_COUT("Head Value shape:" << v.shape[0]<< " " << v.shape[1]<< " size:" << v.data.size()<<" sum:" << v.sum()<< " norm:" <<v.norm()<< std::endl);
-    Tensor wei;
-    wei.shape = {seq, seq};
-    wei.data.resize(seq * seq);
-    float scale = 1.0f / std::sqrt(static_cast<float>(head_size));
-    for (int t1 = 0; t1 < seq; ++t1) {
-        for (int t2 = 0; t2 < seq; ++t2) {
-            float val = 0.0f;
-            for (int h = 0; h < head_size; ++h) {
-                val += q.data[t1 * head_size + h] * k.data[t2 * head_size + h];
-            }
-            wei.data[t1 * seq + t2] = val * scale;
-        }
-    }
-    // Causal mask
-    for (int t1 = 0; t1 < seq; ++t1) {
-        for (int t2 = t1 + 1; t2 < seq; ++t2) {
-            wei.data[t1 * seq + t2] = -std::numeric_limits<float>::infinity();
-        }
-    }
-    // Softmax
-    for (int t1 = 0; t1 < seq; ++t1) {
-        float max_val = -std::numeric_limits<float>::infinity();
-        for (int t2 = 0; t2 < seq; ++t2) {
-            if (wei.data[t1 * seq + t2] > max_val) max_val = wei.data[t1 * seq + t2];
-        }
-        float sum = 0.0f;
-        for (int t2 = 0; t2 < seq; ++t2) {
-            float expv = std::exp(wei.data[t1 * seq + t2] - max_val);
-            sum += expv;
-            wei.data[t1 * seq + t2] = expv;
-        }
-        for (int t2 = 0; t2 < seq; ++t2) {
-            wei.data[t1 * seq + t2] /= sum;
-        }
-    }
-    // out = wei @ v
     out.shape = {seq, head_size};
     out.data.resize(seq * head_size);
-    for (int t1 = 0; t1 < seq; ++t1) {
-        for (int h = 0; h < head_size; ++h) {
-            float val = 0.0f;
-            for (int t2 = 0; t2 < seq; ++t2) {
-                val += wei.data[t1 * seq + t2] * v.data[t2 * head_size + h];
+    float scale = 1.0f / std::sqrt(static_cast<float>(head_size));
+    std::vector<float> wei;     // one row of attention weights
+    for (size_t s = 0; s + 1 < bounds.size(); ++s) {
+        int begin = bounds[s];
+        int len = bounds[s + 1] - begin;
+        const float* qs = &q.data[begin * head_size];
+        const float* ks = &k.data[begin * head_size];
+        const float* vs = &v.data[begin * head_size];
+        float* os = &out.data[begin * head_size];
+        wei.resize(len);
+        // Causal mask: row t1 only sees t2 <= t1, the masked scores would only add exact zeros
+        for (int t1 = 0; t1 < len; ++t1) {
+            float max_val = -std::numeric_limits<float>::infinity();
+            for (int t2 = 0; t2 <= t1; ++t2) {
+                float val = 0.0f;
+                for (int h = 0; h < head_size; ++h) {
+                    val += qs[t1 * head_size + h] * ks[t2 * head_size + h];
+                }
+                wei[t2] = val * scale;
+                if (wei[t2] > max_val) max_val = wei[t2];
+            }
+            // Softmax
+            float sum = 0.0f;
+            for (int t2 = 0; t2 <= t1; ++t2) {
+                float expv = std::exp(wei[t2] - max_val);
+                sum += expv;
+                wei[t2] = expv;
+            }
+            for (int t2 = 0; t2 <= t1; ++t2) {
+                wei[t2] /= sum;
+            }
+            // out = wei @ v
+            for (int h = 0; h < head_size; ++h) {
+                float val = 0.0f;
+                for (int t2 = 0; t2 <= t1; ++t2) {
+                    val += wei[t2] * vs[t2 * head_size + h];
+                }
+                os[t1 * head_size + h] = val;
             }
-            out.data[t1 * head_size + h] = val;
         }
     }
 }
@@ -357,7 +378,7 @@ MultiHeadAttention::~MultiHeadAttention() {
     heads.clear();
 }
 
-void MultiHeadAttention::forward(const Tensor& x, Tensor& out) {
+void MultiHeadAttention::forward(const Tensor& x, Tensor& out, const std::vector<int>& bounds) {
     DEBUG_COUT_FIXED;
     int seq = x.shape[0];
     Tensor concat;
@@ -365,7 +386,7 @@ void MultiHeadAttention::forward(const Tensor& x, Tensor& out) {
     concat.data.resize(seq * n_embd);
     for (int h = 0; h < num_heads; ++h) {
         Tensor head_out;
-        heads[h].forward(x, head_out);
+        heads[h].forward(x, head_out, bounds);
         for (int t = 0; t < seq; ++t) {
             for (int d = 0; d < head_size; ++d) {
                 concat.data[t * n_embd + h * head_size + d] = head_out.data[t * head_size + d];
@@ -510,12 +531,43 @@ void Transformer::forward(std::vector<int>& input_token_ids, Tensor& logits, boo
         this->sinusoidal_global_pe.forward(input_pos, x);
     }
     DEBUG_COUT("Sinusoidal Global PE Forward shape:" << x.shape[0]<< " " << x.shape[1]<< " size:" << x.data.size()<<" sum:" << x.sum()<< " norm:" <<x.norm()<< std::endl);
+    std::vector<int> bounds = {0, static_cast<int>(input_token_ids.size())};
     for (auto& b : blocks) {
-        b.forward(x);
+        b.forward(x, bounds);
     }
     DEBUG_COUT("Block Forward shape:" << x.shape[0]<< " " << x.shape[1]<< " size:" << x.data.size()<<" sum:" << x.sum()<< " norm:" <<x.norm()<< std::endl);
     Tensor norm;
     ln_f.forward(x, norm);
     lm_head.forward(norm, logits);
     DEBUG_COUT("LM Head Forward shape:" << logits.shape[0]<< " " << logits.shape[1]<< " size:" << logits.data.size()<<" sum:" << logits.sum()<< " norm:" <<logits.norm()<< std::endl);
-}
\ No newline at end of file
+}
+
+void Transformer::forward_batch(const std::vector<const std::vector<int>*>& sequences, Tensor& logits) {
+    std::vector<int> token_ids, input_pos;
+    std::vector<int> bounds = {0};
+    for (const std::vector<int>* sequence : sequences) {
+        token_ids.insert(token_ids.end(), sequence->begin(), sequence->end());
+        for (int pos = 0; pos < static_cast<int>(sequence->size()); ++pos) {
+            input_pos.push_back(pos);
+        }
+        bounds.push_back(static_cast<int>(token_ids.size()));
+    }
+    Tensor x;
+    embedding.forward(token_ids, x);
+    this->sinusoidal_global_pe.forward(input_pos, x);
+    for (auto& b : blocks) {
+        b.forward(x, bounds);
+    }
+    // Only the last row of each sequence predicts a token, ln_f and lm_head work row by row so the rest is skipped
+    int batch = static_cast<int>(sequences.size());
+    Tensor last;
+    last.shape = {batch, n_embd};
+    last.data.resize(batch * n_embd);
+    for (int s = 0; s < batch; ++s) {
+        std::copy_n(&x.data[(bounds[s + 1] - 1) * n_embd], n_embd, &last.data[s * n_embd]);
+    }
+    Tensor norm;
+    ln_f.forward(last, norm);
+    lm_head.forward(norm, logits);
+    DEBUG_COUT("LM Head Batch Forward shape:" << logits.shape[0]<< " " << logits.shape[1]<< std::endl);
+}
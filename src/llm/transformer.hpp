@@ -68,7 +68,9 @@ private:
 public:
     Head(int head_size, int n_embd, float dropout);
     ~Head();
-    void forward(const Tensor& x, Tensor& out);
+    // x holds the rows of one or more sequences back to back, sequence s is rows [bounds[s], bounds[s + 1]).
+    // Each row attends causally within its own sequence only.
+    void forward(const Tensor& x, Tensor& out, const std::vector<int>& bounds);
     void set_key_weight(const Tensor& w);
     void set_query_weight(const Tensor& w);
     void set_value_weight(const Tensor& w);
@@ -85,7 +87,7 @@ private:
 public:
     MultiHeadAttention(int num_heads, int head_size, int n_embd, float dropout);
     ~MultiHeadAttention();
-    void forward(const Tensor& x, Tensor& out);
+    void forward(const Tensor& x, Tensor& out, const std::vector<int>& bounds);
     void set_head_key_weight(int head_idx, const Tensor& w);
     void set_head_query_weight(int head_idx, const Tensor& w);
     void set_head_value_weight(int head_idx, const Tensor& w);
@@ -117,7 +119,7 @@ private:
 public:
     Block(int n_embd, int n_head, float dropout);
     ~Block();
-    void forward(Tensor& inp_out);
+    void forward(Tensor& inp_out, const std::vector<int>& bounds);
     void set_ln1_gamma(const Tensor& g);
     void set_ln1_beta(const Tensor& b);
     void set_ln2_gamma(const Tensor& g);
@@ -148,5 +150,9 @@ public:
     ~Transformer();
     void load_weights(const std::string& export_dir);
     void forward(std::vector<int>& input_token_ids, Tensor& logits, bool completion = false);
+    // Several independent sequences in one pass: their rows are stacked for the position-wise layers, so each weight matrix
+    // is streamed once for all of them, and attention stays within each sequence. Sequences must not be empty. logits gets
+    // one row per sequence, for its last position only, the same values forward() gives for that row.
+    void forward_batch(const std::vector<const std::vector<int>*>& sequences, Tensor& logits);
     // void generate(std::vector<int>& idx, int max_new_tokens, float temperature = 1.0f, int top_k = 0);
 };
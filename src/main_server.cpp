@@ -7,12 +7,16 @@
 #include <atomic>
 #include <csignal>
 #include <cerrno>
+#include <chrono>
+#include <vector>
+#include <algorithm>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netinet/tcp.h> // For TCP_NODELAY
+#include <sys/resource.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -20,7 +24,11 @@
 #include <string.h>
 
 #include "server/task_dispatcher.hpp"
+#include "server/event_loop.hpp"
+#include "server/thread_pool.hpp"
 #include "utils/http_utils.hpp"
+#include "utils/metrics.hpp"
+#include "utils/trace.hpp"
 #include "utils/config.hpp"
 
 // #define DEBUG_PRINT
@@ -46,38 +54,63 @@ enabling DEBUG_PRINT will ensure server and client communicate okay, this is ver
 
 class HttpInferenceServer {
 private:
-    SOCKET serverSocket;
+    std::vector<SOCKET> serverSockets;     // one per event loop with LISTEN_REUSEPORT, otherwise one shared by all loops
     int port;
     std::unique_ptr<TaskDispatcher> task_dispatcher;
+    std::unique_ptr<ThreadPool> dispatch_pool;                  // tokenizes and enqueues /process requests off the event loops
+    std::vector<std::unique_ptr<EventLoop>> event_loops;        // accept, read and write every connection
     std::atomic<int> active_connections_{0};
+    std::atomic<uint64_t> dispatch_queue_full_{0};             // requests answered 503 because the dispatch pool queue was full
     int max_connections_;
 
 public:
     HttpInferenceServer(int serverPort, int max_connections) 
-        : port(serverPort), serverSocket(INVALID_SOCKET), max_connections_(max_connections) {
+        : port(serverPort), max_connections_(max_connections) {
         task_dispatcher = std::make_unique<TaskDispatcher>();
     }
     ~HttpInferenceServer() {
-        if (serverSocket != INVALID_SOCKET) {closesocket(serverSocket);}    // Close socket
+        for (auto& loop : event_loops) loop->stop();    // no new requests
+        dispatch_pool.reset();                          // no new enqueues
+        task_dispatcher.reset();                        // finishes the responses still streaming
+        event_loops.clear();                            // closes the remaining connections
+        for (SOCKET serverSocket : serverSockets) {closesocket(serverSocket);}    // Close sockets
     }
 
-    bool initializeSocket() {
+    // Open one more listening socket. With reuse_port every event loop gets its own on the same port (SO_REUSEPORT) and the
+    // kernel spreads incoming connections over them, instead of all loops contending for the accept queue of one socket.
+    bool initializeSocket(bool reuse_port) {
 
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0); // AF_INET is the Internet address family for IPv4, SOCK_STREAM specify the type as TCP, 0 is the protocol (let the os choose default for tcp)
+        SOCKET serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); // AF_INET is the Internet address family for IPv4, SOCK_STREAM specify the type as TCP, 0 is the protocol (let the os choose default for tcp). Non-blocking, the event loops accept until EAGAIN
         if (serverSocket == INVALID_SOCKET) {
             std::cerr << "Socket creation failed" << std::endl;
             return false;
         }
+        serverSockets.push_back(serverSocket);      // closed with the server, also when it fails below
 
         // Allow socket reuse
         int opt = 1;
         setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));           // Allow socket reuse (in case short restart of the server, os sometime set port in use flog for s short time after the server is killed)
+        if (reuse_port && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, (char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
+            perror("SO_REUSEPORT failed");
+            return false;
+        }
 
         sockaddr_in serverAddr;     // Struct to hold the server address
         serverAddr.sin_family = AF_INET;
         serverAddr.sin_addr.s_addr = INADDR_ANY;   // INADDR_ANY is the wildcard address for all IPv4 addresses
         serverAddr.sin_port = htons(port);         // Convert port to network byte order (big endian)
 
+        // SO_REUSEPORT would also let this bind next to another server still listening on the port and split its
+        // traffic, a plain socket bound first makes that fail as it does without reuse_port
+        if (reuse_port && serverSockets.size() == 1) {
+            SOCKET probe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+            bool port_free = probe != INVALID_SOCKET && bind(probe, (sockaddr*)&serverAddr, sizeof(serverAddr)) != SOCKET_ERROR;
+            if (!port_free) perror("bind failed");
+            if (probe != INVALID_SOCKET) closesocket(probe);
+            if (!port_free) return false;
+        }
+
         if (bind(serverSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {    // Bind socket to port
             DEBUG_CERR("Bind failed on port " << port);
             perror("bind failed");
@@ -92,80 +125,205 @@ public:
         return true;
     }
 
+    static void respond(const std::shared_ptr<Connection>& connection, int statusCode, const std::string& statusText, const std::string& body,
+                        const std::string& extraHeaders = "", const std::string& contentType = "application/json") {
+        connection->send(HttpUtils::buildHttpResponse(statusCode, statusText, body, connection->keeps_alive(), contentType, extraHeaders));
+        connection->finish_response();
+    }
 
-    // Handle client connection
-    void handleClient(SOCKET clientSocket) {
-        DEBUG_COUT("Handling new client on socket " << clientSocket);
-        
-        struct ConnectionGuard {
-            HttpInferenceServer* server;
-            SOCKET sock;
-            ConnectionGuard(HttpInferenceServer* s, SOCKET k) : server(s), sock(k) {}
-            ~ConnectionGuard() {
-                server->active_connections_--;
-                DEBUG_COUT("Connection closed. Active connections: " << server->active_connections_.load(std::memory_order_relaxed));
-                closesocket(sock);
-            }
-        };
-        ConnectionGuard guard(this, clientSocket);
+    // Overloaded: come back once the queue has drained
+    static void respond_retry_later(const std::shared_ptr<Connection>& connection, int statusCode, const std::string& message, uint32_t retry_after_s) {
+        respond(connection, statusCode, HttpUtils::statusText(statusCode), HttpUtils::buildJsonError(message),
+                "Retry-After: " + std::to_string(retry_after_s) + "\r\n");
+    }
 
-        // Set TCP_NODELAY to disable Nagle's algorithm for lower latency
-        int opt = 1;
-        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt));
-
-        HttpRequest request;
-        DEBUG_COUT("Reading and parsing HTTP request from client " << clientSocket);
-        if (!HttpUtils::readAndParseHttpRequest(clientSocket, request)) {
-            DEBUG_CERR("Failed to read/parse HTTP request from client " << clientSocket);
-            std::string response = HttpUtils::buildHttpResponse(400, "Bad Request", "{\"error\": \"Invalid HTTP request\"}");    // send bad request response to client. Close connection.
-            send(clientSocket, response.c_str(), response.length(), 0);
+    static uint64_t steady_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Route a complete request, called on the event loop thread that owns the connection so it must not block
+    void handleRequest(const std::shared_ptr<Connection>& connection, const HttpRequestView& request) {
+        bool is_process = request.method == "POST" && (request.path == "/process" || request.path == "/process_batch");
+        // X-Priority sets the priority of requests whose body does not
+        RequestPriority header_priority = RequestPriority::Normal;
+        std::string_view priority_header = request.header("X-Priority");
+        if (is_process && !priority_header.empty() && !HttpUtils::parsePriority(priority_header, header_priority)) {
+            respond(connection, 400, "Bad Request", HttpUtils::buildJsonError("Header X-Priority must be high, normal or low"));
             return;
         }
-        DEBUG_COUT("Successfully parsed request from client " << clientSocket << ": " << request.method << " " << request.path);
-
+        // One in TRACE_SAMPLE_RATE requests is traced, and any asking for it with X-Trace: 1
+        bool traced = is_process && (Trace::sample() || request.header("X-Trace") == "1");
+        uint64_t received_ns = traced ? Trace::now_ns() : 0;
         if (request.method == "POST" && request.path == "/process") {
             ProcessRequest request_parsed;
-            if (HttpUtils::parseJsonMessage(request.body, request_parsed)) {
-                std::string header = HttpUtils::buildHttpChunkedResponseHeader(200, "OK");
-                if(send(clientSocket, header.c_str(), header.length(), 0) == SOCKET_ERROR) {
-                    DEBUG_CERR("Failed to send header");
-                }
+            request_parsed.priority = header_priority;
+            RequestTrace& trace = request_parsed.trace;
+            if (traced) {
+                trace.sampled = true;
+                trace.read_start_ns = connection->request_read_start_ns();
+                trace.received_ns = received_ns;
+            }
+            std::string parse_error;
+            if (!HttpUtils::parseJsonMessage(request.body, request_parsed, parse_error)) {
+                respond(connection, 400, "Bad Request", HttpUtils::buildJsonError(parse_error));
+                return;
+            }
+            // Rejected while it is cheap, before the request takes a pool slot or a place in a worker ring
+            uint32_t retry_after_s = 0;
+            auto ticket = task_dispatcher->admit(&request_parsed, 1, retry_after_s);
+            if (!ticket) {
+                respond_retry_later(connection, 429, request_parsed.deadline_ms ? "Deadline cannot be met, server busy" : "Server busy", retry_after_s);
+                return;
+            }
+            if (traced) trace.admitted_ns = Trace::now_ns();
+            // Tokenization and waiting for ring space may take a while, the pool does that part
+            bool queued = dispatch_pool->submit([this, connection, request_parsed, ticket]() mutable {
+                handleProcess(connection, request_parsed, ticket);
+            });
+            if (!queued) {
+                DEBUG_CERR("Dispatch queue full, rejecting request");
+                dispatch_queue_full_.fetch_add(1, std::memory_order_relaxed);
+                respond(connection, 503, "Service Unavailable", "{\"error\": \"Server busy\"}");
+            }
+        } else if (request.method == "POST" && request.path == "/process_batch") {
+            std::vector<ProcessRequest> items;
+            std::string parse_error;
+            if (!HttpUtils::parseBatchRequest(request.body, items, parse_error, header_priority)) {
+                respond(connection, 400, "Bad Request", HttpUtils::buildJsonError(parse_error));
+                return;
+            }
+            uint32_t retry_after_s = 0;
+            auto ticket = task_dispatcher->admit(items.data(), items.size(), retry_after_s);
+            if (!ticket) {
+                respond_retry_later(connection, 429, "Server busy", retry_after_s);
+                return;
+            }
+            if (traced) {
+                RequestTrace trace{true, connection->request_read_start_ns(), received_ns, Trace::now_ns()};
+                for (ProcessRequest& item : items) item.trace = trace;
+            }
+            bool queued = dispatch_pool->submit([this, connection, items = std::move(items), ticket]() {
+                handleProcessBatch(connection, items, ticket);
+            });
+            if (!queued) {
+                DEBUG_CERR("Dispatch queue full, rejecting request");
+                dispatch_queue_full_.fetch_add(1, std::memory_order_relaxed);
+                respond(connection, 503, "Service Unavailable", "{\"error\": \"Server busy\"}");
+            }
+        } else if (request.method == "GET" && request.path == "/ping") {
+            respond(connection, 200, "OK", "{\"status\": \"ok\"}");
+        } else if (request.method == "GET" && request.path == "/metrics") {
+            respond(connection, 200, "OK", buildMetrics(), "", "text/plain; version=0.0.4");
+        } else if (request.method == "GET" && request.path == "/trace") {
+            // The dump runs to megabytes with full rings, a pool thread builds it
+            bool queued = dispatch_pool->submit([this, connection]() {
+                std::string out;
+                task_dispatcher->append_trace(out);
+                respond(connection, 200, "OK", out);
+            });
+            if (!queued) {
+                dispatch_queue_full_.fetch_add(1, std::memory_order_relaxed);
+                respond(connection, 503, "Service Unavailable", "{\"error\": \"Server busy\"}");
+            }
+        } else {
+            respond(connection, 404, "Not Found", "{\"error\": \"Endpoint not found\"}");
+        }
+    }
 
+    // GET /metrics, Prometheus text format. Reads counters only, cheap enough for the event loop thread.
+    std::string buildMetrics() const {
+        std::string out;
+        out.reserve(32 * 1024);
+        task_dispatcher->append_metrics(out);
+        Metrics::append_family(out, "tinyllm_active_connections", "gauge", "Open client connections.");
+        Metrics::append_sample(out, "tinyllm_active_connections", "", active_connections_.load(std::memory_order_relaxed));
+        Metrics::append_family(out, "tinyllm_dispatch_queue_full_total", "counter", "Requests answered 503 because the dispatch queue was full.");
+        Metrics::append_sample(out, "tinyllm_dispatch_queue_full_total", "", static_cast<double>(dispatch_queue_full_.load(std::memory_order_relaxed)));
+        return out;
+    }
 
-                std::atomic<bool> client_connected(true);
-                auto chunk_callback = [clientSocket, &client_connected](const std::string& chunk_data) -> bool {
-                    if (!client_connected) return false; // Stop if already disconnected
-                    std::string chunk = HttpUtils::buildHttpChunk(chunk_data);
-                    if(send(clientSocket, chunk.c_str(), chunk.length(), 0) == SOCKET_ERROR) {
-                        DEBUG_CERR("Failed to send chunk");
-                        client_connected.store(false);
-                        return false;
-                    }
-                    return true;
-                };
-
-                task_dispatcher->process_message(chunk_callback, request_parsed.message, request_parsed.max_tokens);
-
-                // Send final zero-length chunk
-                if (client_connected) {
-                    std::string final_chunk = "0\r\n\r\n";
-                    if(send(clientSocket, final_chunk.c_str(), final_chunk.length(), 0) == SOCKET_ERROR) {
-                        DEBUG_CERR("Failed to send final chunk");
-                    }
+    // POST /process on a dispatch pool thread
+    // ticket keeps the request's tokens counted as queued until the response is done
+    void handleProcess(const std::shared_ptr<Connection>& connection, ProcessRequest& request_parsed,
+                       const std::shared_ptr<AdmissionController::Ticket>& ticket) {
+        if (!connection->is_connected()) {
+            connection->finish_response();      // gone while the request waited in the pool
+            return;
+        }
+        if (request_parsed.trace.sampled) request_parsed.trace.pool_start_ns = steady_ns();
+        if (request_parsed.deadline_ns != 0 && steady_ns() > request_parsed.deadline_ns) {
+            task_dispatcher->record_expired_before_dispatch();
+            respond_retry_later(connection, 503, "Deadline exceeded before the request reached a worker", task_dispatcher->retry_after_s());
+            return;
+        }
+        std::string reject_reason;
+        if (!task_dispatcher->prepare_request(request_parsed, reject_reason)) {
+            // Over-length prompt (in tokens), rejected before it takes a queue slot on any worker
+            respond(connection, 413, "Payload Too Large", HttpUtils::buildJsonError(reject_reason));
+            return;
+        }
+        if (request_parsed.trace.sampled) request_parsed.trace.prepared_ns = steady_ns();
+        // The header (and the prompt echo) wait in the connection's output buffer and leave with the first tokens
+        if (!connection->queue(HttpUtils::buildHttpChunkedResponseHeader(200, "OK", connection->keeps_alive()))) {
+            DEBUG_CERR("Failed to queue header");
+        }
+
+        auto chunk_callback = [connection](const std::string& chunk_data) -> bool {
+            if (!connection->queue_chunk(chunk_data)) {
+                DEBUG_CERR("Failed to send chunk");
+                return false;
+            }
+            return true;
+        };
+        // The worker's frames go out as they sit in shared memory, behind what the connection queued, one writev per
+        // batch the response pump lets through. What the socket does not take right away is copied and flushed by the event loop.
+        auto stream_callback = [connection](struct iovec* parts, int part_count) -> bool {
+            if (!connection->send(parts, part_count)) {
+                DEBUG_CERR("Failed to send chunk");
+                return false;
+            }
+            return true;
+        };
+        // A finished stream ended the chunked body itself, otherwise send the final zero-length chunk.
+        // Once the output is flushed the event loop reads the next request, or closes the connection.
+        auto on_finished = [connection, ticket](bool body_complete) {     // the ticket goes with the last copy of this
+            if (!body_complete && connection->is_connected()) {
+                if (!connection->queue("0\r\n\r\n")) {
+                    DEBUG_CERR("Failed to send final chunk");
                 }
-            } else {
-                std::string response = HttpUtils::buildHttpResponse(400, "Bad Request", "{\"error\": \"Invalid JSON or missing message field\"}");
-                send(clientSocket, response.c_str(), response.length(), 0);
             }
-        } else if (request.method == "GET" && request.path == "/ping") {
-            DEBUG_COUT("Handling /ping request from client " << clientSocket);
-            std::string response = HttpUtils::buildHttpResponse(200, "OK", "{\"status\": \"ok\"}");
-            send(clientSocket, response.c_str(), response.length(), 0);
-            DEBUG_COUT("Finished /ping request for client " << clientSocket);
-        } else {
-            std::string response = HttpUtils::buildHttpResponse(404, "Not Found", "{\"error\": \"Endpoint not found\"}");
-            send(clientSocket, response.c_str(), response.length(), 0);
+            connection->finish_response();
+        };
+
+        // Returns once the request is queued, the response is streamed by the dispatcher's response pump
+        task_dispatcher->process_message(chunk_callback, stream_callback, on_finished, request_parsed);
+    }
+
+    // POST /process_batch on a dispatch pool thread. The body is NDJSON, one line per item in the order they finish.
+    void handleProcessBatch(const std::shared_ptr<Connection>& connection, const std::vector<ProcessRequest>& items,
+                            const std::shared_ptr<AdmissionController::Ticket>& ticket) {
+        if (!connection->is_connected()) {
+            connection->finish_response();
+            return;
+        }
+        if (!connection->queue(HttpUtils::buildHttpChunkedResponseHeader(200, "OK", connection->keeps_alive(), "application/x-ndjson"))) {
+            DEBUG_CERR("Failed to queue header");
         }
+        // Lines of several workers' tasks arrive from the response pump, each call whole lines as one chunk
+        auto on_lines = [connection](std::string_view lines) -> bool {
+            if (!lines.empty() && !connection->queue_chunk(lines)) {
+                DEBUG_CERR("Failed to send chunk");
+                return false;
+            }
+            return connection->send(nullptr, 0);
+        };
+        auto on_finished = [connection, ticket]() {
+            if (connection->is_connected() && !connection->queue("0\r\n\r\n")) {
+                DEBUG_CERR("Failed to send final chunk");
+            }
+            connection->finish_response();
+        };
+        task_dispatcher->process_batch(items, on_lines, on_finished);
     }
 
     void run() {
@@ -177,61 +335,43 @@ public:
             std::cout << "Task dispatcher initialized successfully, worker processes are ready to serve requests" << std::endl;
         }
         
-        if (!initializeSocket()) {
-            std::cerr << "Failed to initialize socket, quitting..." << std::endl;
-            return;
+        auto& config = AppConfig::get_instance();
+        int loop_count = config.get_int("EVENT_LOOPS", 0);
+        if (loop_count <= 0) loop_count = std::max(1u, std::thread::hardware_concurrency());     // one per core
+        bool reuse_port = config.get_int("LISTEN_REUSEPORT", 1) != 0 && loop_count > 1;
+        for (int i = 0; i < (reuse_port ? loop_count : 1); ++i) {
+            if (!initializeSocket(reuse_port)) {
+                std::cerr << "Failed to initialize socket, quitting..." << std::endl;
+                task_dispatcher->stop_monitor_thread();
+                return;
+            }
+        }
+        dispatch_pool = std::make_unique<ThreadPool>(std::max(1, config.get_int("DISPATCH_THREADS", 4)), std::max(1, config.get_int("DISPATCH_QUEUE", 1024)));
+        ConnectionLimits limits;
+        limits.max_connections = max_connections_;
+        limits.idle_timeout_ms = config.get_int("IDLE_TIMEOUT_MS", 5000);
+        limits.max_requests = static_cast<uint32_t>(std::max(1, config.get_int("MAX_REQUESTS_PER_CONNECTION", 1000)));
+        for (int i = 0; i < loop_count; ++i) {
+            auto handler = [this](const std::shared_ptr<Connection>& connection, const HttpRequestView& request) { handleRequest(connection, request); };
+            event_loops.push_back(std::make_unique<EventLoop>(i, serverSockets[i % serverSockets.size()], handler, active_connections_, limits));
+            if (!event_loops.back()->start()) {
+                std::cerr << "Failed to start event loop " << i << ", quitting..." << std::endl;
+                task_dispatcher->stop_monitor_thread();
+                return;
+            }
         }
 
-        std::cout << "Server running on http://0.0.0.0:" << port << std::endl;
+        std::cout << "Server running on http://0.0.0.0:" << port << " with " << loop_count << " event loops"
+                  << (reuse_port ? ", one listening socket each" : "") << std::endl;
         std::cout << "Available endpoints:" << std::endl;
         std::cout << "  POST /process - Process a message" << std::endl;
+        std::cout << "  GET /metrics - Prometheus metrics" << std::endl;
+        std::cout << "  GET /trace - Chrome trace of the sampled requests" << std::endl;
         std::cout << "Press Ctrl+C to stop the server" << std::endl;
 
-        // Main server loop: Listen for incoming connections until shutdown (ctrl+c) is signaled. This is crucial for graceful shutdown, when the class is deconstructed, it will bring down all the child processes.
+        // The event loops serve every connection, this thread only waits for shutdown (ctrl+c). This is crucial for graceful shutdown, when the class is deconstructed, it will bring down all the child processes.
         while (!global_shutdown_flag.load()) {
-            // Prepare file descriptor set for select
-            fd_set read_fds;                    // struct that contains a list of file descriptors to monitor
-            FD_ZERO(&read_fds);                 // initialize the set to empty
-            FD_SET(serverSocket, &read_fds);    // add the server socket to the set, this way file descriptor for server socket is monitored for read events
-
-            // Set timeout to periodically check shutdown flag.
-            struct timeval timeout; 
-            timeout.tv_sec = 1;
-            timeout.tv_usec = 0;   // This is the damn problem, timeval struct has to be initialized both the sec and usec, otherwise the will hold garbage !
-
- 
-            DEBUG_COUT("Waiting for connection on select()...");
-            // Wait for activity on server socket or timeout
-            int activity = select(serverSocket + 1, &read_fds, nullptr, nullptr, &timeout);  // system call that monitors multiple file descriptors (like sockets). 0 = timeout, > 0 = activity, < 0 = error
-            if ((activity < 0) && (errno!=EINTR)) { DEBUG_CERR("Select error: " << strerror(errno));}
-            else if (activity > 0) { DEBUG_COUT("select() returned activity. Accepting connection..."); }
-
-
-            if (activity > 0 && FD_ISSET(serverSocket, &read_fds)) { // FD_ISSET checks if server socket is in the set
-                sockaddr_in clientAddr;
-                socklen_t clientAddrLen = sizeof(clientAddr);
-                
-                SOCKET clientSocket = accept(serverSocket, (sockaddr*)&clientAddr, &clientAddrLen); // accept the connection after select syscall confirm there is activity on server socket
-                if (clientSocket == INVALID_SOCKET) {
-                    if (global_shutdown_flag.load()) break;
-                    DEBUG_COUT("Accept failed: Invalid socket");
-                    continue;
-                }
-
-                if (active_connections_.load(std::memory_order_relaxed) >= max_connections_) {
-                    DEBUG_CERR("Max connections reached (" << max_connections_ << "). Rejecting new connection.");
-                    std::string response = HttpUtils::buildHttpResponse(503, "Service Unavailable", "{\"error\": \"Max connections reached\"}");
-                    send(clientSocket, response.c_str(), response.length(), 0);
-                    closesocket(clientSocket);
-                    continue;
-                }
-                active_connections_++;
-                DEBUG_COUT("Connection accepted. Active connections: " << active_connections_.load(std::memory_order_relaxed));
-
-                // Handle client in a separate thread. Fixed, the tradeoff to implement asyncronous loop is not worth it.
-                std::thread clientThread(&HttpInferenceServer::handleClient, this, clientSocket);
-                clientThread.detach();
-            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
         }
         task_dispatcher->stop_monitor_thread();
         DEBUG_COUT("\nShutdown signal received, closing server...");
@@ -244,6 +384,13 @@ int main() {
     signal(SIGPIPE, SIG_IGN);                // Ignore SIGPIPE to prevent crashes on broken client connections
     std::cout << "Starting Mock Inference Server..." << std::endl;
 
+    // One descriptor per connection, lift the soft limit (often 1024) to the hard one
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
     // Load configuration
     if (!AppConfig::get_instance().load("config.txt")) {
         std::cerr << "Failed to load configuration file. Exiting." << std::endl;
@@ -256,23 +403,36 @@ int main() {
     std::cout << "  WORKER_EXECUTABLE_PATH: " << config.get_string("WORKER_EXECUTABLE_PATH", "./build/worker") << std::endl;
     std::cout << "  MIN_WORKERS: " << config.get_int("MIN_WORKERS", 2) << std::endl;
     std::cout << "  MAX_WORKERS_DYNAMIC: " << config.get_int("MAX_WORKERS_DYNAMIC", 4) << std::endl;
+    std::cout << "  QUEUE_DEPTH: " << config.get_int("QUEUE_DEPTH", 32) << std::endl;
+    std::cout << "  HUGE_PAGES: " << config.get_int("HUGE_PAGES", 0) << std::endl;
+    std::cout << "  WORKER_STALL_TIMEOUT_MS: " << config.get_int("WORKER_STALL_TIMEOUT_MS", 30000) << std::endl;
     std::cout << "  MODEL_PATH: " << config.get_string("MODEL_PATH", "model/weights") << std::endl;
     std::cout << "  TOKENIZER_PATH: " << config.get_string("TOKENIZER_PATH", "model/tinystories_tokenizer_vocab.json") << std::endl;
     std::cout << "  SHM_NAME: " << config.get_string("SHM_NAME", "/inference_shm") << std::endl;
-    std::cout << "  SEM_REQ_ITEMS_PREFIX: " << config.get_string("SEM_REQ_ITEMS_PREFIX", "/sem_req_items_") << std::endl;
-    std::cout << "  SEM_REQ_SPACE_PREFIX: " << config.get_string("SEM_REQ_SPACE_PREFIX", "/sem_req_space_") << std::endl;
-    std::cout << "  SEM_RESP_PREFIX: " << config.get_string("SEM_RESP_PREFIX", "/sem_resp_") << std::endl;
-    std::cout << "  SEM_RESP_CONSUMED_PREFIX: " << config.get_string("SEM_RESP_CONSUMED_PREFIX", "/sem_resp_consumed_") << std::endl;
-    std::cout << "  MAX_CONNECTIONS: " << config.get_int("MAX_CONNECTIONS", 20) << std::endl;
-    std::cout << "Note that the number of worker and client connections are capped to 5 and 20 respectively" << std::endl;
+    std::cout << "  MAX_CONNECTIONS: " << config.get_int("MAX_CONNECTIONS", 10000) << std::endl;
+    std::cout << "  EVENT_LOOPS: " << config.get_int("EVENT_LOOPS", 0) << std::endl;
+    std::cout << "  LISTEN_REUSEPORT: " << config.get_int("LISTEN_REUSEPORT", 1) << std::endl;
+    std::cout << "  IDLE_TIMEOUT_MS: " << config.get_int("IDLE_TIMEOUT_MS", 5000) << std::endl;
+    std::cout << "  MAX_REQUESTS_PER_CONNECTION: " << config.get_int("MAX_REQUESTS_PER_CONNECTION", 1000) << std::endl;
+    std::cout << "  DISPATCH_THREADS: " << config.get_int("DISPATCH_THREADS", 4) << std::endl;
+    std::cout << "  DISPATCH_QUEUE: " << config.get_int("DISPATCH_QUEUE", 1024) << std::endl;
+    std::cout << "  SERVER_TOKENIZATION: " << config.get_int("SERVER_TOKENIZATION", 0) << std::endl;
+    std::cout << "  MAX_PROMPT_TOKENS: " << config.get_int("MAX_PROMPT_TOKENS", 462) << std::endl;
+    std::cout << "  RESP_FLUSH_TOKENS: " << config.get_int("RESP_FLUSH_TOKENS", 1) << std::endl;
+    std::cout << "  RESP_FLUSH_INTERVAL_US: " << config.get_int("RESP_FLUSH_INTERVAL_US", 0) << std::endl;
+    std::cout << "  OUTPUT_FLUSH_US: " << config.get_int("OUTPUT_FLUSH_US", 1000) << std::endl;
+    std::cout << "  MAX_QUEUE_WAIT_MS: " << config.get_int("MAX_QUEUE_WAIT_MS", 10000) << std::endl;
+    std::cout << "  ADMISSION_TOKENS_PER_SEC: " << config.get_int("ADMISSION_TOKENS_PER_SEC", 50) << std::endl;
+    std::cout << "  SCHEDULER_TASKS_PER_WORKER: " << config.get_int("SCHEDULER_TASKS_PER_WORKER", 1) << std::endl;
+    std::cout << "  SCHEDULER_AGING_MS: " << config.get_int("SCHEDULER_AGING_MS", 20) << std::endl;
+    std::cout << "  TRACE_SAMPLE_RATE: " << config.get_int("TRACE_SAMPLE_RATE", 100) << std::endl;
     std::cout << "---------------------------------" << std::endl;
 
     // Minimal Oatpp usage - just for environment initialization
     // oatpp::base::Environment::init();
     try {
-        int max_connections = config.get_int("MAX_CONNECTIONS", 20);
-        max_connections = std::min(max_connections, 20);
-        HttpInferenceServer server(8080, config.get_int("MAX_CONNECTIONS", 20));
+        int max_connections = config.get_int("MAX_CONNECTIONS", 10000);
+        HttpInferenceServer server(8080, max_connections);
         server.run();
         
     } catch (const std::exception& e) {
@@ -0,0 +1,62 @@
+#include "admission_control.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+
+static constexpr uint64_t RATE_SAMPLE_NS = 500ull * 1000 * 1000;          // at most one rate sample per this
+static constexpr uint64_t RATE_MAX_INTERVAL_NS = 5000ull * 1000 * 1000;   // longer gaps may hide idle time, the sample is skipped
+static constexpr double RATE_SMOOTHING = 0.3;                             // weight of a new sample
+
+static uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+AdmissionController::AdmissionController(IPCManager* ipc, uint32_t max_queue_wait_ms, double initial_tokens_per_sec)
+    : ipc_manager(ipc), max_queue_wait_ms(max_queue_wait_ms), queued(0), rate(std::max(initial_tokens_per_sec, 1.0)), rejected(0), rejected_deadline(0),
+      last_sample_ns(0), last_generated(0), busy_since_sample(false) {}
+
+uint64_t AdmissionController::generated_tokens() const {
+    uint64_t total = 0;
+    for (int i = 0; i < ipc_manager->get_max_workers(); ++i) {
+        total += ipc_manager->get_generated_tokens(i);
+    }
+    return total;
+}
+
+void AdmissionController::sample_rate(uint64_t now_ns) {
+    std::unique_lock<std::mutex> lock(sample_mutex, std::try_to_lock);
+    if (!lock.owns_lock() || (last_sample_ns != 0 && now_ns - last_sample_ns < RATE_SAMPLE_NS)) return;
+
+    uint64_t generated = generated_tokens();
+    bool busy = queued.load(std::memory_order_relaxed) > 0;
+    // Only an interval with work queued at both ends says how fast the workers go
+    if (busy && busy_since_sample && now_ns - last_sample_ns <= RATE_MAX_INTERVAL_NS && generated > last_generated) {
+        double sample = static_cast<double>(generated - last_generated) * 1e9 / static_cast<double>(now_ns - last_sample_ns);
+        rate.store(rate.load(std::memory_order_relaxed) * (1.0 - RATE_SMOOTHING) + sample * RATE_SMOOTHING, std::memory_order_relaxed);
+    }
+    last_sample_ns = now_ns;
+    last_generated = generated;
+    busy_since_sample = busy;
+}
+
+std::shared_ptr<AdmissionController::Ticket> AdmissionController::admit(uint64_t tokens, uint32_t deadline_ms, uint32_t& retry_after_s) {
+    sample_rate(steady_ns());
+    double wait_ms = static_cast<double>(queued.load(std::memory_order_relaxed)) * 1000.0 / rate.load(std::memory_order_relaxed);
+    double limit_ms = max_queue_wait_ms ? max_queue_wait_ms : std::numeric_limits<double>::infinity();
+    if (deadline_ms) limit_ms = std::min(limit_ms, static_cast<double>(deadline_ms));
+    if (wait_ms > limit_ms) {
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        if (deadline_ms && (max_queue_wait_ms == 0 || deadline_ms < max_queue_wait_ms)) rejected_deadline.fetch_add(1, std::memory_order_relaxed);
+        retry_after_s = static_cast<uint32_t>(std::max(1.0, std::ceil((wait_ms - limit_ms) / 1000.0)));
+        return nullptr;
+    }
+    queued.fetch_add(tokens, std::memory_order_relaxed);
+    return std::make_shared<Ticket>(this, tokens);
+}
+
+uint32_t AdmissionController::retry_after_s() {
+    double wait_s = static_cast<double>(queued.load(std::memory_order_relaxed)) / rate.load(std::memory_order_relaxed);
+    return static_cast<uint32_t>(std::max(1.0, std::ceil(wait_s)));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../ipc/ipc_utils.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Admission control in front of the worker rings. Every admitted request counts its token budget as queued until its
+// response is done, the expected wait of a newcomer is the queued tokens over the measured generation rate. A request is
+// turned away up front when that wait is over MAX_QUEUE_WAIT_MS or over its own deadline, instead of piling up in front
+// of full rings where every queued request only adds to the latency of the ones behind it.
+//
+// The rate is the growth of the workers' generated token counters, sampled while there is queued work (an idle server
+// says nothing about its speed) and smoothed over samples. Until the first sample it is ADMISSION_TOKENS_PER_SEC.
+class AdmissionController {
+public:
+    // The queued tokens of an admitted request, released when the last copy is dropped
+    class Ticket {
+    public:
+        Ticket(AdmissionController* owner, uint64_t tokens) : owner(owner), tokens(tokens) {}
+        ~Ticket() { owner->release(tokens); }
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+    private:
+        AdmissionController* owner;
+        uint64_t tokens;
+    };
+
+    // max_queue_wait_ms 0 only rejects on deadlines
+    AdmissionController(IPCManager* ipc, uint32_t max_queue_wait_ms, double initial_tokens_per_sec);
+
+    // Admit a request that generates up to tokens and has to start within deadline_ms (0 = no deadline). nullptr when
+    // it would wait too long, retry_after_s then says in how many seconds the queue should have drained enough.
+    std::shared_ptr<Ticket> admit(uint64_t tokens, uint32_t deadline_ms, uint32_t& retry_after_s);
+    // Seconds until the current queue drains, for requests dropped after admission
+    uint32_t retry_after_s();
+
+    uint64_t queued_tokens() const { return queued.load(std::memory_order_relaxed); }
+    double tokens_per_sec() const { return rate.load(std::memory_order_relaxed); }
+    uint64_t rejected_count() const { return rejected.load(std::memory_order_relaxed); }
+    // Of those, the ones turned away because of their own deadline rather than MAX_QUEUE_WAIT_MS
+    uint64_t rejected_deadline_count() const { return rejected_deadline.load(std::memory_order_relaxed); }
+
+private:
+    IPCManager* ipc_manager;
+    uint32_t max_queue_wait_ms;
+    std::atomic<uint64_t> queued;       // token budgets of the admitted requests not done yet
+    std::atomic<double> rate;           // tokens/sec
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> rejected_deadline;
+
+    std::mutex sample_mutex;            // try-locked, one caller samples at a time and the others go on with the last rate
+    uint64_t last_sample_ns;
+    uint64_t last_generated;
+    bool busy_since_sample;             // queued work at the last sample, the interval since counts towards the rate
+
+    void release(uint64_t tokens) { queued.fetch_sub(tokens, std::memory_order_relaxed); }
+    void sample_rate(uint64_t now_ns);
+    uint64_t generated_tokens() const;
+};
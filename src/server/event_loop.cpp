@@ -0,0 +1,452 @@
+#include "event_loop.hpp"
+#include "../utils/trace.hpp"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <chrono>
+#include <algorithm>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+// #define DEBUG_PRINT
+
+
+#ifdef DEBUG_PRINT
+#define DEBUG_COUT(x) std::cout << x << std::endl
+#define DEBUG_CERR(x) std::cerr << x << std::endl
+#else
+#define DEBUG_COUT(x)
+#define DEBUG_CERR(x)
+#endif
+
+
+static uint64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Connection::Connection(EventLoop* loop, SOCKET sock)
+    : loop(loop), sock(sock), connected(true), state(State::ReadingRequest), input_closed(false), input_capacity(0), input_length(0), requests_served(0), idle_deadline_ms(0),
+      read_start_ns(0), keep_alive(false), output_sent(0), output_blocked(false), response_done(false) {}
+
+Connection::~Connection() {
+    closesocket(sock);
+}
+
+bool Connection::send(struct iovec* parts, int part_count) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (!connected.load(std::memory_order_relaxed)) return false;
+
+    // Holding the lock across the write keeps the loop's EPOLLOUT flush from running between a short write here and the
+    // copy of the rest below
+    if (!write_locked(parts, part_count)) {
+        connected.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    return output_within_limit_locked();
+}
+
+bool Connection::send(const std::string& data) {
+    struct iovec part = {const_cast<char*>(data.data()), data.length()};
+    return send(&part, 1);
+}
+
+bool Connection::queue(std::string_view data) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (!connected.load(std::memory_order_relaxed)) return false;
+    output.append(data.data(), data.size());
+    return output_within_limit_locked();
+}
+
+bool Connection::queue_chunk(std::string_view data) {
+    char size_line[20];
+    int size_length = std::snprintf(size_line, sizeof(size_line), "%zx\r\n", data.size());
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (!connected.load(std::memory_order_relaxed)) return false;
+    // Framed straight into the output buffer, which keeps its capacity from one response to the next
+    output.append(size_line, size_length).append(data.data(), data.size()).append("\r\n", 2);
+    return output_within_limit_locked();
+}
+
+void Connection::finish_response() {
+    {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        response_done = true;
+        if (connected.load(std::memory_order_relaxed) && !write_locked(nullptr, 0)) {
+            connected.store(false, std::memory_order_relaxed);
+        }
+        if (!output_drained_locked() && connected.load(std::memory_order_relaxed)) return;     // the EPOLLOUT flush takes it from there
+    }
+    loop->post(shared_from_this());
+}
+
+bool Connection::write_locked(struct iovec* parts, int part_count) {
+    const size_t buffered = output.size() - output_sent;
+    if (output_blocked || part_count > MAX_SEND_PARTS) {
+        // Behind bytes the socket refused, the EPOLLOUT flush sends these too. Or too many parts for one writev: buffer
+        // them and send it all from the buffer.
+        for (int i = 0; i < part_count; ++i) {
+            output.append(static_cast<const char*>(parts[i].iov_base), parts[i].iov_len);
+        }
+        return output_blocked || flush_output_locked();
+    }
+    if (buffered == 0 && part_count == 0) return true;
+
+    // Buffered bytes first, then the new ones, in one writev
+    struct iovec iov[1 + MAX_SEND_PARTS];
+    int iov_count = 0;
+    if (buffered > 0) iov[iov_count++] = {&output[output_sent], buffered};
+    for (int i = 0; i < part_count; ++i) iov[iov_count++] = parts[i];
+    struct iovec* remaining = iov;
+    ssize_t written = HttpUtils::writeAvailable(sock, remaining, iov_count);
+    if (written < 0) return false;
+
+    if (static_cast<size_t>(written) < buffered) {
+        output_sent += written;
+        for (int i = 0; i < part_count; ++i) {
+            output.append(static_cast<const char*>(parts[i].iov_base), parts[i].iov_len);
+        }
+    } else {
+        output.clear();
+        output_sent = 0;
+        for (int i = 0; i < iov_count; ++i) {   // what is left of the new parts
+            output.append(static_cast<const char*>(remaining[i].iov_base), remaining[i].iov_len);
+        }
+    }
+    output_blocked = !output_drained_locked();
+    return true;
+}
+
+bool Connection::output_within_limit_locked() {
+    if (output.size() - output_sent > MAX_PENDING_OUTPUT) {
+        DEBUG_CERR("Client on socket " << sock << " stopped reading, dropping it");
+        connected.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool Connection::flush_output_locked() {
+    if (output_drained_locked()) return true;
+    struct iovec part = {&output[output_sent], output.size() - output_sent};
+    struct iovec* parts = &part;
+    int part_count = 1;
+    ssize_t written = HttpUtils::writeAvailable(sock, parts, part_count);
+    if (written < 0) return false;
+    output_sent += written;
+    if (output_drained_locked()) {
+        output.clear();
+        output_sent = 0;
+    }
+    output_blocked = !output_drained_locked();
+    return true;
+}
+
+
+EventLoop::EventLoop(int index, SOCKET listen_socket, RequestHandler handler, std::atomic<int>& active_connections, const ConnectionLimits& limits)
+    : index(index), listen_socket(listen_socket), handler(std::move(handler)), active_connections(active_connections),
+      limits(limits), epoll_fd(-1), wakeup_fd(-1), should_stop(false) {}
+
+EventLoop::~EventLoop() {
+    stop();
+    for (auto& entry : connections) {
+        entry.second->state = Connection::State::Closed;
+        entry.second->connected.store(false);
+        active_connections--;
+    }
+    connections.clear();
+    idle_timers.clear();
+    posted.clear();
+    if (wakeup_fd != -1) close(wakeup_fd);
+    if (epoll_fd != -1) close(epoll_fd);
+}
+
+bool EventLoop::start() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wakeup_fd == -1) {
+        std::cerr << "Failed to create event loop " << index << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = wakeup_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &event) == -1) {
+        std::cerr << "Failed to register the wakeup eventfd of event loop " << index << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    // Level triggered, only one of the loops waiting on a shared socket is woken per incoming connection
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = listen_socket;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_socket, &event) == -1) {
+        std::cerr << "Failed to register the listening socket with event loop " << index << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    should_stop.store(false);
+    loop_thread = std::thread([this]() { run(); });
+    return true;
+}
+
+void EventLoop::stop() {
+    if (!loop_thread.joinable()) return;
+    should_stop.store(true);
+    uint64_t one = 1;
+    ssize_t written = write(wakeup_fd, &one, sizeof(one));
+    (void)written;
+    loop_thread.join();
+}
+
+void EventLoop::post(std::shared_ptr<Connection> connection) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex);
+        posted.push_back(std::move(connection));
+    }
+    uint64_t one = 1;
+    ssize_t written = write(wakeup_fd, &one, sizeof(one));
+    (void)written;
+}
+
+void EventLoop::run() {
+    epoll_event events[256];
+    std::vector<std::shared_ptr<Connection>> woken;
+    while (!should_stop.load()) {
+        int n = epoll_wait(epoll_fd, events, 256, expire_idle_connections());
+        if (n < 0 && errno != EINTR) {
+            std::cerr << "Event loop " << index << " epoll_wait failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeup_fd) {
+                uint64_t count;
+                ssize_t drained = read(wakeup_fd, &count, sizeof(count));
+                (void)drained;
+                {
+                    std::lock_guard<std::mutex> lock(posted_mutex);
+                    woken.swap(posted);
+                }
+                for (auto& connection : woken) service(connection);
+                woken.clear();
+                continue;
+            }
+            if (fd == listen_socket) {
+                accept_connections();
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end()) continue;
+            std::shared_ptr<Connection> connection = it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                DEBUG_COUT("Socket " << fd << " hung up");
+                close_connection(connection);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) handle_output(connection);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) handle_input(connection);
+        }
+    }
+}
+
+void EventLoop::accept_connections() {
+    while (true) {
+        SOCKET client_socket = accept4(listen_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                DEBUG_CERR("Accept failed: " << strerror(errno));
+            }
+            return;     // another loop took it, or out of descriptors until some connection closes
+        }
+
+        if (active_connections.load(std::memory_order_relaxed) >= limits.max_connections) {
+            DEBUG_CERR("Max connections reached (" << limits.max_connections << "). Rejecting new connection.");
+            std::string response = HttpUtils::buildHttpResponse(503, "Service Unavailable", "{\"error\": \"Max connections reached\"}");
+            ssize_t written = ::send(client_socket, response.c_str(), response.length(), MSG_NOSIGNAL);     // best effort, fresh socket buffers are empty
+            (void)written;
+            closesocket(client_socket);
+            continue;
+        }
+
+        // Set TCP_NODELAY to disable Nagle's algorithm for lower latency
+        int opt = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(opt));
+
+        auto connection = std::make_shared<Connection>(this, client_socket);
+        connection->read_start_ns = Trace::now_ns();
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = client_socket;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+            DEBUG_CERR("Failed to register socket " << client_socket << ": " << strerror(errno));
+            continue;   // closed with the connection
+        }
+        arm_idle_timer(connection);
+        connections.emplace(client_socket, std::move(connection));
+        active_connections++;
+        DEBUG_COUT("Connection accepted on loop " << index << ". Active connections: " << active_connections.load(std::memory_order_relaxed));
+    }
+}
+
+void EventLoop::handle_input(const std::shared_ptr<Connection>& connection) {
+    // Edge triggered: read until the socket is empty, or the next event never comes. The exception is a buffer full of
+    // pipelined requests, the rest stays in the socket and is read once the request in front is done.
+    while (!connection->input_closed && reserve_input(connection)) {
+        ssize_t received = recv(connection->sock, connection->input.get() + connection->input_length,
+                                connection->input_capacity - connection->input_length, 0);
+        if (received > 0) {
+            if (connection->read_start_ns == 0) connection->read_start_ns = Trace::now_ns();
+            connection->input_length += received;
+            continue;
+        }
+        if (received == 0) {
+            // The client closed its side. It may still wait for the responses to what it sent (a half close after
+            // pipelining), those are served and the connection closes after them. A client that is gone for good makes
+            // the next send fail, which cancels a streaming task.
+            DEBUG_COUT("Client on socket " << connection->sock << " closed its side of the connection");
+            connection->input_closed = true;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        close_connection(connection);
+        return;
+    }
+    process_input(connection);
+    if (connection->input_closed && connection->state == Connection::State::ReadingRequest) {
+        close_connection(connection);       // nothing complete left to answer
+    }
+}
+
+bool EventLoop::reserve_input(const std::shared_ptr<Connection>& connection) {
+    if (!connection->input) {
+        connection->input.reset(new char[INPUT_BUFFER_SIZE]);
+        connection->input_capacity = INPUT_BUFFER_SIZE;
+    }
+    if (connection->input_length < connection->input_capacity) return true;
+    if (connection->state != Connection::State::ReadingRequest) return false;
+
+    // Full while reading a request: double it while the headers are coming in (the parser refuses them past
+    // HTTP_MAX_HEADER_BYTES), after that the parsed headers say how large the whole request is
+    if (connection->parser.parse(connection->input.get(), connection->input_length) != HttpRequestParser::Status::Incomplete) return false;
+    size_t needed = connection->parser.request_size();
+    if (needed == 0) needed = std::min(connection->input_capacity * 2, HTTP_MAX_HEADER_BYTES);
+    if (needed <= connection->input_capacity) return false;
+    std::unique_ptr<char[]> grown(new char[needed]);
+    std::memcpy(grown.get(), connection->input.get(), connection->input_length);
+    connection->input = std::move(grown);
+    connection->input_capacity = needed;
+    return true;
+}
+
+void EventLoop::consume_input(const std::shared_ptr<Connection>& connection, size_t length) {
+    connection->parser.reset();
+    connection->input_length -= length;
+    connection->read_start_ns = connection->input_length ? Trace::now_ns() : 0;     // a pipelined request starts now
+    if (connection->input_length == 0) {
+        connection->input.reset();
+        connection->input_capacity = 0;
+    } else if (connection->input_capacity > INPUT_BUFFER_SIZE && connection->input_length <= INPUT_BUFFER_SIZE) {
+        std::unique_ptr<char[]> shrunk(new char[INPUT_BUFFER_SIZE]);
+        std::memcpy(shrunk.get(), connection->input.get() + length, connection->input_length);
+        connection->input = std::move(shrunk);
+        connection->input_capacity = INPUT_BUFFER_SIZE;
+    } else {
+        std::memmove(connection->input.get(), connection->input.get() + length, connection->input_length);
+    }
+}
+
+void EventLoop::process_input(const std::shared_ptr<Connection>& connection) {
+    if (connection->state != Connection::State::ReadingRequest || connection->input_length == 0) return;
+
+    HttpRequestParser::Status status = connection->parser.parse(connection->input.get(), connection->input_length);
+    if (status == HttpRequestParser::Status::Incomplete) return;
+    if (status == HttpRequestParser::Status::Error) {
+        int code = connection->parser.error_status();
+        DEBUG_CERR("Rejected request from client " << connection->sock << ": " << code << " " << connection->parser.error_message());
+        respond(connection, code, HttpUtils::statusText(code), std::string("{\"error\": \"") + connection->parser.error_message() + "\"}");
+        return;
+    }
+
+    HttpRequestView request = connection->parser.request(connection->input.get());
+    DEBUG_COUT("Parsed request from client " << connection->sock << ": " << request.method << " " << request.path);
+    connection->state = Connection::State::Processing;
+    connection->requests_served++;
+    connection->keep_alive = request.keep_alive && connection->requests_served < limits.max_requests;
+    handler(connection, request);
+    consume_input(connection, connection->parser.request_size());
+}
+
+void EventLoop::handle_output(const std::shared_ptr<Connection>& connection) {
+    bool close_now = false;
+    bool next_request = false;
+    {
+        std::lock_guard<std::mutex> lock(connection->output_mutex);
+        if (!connection->flush_output_locked()) connection->connected.store(false, std::memory_order_relaxed);
+        if (!connection->connected.load(std::memory_order_relaxed)) {
+            close_now = true;
+        } else if (connection->response_done && connection->output_drained_locked()) {
+            connection->response_done = false;
+            next_request = connection->keep_alive;
+            close_now = !next_request;
+        }
+    }
+    if (close_now) {
+        close_connection(connection);
+    } else if (next_request) {
+        // Whatever the client pipelined behind the finished request is buffered, or still in the socket when the buffer filled up
+        connection->state = Connection::State::ReadingRequest;
+        arm_idle_timer(connection);
+        handle_input(connection);
+    }
+}
+
+void EventLoop::service(const std::shared_ptr<Connection>& connection) {
+    if (connection->state == Connection::State::Closed) return;
+    handle_output(connection);
+}
+
+void EventLoop::arm_idle_timer(const std::shared_ptr<Connection>& connection) {
+    if (limits.idle_timeout_ms <= 0) return;
+    connection->idle_deadline_ms = steady_ms() + limits.idle_timeout_ms;
+    idle_timers.emplace_back(connection->idle_deadline_ms, connection);
+}
+
+int EventLoop::expire_idle_connections() {
+    uint64_t now = steady_ms();
+    while (!idle_timers.empty()) {
+        auto& timer = idle_timers.front();
+        std::shared_ptr<Connection> connection = timer.second.lock();
+        // Still reading the same request it was reading when the timer was set
+        bool current = connection && connection->state == Connection::State::ReadingRequest && connection->idle_deadline_ms == timer.first;
+        if (current && timer.first > now) return static_cast<int>(timer.first - now);
+        idle_timers.pop_front();
+        if (current) {
+            DEBUG_COUT("Socket " << connection->sock << " idle for " << limits.idle_timeout_ms << " ms, closing");
+            close_connection(connection);
+        }
+    }
+    return -1;
+}
+
+void EventLoop::close_connection(const std::shared_ptr<Connection>& connection) {
+    if (connection->state == Connection::State::Closed) return;
+    connection->state = Connection::State::Closed;
+    connection->connected.store(false);     // a response still streaming stops at its next send
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->sock, nullptr);
+    connections.erase(connection->sock);
+    active_connections--;
+    DEBUG_COUT("Connection closed. Active connections: " << active_connections.load(std::memory_order_relaxed));
+}
+
+void EventLoop::respond(const std::shared_ptr<Connection>& connection, int status_code, const std::string& status_text, const std::string& body) {
+    connection->state = Connection::State::Processing;
+    connection->keep_alive = false;     // the rest of the input cannot be trusted to start a request
+    connection->send(HttpUtils::buildHttpResponse(status_code, status_text, body));
+    connection->finish_response();
+}
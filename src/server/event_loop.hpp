@@ -0,0 +1,156 @@
+#pragma once
+
+#include "../utils/http_utils.hpp"
+#include "../utils/http_parser.hpp"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+constexpr size_t INPUT_BUFFER_SIZE = 2 * 1024;         // Initial connection input buffer, doubled up to HTTP_MAX_HEADER_BYTES for large headers and grown to the request size for a large body
+constexpr size_t MAX_PENDING_OUTPUT = 256 * 1024;      // Unsent response bytes a connection may hold before the client counts as gone
+constexpr int MAX_SEND_PARTS = 7;                       // iovecs Connection::send writes behind the buffered bytes in one writev
+
+class EventLoop;
+
+// Per connection limits, from config.txt
+struct ConnectionLimits {
+    int max_connections;        // MAX_CONNECTIONS, over all loops
+    int idle_timeout_ms;        // IDLE_TIMEOUT_MS, a connection must complete its next request within this or is closed, 0 = never
+    uint32_t max_requests;      // MAX_REQUESTS_PER_CONNECTION, the response to the last one carries Connection: close
+};
+
+// An accepted client socket. The event loop that accepted it reads the request and flushes buffered output, any thread
+// (the dispatch pool, the response pump) may send. Shared: a response still streaming keeps the object, and the socket,
+// alive after the loop let go of it. The socket closes with the last reference.
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(EventLoop* loop, SOCKET sock);
+    ~Connection();
+
+    // Write the queued bytes and then parts in one writev, part_count 0 only pushes out the queue. Whatever the socket does
+    // not take is copied and flushed by the event loop once the socket is writable again, no write is tried while it is
+    // not. False once the client is gone, or when a slow client lets more than MAX_PENDING_OUTPUT bytes pile up.
+    bool send(struct iovec* parts, int part_count);
+    bool send(const std::string& data);
+    // Append to the output buffer without writing, the next send or finish_response takes it along
+    bool queue(std::string_view data);
+    // queue data as one HTTP chunk, framed in place
+    bool queue_chunk(std::string_view data);
+    // The response is complete, queued bytes are written. Once the output is out the event loop moves on to the next
+    // request of a keep-alive connection, or closes it. Any thread.
+    void finish_response();
+    bool is_connected() const { return connected.load(std::memory_order_relaxed); }
+    // Whether the connection stays open for another request after the current response, for its Connection header
+    bool keeps_alive() const { return keep_alive; }
+    // steady_clock ns at which reading the current request began, for its trace. Event loop thread, i.e. the request handler.
+    uint64_t request_read_start_ns() const { return read_start_ns; }
+
+private:
+    friend class EventLoop;
+    enum class State {
+        ReadingRequest,     // waiting for a complete request
+        Processing,         // handed to the request handler, the response may still be streaming
+        Closed,             // removed from the loop
+    };
+
+    EventLoop* loop;
+    const SOCKET sock;
+    std::atomic<bool> connected;
+
+    // Event loop thread only
+    State state;
+    // Bytes read and not consumed yet, the request being parsed first. Pipelined requests wait here while the current one is
+    // processed. Allocated once bytes arrive and released when empty, so idle connections hold no buffer.
+    std::unique_ptr<char[]> input;
+    size_t input_capacity;
+    size_t input_length;
+    HttpRequestParser parser;   // resumes on the request at the start of input
+    bool input_closed;          // the client shut down its sending side, close once the buffered requests are answered
+    uint32_t requests_served;
+    uint64_t idle_deadline_ms;  // steady clock ms by which the request being read has to be complete
+    uint64_t read_start_ns;     // steady clock ns of the accept (first request), the first byte or the end of the request in front, 0 = none yet
+
+    bool keep_alive;            // set by the loop before the request goes to the handler, read-only while it is processed
+
+    std::mutex output_mutex;
+    std::string output;         // bytes queued or not taken by the socket yet, the capacity is kept for the next response
+    size_t output_sent;         // prefix of output already written
+    bool output_blocked;        // the last write stopped short, wait for EPOLLOUT
+    bool response_done;
+
+    // Write buffered output, then parts, until the socket would block and buffer the rest. output_mutex held. False on a
+    // socket error.
+    bool write_locked(struct iovec* parts, int part_count);
+    // Write buffered output until the socket would block, output_mutex held. False on a socket error.
+    bool flush_output_locked();
+    // Drops the client when a slow reader let too much pile up
+    bool output_within_limit_locked();
+    bool output_drained_locked() const { return output_sent == output.size(); }
+};
+
+// Non-blocking reactor: one thread, one epoll set with its listening socket (its own with LISTEN_REUSEPORT, else shared
+// by all loops) and the edge-triggered client sockets it accepted. Reads and parses requests, hands complete ones to the request handler (on the loop thread, so the handler
+// must not block) and flushes the output a connection could not write right away. A connection serves its requests one
+// at a time, pipelined ones are parsed once the response in front of them is out, so responses keep the request order.
+class EventLoop {
+public:
+    // request points into the connection's input buffer, only valid during the call
+    using RequestHandler = std::function<void(const std::shared_ptr<Connection>& connection, const HttpRequestView& request)>;
+
+    EventLoop(int index, SOCKET listen_socket, RequestHandler handler, std::atomic<int>& active_connections, const ConnectionLimits& limits);
+    ~EventLoop();
+
+    bool start();
+    // Join the loop thread. Connections stay open until the loop is destroyed.
+    void stop();
+
+    // Have the loop look at the connection again (response finished, client gone), callable from any thread
+    void post(std::shared_ptr<Connection> connection);
+
+private:
+    int index;
+    SOCKET listen_socket;       // when shared by several loops, each wakes for it with EPOLLEXCLUSIVE
+    RequestHandler handler;
+    std::atomic<int>& active_connections;   // over all loops
+    ConnectionLimits limits;
+
+    int epoll_fd;
+    int wakeup_fd;              // post and stop wake the loop through it
+    std::thread loop_thread;
+    std::atomic<bool> should_stop;
+
+    std::unordered_map<SOCKET, std::shared_ptr<Connection>> connections;    // loop thread only
+    // Idle deadlines in the order they were set, which is deadline order as the timeout is the same for all. Entries of
+    // connections that moved on or closed are skipped when they come up.
+    std::deque<std::pair<uint64_t, std::weak_ptr<Connection>>> idle_timers;
+
+    std::mutex posted_mutex;
+    std::vector<std::shared_ptr<Connection>> posted;
+
+    void run();
+    void accept_connections();
+    void handle_input(const std::shared_ptr<Connection>& connection);
+    // Make room to read into. False when the buffer is full and has to be consumed first.
+    bool reserve_input(const std::shared_ptr<Connection>& connection);
+    // Drop the request at the start of the buffer, the pipelined bytes behind it move to the front
+    void consume_input(const std::shared_ptr<Connection>& connection, size_t length);
+    // Parse the next request out of the buffered input and hand it to the handler once complete
+    void process_input(const std::shared_ptr<Connection>& connection);
+    void handle_output(const std::shared_ptr<Connection>& connection);
+    // Once the response is out: start on the next request of a keep-alive connection, otherwise close it. Closes right away when the client is gone.
+    void service(const std::shared_ptr<Connection>& connection);
+    void arm_idle_timer(const std::shared_ptr<Connection>& connection);
+    // Close connections past their idle deadline, returns the epoll_wait timeout until the next one
+    int expire_idle_connections();
+    void close_connection(const std::shared_ptr<Connection>& connection);
+    // Answer a request the loop could not parse and close once sent
+    void respond(const std::shared_ptr<Connection>& connection, int status_code, const std::string& status_text, const std::string& body);
+};
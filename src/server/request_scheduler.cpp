@@ -0,0 +1,111 @@
+#include "request_scheduler.hpp"
+#include <algorithm>
+#include <chrono>
+
+
+static uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+RequestScheduler::RequestScheduler(uint32_t capacity, uint32_t aging_ms)
+    : capacity(capacity), aging_ns(static_cast<uint64_t>(std::max(aging_ms, 1u)) * 1000000), in_flight_count(0), stopping(false) {}
+
+RequestScheduler::~RequestScheduler() {
+    stop();
+}
+
+void RequestScheduler::start() {
+    if (capacity == 0) return;      // nothing ever waits
+    scheduler_thread = std::thread([this]() { run(); });
+}
+
+void RequestScheduler::stop() {
+    std::vector<Task> left;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        left.swap(waiting);
+    }
+    wake.notify_all();
+    if (scheduler_thread.joinable()) scheduler_thread.join();
+    for (Task& task : left) {
+        stats[static_cast<int>(task.priority)].waiting.fetch_sub(1, std::memory_order_relaxed);
+        task.dispatch(false);
+    }
+}
+
+void RequestScheduler::submit(RequestPriority priority, uint64_t cost, Dispatch dispatch) {
+    Task task{priority, cost, steady_ns(), std::move(dispatch)};
+    bool dispatch_now = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!stopping) {
+            if (capacity != 0 && (!waiting.empty() || in_flight_count.load(std::memory_order_relaxed) >= capacity)) {
+                stats[static_cast<int>(priority)].waiting.fetch_add(1, std::memory_order_relaxed);
+                waiting.push_back(std::move(task));
+                return;
+            }
+            in_flight_count.fetch_add(1, std::memory_order_relaxed);
+            dispatch_now = true;
+        }
+    }
+    if (dispatch_now) record_dispatch(task, task.enqueued_ns);
+    task.dispatch(dispatch_now);
+}
+
+void RequestScheduler::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        in_flight_count.fetch_sub(1, std::memory_order_relaxed);
+        if (waiting.empty()) return;
+    }
+    // The next task is dispatched on the scheduler thread, never on the response pump thread releasing this one:
+    // enqueueing may wait for ring space, which only frees while the pump keeps draining the workers' output
+    wake.notify_one();
+}
+
+size_t RequestScheduler::pick_next(uint64_t now_ns) const {
+    size_t best = 0;
+    double best_key = 0.0;
+    for (size_t i = 0; i < waiting.size(); ++i) {
+        const Task& task = waiting[i];
+        double key = static_cast<double>(task.cost + static_cast<uint64_t>(task.priority) * CLASS_COST_STEP) -
+                     static_cast<double>(now_ns - task.enqueued_ns) / static_cast<double>(aging_ns);
+        if (i == 0 || key < best_key) {
+            best = i;
+            best_key = key;
+        }
+    }
+    return best;
+}
+
+void RequestScheduler::record_dispatch(const Task& task, uint64_t now_ns) {
+    ClassStats& class_stats = stats[static_cast<int>(task.priority)];
+    uint64_t wait_ns = now_ns - task.enqueued_ns;
+    class_stats.dispatched.fetch_add(1, std::memory_order_relaxed);
+    class_stats.wait_ns_total.fetch_add(wait_ns, std::memory_order_relaxed);
+    class_stats.wait_us.record(wait_ns / 1000);
+    uint64_t max_ns = class_stats.wait_ns_max.load(std::memory_order_relaxed);
+    while (wait_ns > max_ns && !class_stats.wait_ns_max.compare_exchange_weak(max_ns, wait_ns, std::memory_order_relaxed)) {}
+}
+
+void RequestScheduler::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (waiting.empty() || in_flight_count.load(std::memory_order_relaxed) >= capacity) {
+            wake.wait(lock);
+            continue;
+        }
+        uint64_t now_ns = steady_ns();
+        size_t next = pick_next(now_ns);
+        Task task = std::move(waiting[next]);
+        waiting[next] = std::move(waiting.back());
+        waiting.pop_back();
+        in_flight_count.fetch_add(1, std::memory_order_relaxed);
+        stats[static_cast<int>(task.priority)].waiting.fetch_sub(1, std::memory_order_relaxed);
+        lock.unlock();
+        record_dispatch(task, now_ns);
+        task.dispatch(true);
+        lock.lock();
+    }
+}
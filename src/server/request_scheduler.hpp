@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../utils/http_utils.hpp"
+#include "../utils/metrics.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+constexpr int PRIORITY_CLASSES = 3;     // RequestPriority::High, Normal, Low
+
+// Orders the tasks waiting for a worker. The worker rings are FIFO, so only capacity tasks (SCHEDULER_TASKS_PER_WORKER per worker) are let
+// into them at a time and the rest wait here, where the next one to go is picked by priority class, then by expected cost
+// (shortest job first), with aging: every aging_ms of waiting counts as one token less of cost. A class is worth
+// CLASS_COST_STEP tokens, so a low priority task still overtakes fresh normal ones once it has waited long enough.
+class RequestScheduler {
+public:
+    static constexpr uint64_t CLASS_COST_STEP = 512;
+
+    // Called once: with true when the task may go to a worker (it calls release once it has left the worker, or failed
+    // to get there), with false when the scheduler stops with the task still waiting (answer the client, no release).
+    using Dispatch = std::function<void(bool dispatch)>;
+
+    // Queue wait of the tasks dispatched so far, per class
+    struct ClassStats {
+        std::atomic<uint64_t> waiting{0};
+        std::atomic<uint64_t> dispatched{0};
+        std::atomic<uint64_t> wait_ns_total{0};
+        std::atomic<uint64_t> wait_ns_max{0};
+        Histogram wait_us{LATENCY_BOUNDS_US};
+    };
+
+    // capacity: tasks in the worker rings at a time, 0 lets every task through in arrival order
+    RequestScheduler(uint32_t capacity, uint32_t aging_ms);
+    ~RequestScheduler();
+
+    void start();
+    // Stop dispatching, the tasks still waiting are handed back with false
+    void stop();
+
+    // Dispatch on the calling thread when there is room and nothing waits, otherwise queue it for the scheduler thread.
+    // cost is the expected tokens of the task, prompt plus generated.
+    void submit(RequestPriority priority, uint64_t cost, Dispatch dispatch);
+    // A dispatched task left the worker, its place goes to the next one waiting
+    void release();
+
+    const ClassStats& class_stats(RequestPriority priority) const { return stats[static_cast<int>(priority)]; }
+    uint32_t in_flight() const { return in_flight_count.load(std::memory_order_relaxed); }
+
+private:
+    struct Task {
+        RequestPriority priority;
+        uint64_t cost;
+        uint64_t enqueued_ns;
+        Dispatch dispatch;
+    };
+
+    uint32_t capacity;
+    uint64_t aging_ns;      // waiting this long takes one token off the cost
+    ClassStats stats[PRIORITY_CLASSES];
+    std::atomic<uint32_t> in_flight_count;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Task> waiting;      // unordered, picked by a scan, admission control keeps it short
+    bool stopping;
+    std::thread scheduler_thread;
+
+    void run();
+    // Index of the task to go next, waiting must not be empty
+    size_t pick_next(uint64_t now_ns) const;
+    void record_dispatch(const Task& task, uint64_t now_ns);
+};
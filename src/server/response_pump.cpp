@@ -0,0 +1,172 @@
+#include "response_pump.hpp"
+#include "../utils/trace.hpp"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+// #define DEBUG_PRINT
+
+
+#ifdef DEBUG_PRINT
+#define DEBUG_COUT(x) std::cout << x << std::endl
+#else
+#define DEBUG_COUT(x)
+#endif
+
+
+static uint64_t steady_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ResponsePump::ResponsePump(IPCManager* ipc, uint32_t flush_delay_us)
+    : ipc_manager(ipc), flush_delay_us(flush_delay_us), epoll_fd(-1), wakeup_fd(-1), should_stop(false) {}
+
+ResponsePump::~ResponsePump() {
+    stop();
+    if (wakeup_fd != -1) close(wakeup_fd);
+    if (epoll_fd != -1) close(epoll_fd);
+}
+
+bool ResponsePump::start(const std::vector<int>& notify_fds) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || wakeup_fd == -1) {
+        std::cerr << "Failed to create response pump epoll: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<int> fds(notify_fds);
+    fds.push_back(wakeup_fd);
+    for (int fd : fds) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            std::cerr << "Failed to register eventfd " << fd << " with the response pump: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+
+    should_stop.store(false);
+    pump_thread = std::thread([this]() { run(); });
+    return true;
+}
+
+void ResponsePump::stop() {
+    if (!pump_thread.joinable()) return;
+    should_stop.store(true);
+    uint64_t one = 1;
+    ssize_t written = write(wakeup_fd, &one, sizeof(one));
+    (void)written;
+    pump_thread.join();
+
+    // The workers are going down with the server, these streams will not finish anymore
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    for (Stream& stream : pending) streams.push_back(std::move(stream));
+    pending.clear();
+    for (Stream& stream : streams) stream.on_finished(false, stream.client_disconnected);
+    streams.clear();
+}
+
+void ResponsePump::add_stream(Stream stream) {
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending.push_back(std::move(stream));
+    }
+    uint64_t one = 1;
+    ssize_t written = write(wakeup_fd, &one, sizeof(one));
+    (void)written;
+}
+
+bool ResponsePump::pump_stream(Stream& stream, uint64_t now_us, uint64_t& next_flush_us) {
+    struct iovec parts[2];
+    int part_count = 0;
+    uint32_t end = 0;
+    bool is_last = false;
+    bool ready = false;
+    if (!ipc_manager->peek_response_chunk(stream.worker_idx, stream.slot_idx, stream.task_id, parts, part_count, end, is_last, ready)) {
+        ipc_manager->release_request_slot(stream.worker_idx, stream.slot_idx);
+        stream.on_finished(false, stream.client_disconnected);
+        return true;
+    }
+    if (!ready) part_count = 0;
+    if (stream.client_disconnected) {
+        stream.held_since_us = 0;       // drained without sending
+    } else if (part_count > 0 || stream.held_since_us != 0) {
+        if (stream.held_since_us == 0) stream.held_since_us = now_us;
+        size_t held = 0;
+        for (int i = 0; i < part_count; ++i) held += parts[i].iov_len;
+        bool due = is_last || held >= RESP_STREAM_SIZE / 2 || now_us - stream.held_since_us >= flush_delay_us;
+        if (!due) {
+            next_flush_us = std::min(next_flush_us, stream.held_since_us + flush_delay_us);
+            return false;       // left in the response stream, the next pass sees them again with whatever follows
+        }
+        stream.held_since_us = 0;
+        // Straight from the response stream to the socket, the bytes are only handed back to the worker once sent
+        uint64_t write_start_ns = stream.traced ? Trace::now_ns() : 0;
+        bool delivered = stream.on_data(parts, part_count);
+        if (stream.traced) Trace::record(TraceEvent::SocketWrite, stream.task_id, write_start_ns, Trace::now_ns(), static_cast<uint32_t>(held));
+        if (!delivered) {
+            stream.client_disconnected = true;
+            DEBUG_COUT("Client disconnected for task " << stream.task_id << ". Canceling.");
+            // The worker sees the flag before its next decode step and ends the stream, the slot is released once that final chunk is drained.
+            ipc_manager->cancel_request(stream.worker_idx, stream.slot_idx, stream.task_id);
+        }
+    }
+    if (!ready) return false;
+    ipc_manager->consume_response_chunk(stream.worker_idx, stream.slot_idx, end);
+    if (!is_last) return false;
+
+    // Nobody reads this slot's response stream anymore, hand the queue slot back to the worker's ring
+    ipc_manager->release_request_slot(stream.worker_idx, stream.slot_idx);
+    stream.on_finished(true, stream.client_disconnected);
+    return true;
+}
+
+void ResponsePump::run() {
+    epoll_event events[64];
+    while (!should_stop.load()) {
+        uint64_t now_us = steady_us();
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            for (Stream& stream : pending) {
+                stream.held_since_us = now_us;      // the response header is queued on the connection
+                streams.push_back(std::move(stream));
+            }
+            pending.clear();
+        }
+
+        // Arm before the scan: a worker publishing after this point either shows up in the scan or writes its eventfd.
+        // Streams are scanned as a whole on every wake, a stolen task publishes through the eventfd of the worker running it.
+        ipc_manager->arm_response_notify(true);
+        uint64_t next_flush_us = UINT64_MAX;
+        size_t kept = 0;
+        for (size_t i = 0; i < streams.size(); ++i) {
+            if (!pump_stream(streams[i], now_us, next_flush_us)) {
+                if (kept != i) streams[kept] = std::move(streams[i]);
+                ++kept;
+            }
+        }
+        streams.resize(kept);
+
+        // Wake for held bytes that come due, rounded up to the millisecond epoll_wait counts in
+        long timeout_ms = FUTEX_PARK_TIMEOUT_MS;
+        if (next_flush_us != UINT64_MAX) {
+            uint64_t wait_us = next_flush_us > now_us ? next_flush_us - now_us : 0;
+            timeout_ms = std::min<long>(timeout_ms, static_cast<long>((wait_us + 999) / 1000));
+        }
+        int n = epoll_wait(epoll_fd, events, 64, static_cast<int>(timeout_ms));
+        ipc_manager->arm_response_notify(false);
+        for (int i = 0; i < n; ++i) {
+            uint64_t count;
+            ssize_t drained = read(events[i].data.fd, &count, sizeof(count));   // reset the eventfd, EAGAIN when another wake already did
+            (void)drained;
+        }
+    }
+}
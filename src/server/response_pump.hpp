@@ -0,0 +1,67 @@
+#pragma once
+
+#include "../ipc/ipc_utils.hpp"
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streams the responses of every in-flight task from a single thread, so server threads no longer scale with the number of
+// generations in progress. Workers signal published bytes through their eventfd (only while the pump is about to sleep, see
+// IPCManager::arm_response_notify), the pump epolls all of them and hands each stream's new bytes to its callback.
+//
+// Published bytes stay in the worker's response stream until they are handed on, so tokens arriving within flush_delay_us
+// of each other leave in one writev without being copied. A stream is written early when it ends or half its ring is
+// taken, so the worker never waits on the delay.
+class ResponsePump {
+public:
+    struct Stream {
+        int worker_idx;
+        uint32_t slot_idx;
+        uint64_t task_id;
+        // Called on the pump thread with the bytes published since the last call, still in shared memory (already framed
+        // HTTP chunks, see HttpUtils::append_json_chunk_frame), to be written behind whatever the connection queued. With
+        // part_count 0 only the queued bytes go out. The iovecs may be modified. Returns false once the client is gone, the
+        // task is then canceled and drained without further calls.
+        std::function<bool(struct iovec* parts, int part_count)> on_data;
+        // Called once on the pump thread after the final chunk (ok, the stream ended the chunked body) or a broken stream,
+        // the queue slot is already released.
+        std::function<void(bool ok, bool client_disconnected)> on_finished;
+        bool client_disconnected = false;
+        bool traced = false;            // record a TraceEvent::SocketWrite span per on_data call
+        uint64_t held_since_us = 0;     // pump thread only, since when bytes wait for on_data, 0 = none
+    };
+
+    // flush_delay_us: how long published bytes (and the response header queued before the stream) may wait to be written
+    // together with the ones that follow. 0 writes on every pass.
+    ResponsePump(IPCManager* ipc, uint32_t flush_delay_us);
+    ~ResponsePump();
+
+    // Register the workers' eventfds and start the pump thread
+    bool start(const std::vector<int>& notify_fds);
+    // Stop the thread. Streams still in flight are finished as broken, their workers are being shut down.
+    void stop();
+
+    // Hand a freshly enqueued task's stream to the pump, callable from any thread
+    void add_stream(Stream stream);
+
+private:
+    IPCManager* ipc_manager;
+    uint32_t flush_delay_us;
+    int epoll_fd;
+    int wakeup_fd;      // add_stream and stop wake the pump through it
+
+    std::thread pump_thread;
+    std::atomic<bool> should_stop;
+
+    std::mutex pending_mutex;
+    std::vector<Stream> pending;     // added, not yet picked up by the pump thread
+    std::vector<Stream> streams;     // pump thread only
+
+    void run();
+    // Forward what the stream published once it is due. Returns true once the stream is finished, otherwise lowers
+    // next_flush_us to when its held bytes are due.
+    bool pump_stream(Stream& stream, uint64_t now_us, uint64_t& next_flush_us);
+};
@@ -1,10 +1,17 @@
 #include "task_dispatcher.hpp"
 #include "../utils/http_utils.hpp"
 #include "../utils/config.hpp"
+#include "../utils/trace.hpp"
+#include "../llm/simple_tokenizer.hpp"
+#include "../llm/tiny_llm_inference.hpp"
 #include <iostream>
+#include <cstring>
 #include <chrono>
 #include <thread>
 #include <functional>
+#include <algorithm>
+#include <mutex>
+#include <unistd.h>
 
 
 // #define DEBUG_PRINT
@@ -21,16 +28,31 @@ TaskDispatcher::TaskDispatcher() : should_stop_monitoring(false) {
     auto& config = AppConfig::get_instance();
     std::string worker_path = config.get_string("WORKER_EXECUTABLE_PATH", "./build/worker");
     int min_workers = config.get_int("MIN_WORKERS", 2);
-    int max_workers = config.get_int("MAX_WORKERS_DYNAMIC", 4);
-    max_workers = std::min(max_workers, static_cast<int>(MAX_WORKERS));
+    int max_workers = std::max(1, config.get_int("MAX_WORKERS_DYNAMIC", DEFAULT_MAX_WORKERS));
+
+    // Prompt plus the (at most 50) generated tokens have to fit in the model context, and the ids in one payload.
+    int context_budget = TransformerParameters::max_context - 50;
+    server_tokenization = config.get_int("SERVER_TOKENIZATION", 0) != 0;
+    max_prompt_tokens = std::min(config.get_int("MAX_PROMPT_TOKENS", context_budget), static_cast<int>(MAX_PAYLOAD_TOKENS));
 
     ipc_manager = std::make_unique<IPCManager>(true);  // true = server mode
-    worker_manager = std::make_unique<WorkerManager>(ipc_manager.get(), worker_path, min_workers, max_workers);
+    bool huge_pages = config.get_int("HUGE_PAGES", 0) != 0;
+    uint32_t stall_timeout_ms = static_cast<uint32_t>(std::max(0, config.get_int("WORKER_STALL_TIMEOUT_MS", 30000)));
+    worker_manager = std::make_unique<WorkerManager>(ipc_manager.get(), worker_path, min_workers, max_workers, huge_pages, stall_timeout_ms);
+    response_pump = std::make_unique<ResponsePump>(ipc_manager.get(), static_cast<uint32_t>(std::max(0, config.get_int("OUTPUT_FLUSH_US", 1000))));
+    admission = std::make_unique<AdmissionController>(ipc_manager.get(), static_cast<uint32_t>(std::max(0, config.get_int("MAX_QUEUE_WAIT_MS", 10000))),
+                                                      static_cast<double>(config.get_int("ADMISSION_TOKENS_PER_SEC", 50)));
+    int tasks_per_worker = std::max(0, config.get_int("SCHEDULER_TASKS_PER_WORKER", 1));
+    scheduler = std::make_unique<RequestScheduler>(static_cast<uint32_t>(tasks_per_worker * max_workers),
+                                                   static_cast<uint32_t>(std::max(1, config.get_int("SCHEDULER_AGING_MS", 20))));
+    Trace::set_sample_rate(static_cast<uint32_t>(std::max(0, config.get_int("TRACE_SAMPLE_RATE", 100))));
 }
 
 TaskDispatcher::~TaskDispatcher() {
     // stop_monitor_thread();                  // stop all monitoring first bfore dealocating worker resources.
     std::cout << "Cleaning up task dispatcher..." << std::endl;
+    scheduler->stop();                      // answers the requests still waiting for a worker
+    response_pump.reset();                  // finishes the streams still in flight, closing their connections
     ipc_manager->request_shutdown();        // Request shutdown of all workers
     // worker_manager->print_stats();
     worker_manager.reset();                 // Cleanup worker manager (this will terminate all workers) ??
@@ -39,6 +61,15 @@ TaskDispatcher::~TaskDispatcher() {
 
 bool TaskDispatcher::initialize() {
     std::cout << "Initializing task dispatcher..." << std::endl;
+    if (server_tokenization) {
+        tokenizer = std::make_unique<HybridTokenizer>();
+        tokenizer->load_vocab(AppConfig::get_instance().get_string("TOKENIZER_PATH", "model/tinystories_tokenizer_vocab.json"));
+        if (tokenizer->word_to_id.empty()) {
+            std::cerr << "Failed to load tokenizer vocabulary for server side tokenization" << std::endl;
+            return false;
+        }
+        std::cout << "Server side tokenization enabled, max prompt tokens: " << max_prompt_tokens << std::endl;
+    }
     // Initialize IPC first
     if (!ipc_manager->initialize()) {
         std::cerr << "Failed to initialize IPC manager" << std::endl;
@@ -49,6 +80,11 @@ bool TaskDispatcher::initialize() {
         std::cerr << "Failed to initialize worker manager" << std::endl;
         return false;
     }
+    if (!response_pump->start(worker_manager->get_notify_fds())) {
+        std::cerr << "Failed to start response pump" << std::endl;
+        return false;
+    }
+    scheduler->start();
     start_monitor_thread();
     std::cout << "Task dispatcher initialized successfully, started with " << worker_manager->get_active_worker_count() << " workers" << std::endl;
     return true;
@@ -56,64 +92,485 @@ bool TaskDispatcher::initialize() {
 
 
 
-void TaskDispatcher::process_message(std::function<bool(const std::string&)> chunk_callback, const std::string& message, int max_tokens) {  
+bool TaskDispatcher::prepare_request(ProcessRequest& request, std::string& error_message) const {
+    if (!tokenizer) {
+        // The worker tokenizes and fits the prompt to the model context, only the payload size is checked here.
+        // Leave room for the "max_tokens\x01" header in front of the prompt.
+        const size_t max_prompt_bytes = MAX_PAYLOAD_SIZE - 16;
+        if (request.message.length() > max_prompt_bytes) {
+            error_message = "Prompt too long: " + std::to_string(request.message.length()) + " bytes, limit is " + std::to_string(max_prompt_bytes);
+            return false;
+        }
+        return true;
+    }
+    request.prompt_tokens = tokenizer->encode(request.message);
+    if (static_cast<int>(request.prompt_tokens.size()) > max_prompt_tokens) {
+        error_message = "Prompt too long: " + std::to_string(request.prompt_tokens.size()) + " tokens, limit is " + std::to_string(max_prompt_tokens);
+        return false;
+    }
+    return true;
+}
+
+// Expected tokens of a request, what the scheduler orders by: the prompt (estimated from its bytes when the worker
+// tokenizes) plus what the worker generates, at most 50 tokens
+static uint64_t expected_cost(const ProcessRequest& request) {
+    uint64_t prompt = request.prompt_tokens.empty() ? request.message.length() / 4 : request.prompt_tokens.size();
+    return prompt + static_cast<uint64_t>(std::min(std::max(request.max_tokens, 0), 50));
+}
+
+std::shared_ptr<AdmissionController::Ticket> TaskDispatcher::admit(ProcessRequest* requests, size_t count, uint32_t& retry_after_s) {
+    // The worker generates at most 50 tokens per request, that is what a request can cost
+    uint64_t tokens = 0;
+    uint32_t deadline_ms = 0;
+    for (size_t i = 0; i < count; ++i) {
+        tokens += static_cast<uint64_t>(std::min(std::max(requests[i].max_tokens, 0), 50));
+        if (requests[i].deadline_ms > 0 && (deadline_ms == 0 || static_cast<uint32_t>(requests[i].deadline_ms) < deadline_ms)) {
+            deadline_ms = static_cast<uint32_t>(requests[i].deadline_ms);
+        }
+    }
+    std::shared_ptr<AdmissionController::Ticket> ticket = admission->admit(tokens, deadline_ms, retry_after_s);
+    if (ticket) {
+        uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        for (size_t i = 0; i < count; ++i) {
+            requests[i].arrival_ns = now_ns;
+            if (requests[i].deadline_ms > 0) requests[i].deadline_ns = now_ns + static_cast<uint64_t>(requests[i].deadline_ms) * 1000000;
+        }
+    }
+    return ticket;
+}
+
+void TaskDispatcher::process_message(std::function<bool(const std::string&)> chunk_callback, std::function<bool(struct iovec*, int)> stream_callback,
+                                     std::function<void(bool)> on_finished, const ProcessRequest& request) {
+    uint64_t submitted_ns = request.trace.sampled ? Trace::now_ns() : 0;
+    scheduler->submit(request.priority, expected_cost(request), [this, chunk_callback, stream_callback, on_finished, request, submitted_ns](bool dispatch) {
+        if (!dispatch) {
+            chunk_callback("{\"error\": \"Server shutting down\"}");
+            on_finished(false);
+            return;
+        }
+        dispatch_message(chunk_callback, stream_callback, on_finished, request, submitted_ns);
+    });
+}
+
+// Server spans of a traced task up to its enqueue, recorded once the task_id is known. Stages the request skipped are left out.
+static void record_dispatch_spans(uint64_t task_id, const RequestTrace& trace, uint64_t submitted_ns, uint64_t dispatched_ns, uint64_t enqueued_ns) {
+    auto span = [task_id](TraceEvent event, uint64_t start_ns, uint64_t end_ns) {
+        if (start_ns != 0 && end_ns != 0) Trace::record(event, task_id, start_ns, end_ns);
+    };
+    span(TraceEvent::HttpRead, trace.read_start_ns, trace.received_ns);
+    span(TraceEvent::Parse, trace.received_ns, trace.admitted_ns);
+    span(TraceEvent::PoolWait, trace.admitted_ns, trace.pool_start_ns);
+    span(TraceEvent::Prepare, trace.pool_start_ns, trace.prepared_ns);
+    span(TraceEvent::SchedulerWait, submitted_ns, dispatched_ns);
+    span(TraceEvent::Enqueue, dispatched_ns, enqueued_ns);
+}
+
+void TaskDispatcher::dispatch_message(std::function<bool(const std::string&)> chunk_callback, std::function<bool(struct iovec*, int)> stream_callback,
+                                      std::function<void(bool)> on_finished, const ProcessRequest& request, uint64_t submitted_ns) {
+    uint64_t dispatched_ns = request.trace.sampled ? Trace::now_ns() : 0;
     // Get next available worker in a round-robin fashion
     int assigned_worker = worker_manager->assign_task_to_worker();
     if (assigned_worker == -1) {
+        scheduler->release();
         chunk_callback("{\"error\": \"No workers available\"}");
+        on_finished(false);
         return;
     }
 
     uint64_t task_id;
+    uint32_t slot_idx;
     
     // Notify worker manager that we are starting a request for this worker
     worker_manager->on_request_start(assigned_worker);
 
-    // Enqueue the request specifically for the assigned worker
-    std::string encoded_message = std::to_string(max_tokens) + '\x01' + message;
-    if (!ipc_manager->enqueue_request(assigned_worker, encoded_message, task_id)) {
+    // Enqueue the request specifically for the assigned worker, as token ids when the prompt was tokenized here, as text otherwise.
+    // Header and prompt are copied straight into the worker's payload arena.
+    std::string header;
+    std::string_view body;
+    PayloadKind kind = PayloadKind::Text;
+    if (!request.prompt_tokens.empty()) {
+        TokenPayloadHeader token_header{static_cast<uint32_t>(std::max(request.max_tokens, 0)), static_cast<uint32_t>(request.prompt_tokens.size())};
+        header.assign(reinterpret_cast<const char*>(&token_header), sizeof(token_header));
+        body = std::string_view(reinterpret_cast<const char*>(request.prompt_tokens.data()), request.prompt_tokens.size() * sizeof(int32_t));
+        kind = PayloadKind::Tokens;
+    } else {
+        header = std::to_string(request.max_tokens) + '\x01';
+        body = request.message;
+    }
+    if (!ipc_manager->enqueue_request(assigned_worker, header, body, task_id, slot_idx, kind, request.deadline_ns, request.arrival_ns, request.trace.sampled)) {
         worker_manager->on_request_complete(assigned_worker); // Clean up on failure
+        scheduler->release();
         chunk_callback("{\"error\": \"Failed to enqueue request - server may be overloaded\"}");
+        on_finished(false);
         return;
     }
+    // The whole request is traced from its first byte, or from its parse when the connection did not note that
+    uint64_t request_start_ns = 0;
+    if (request.trace.sampled) {
+        record_dispatch_spans(task_id, request.trace, submitted_ns, dispatched_ns, Trace::now_ns());
+        request_start_ns = request.trace.read_start_ns ? request.trace.read_start_ns : request.trace.received_ns;
+    }
+
+    DEBUG_COUT("Dispatched task " << task_id << " to worker " << assigned_worker << " (message: \"" << request.message << "\")");
+
+    ResponsePump::Stream stream;
+    stream.worker_idx = assigned_worker;
+    stream.slot_idx = slot_idx;
+    stream.task_id = task_id;
+    stream.traced = request.trace.sampled;
+
+    // Token payloads carry no text, so the prompt echo the worker sends in text mode comes from here instead
+    if (kind == PayloadKind::Tokens && !chunk_callback(HttpUtils::build_json_response_chunk(request.message, false))) {
+        stream.client_disconnected = true;
+        ipc_manager->cancel_request(assigned_worker, slot_idx, task_id);
+    }
+
+    stream.on_data = std::move(stream_callback);
+    stream.on_finished = [this, assigned_worker, chunk_callback, on_finished, task_id, request_start_ns](bool ok, bool client_disconnected) {
+        if (!ok && !client_disconnected) { // Only send error if client was still connected
+            chunk_callback("{\"error\": \"Failed to receive response from worker\"}");
+        }
+        // Notify worker manager about request completion
+        worker_manager->on_request_complete(assigned_worker);
+        scheduler->release();
+        on_finished(ok);
+        if (request_start_ns) Trace::record(TraceEvent::Request, task_id, request_start_ns, Trace::now_ns(), ok ? 1 : 0);
+    };
+    response_pump->add_stream(std::move(stream));
+}
+
+
+// Shared by the batch tasks of one /process_batch request
+struct TaskDispatcher::BatchProgress {
+    std::function<bool(std::string_view)> on_lines;
+    std::function<void()> on_finished;
+    std::atomic<int> pending{1};            // tasks in flight, plus one held by process_batch until every task is dispatched
+    std::atomic<bool> client_gone{false};
+    struct TaskRef {
+        int worker_idx;
+        uint32_t slot_idx;
+        uint64_t task_id;
+    };
+    std::mutex tasks_mutex;
+    std::vector<TaskRef> tasks;     // every enqueued task, to cancel the lot once the client is gone
+
+    void task_done() {
+        if (pending.fetch_sub(1) == 1) on_finished();
+    }
+};
 
-    DEBUG_COUT("Dispatched task " << task_id << " to worker " << assigned_worker << " (message: \"" << message << "\")");
+// The items of one batch task and what its worker answered so far
+struct BatchTask {
+    std::vector<uint32_t> indices;      // ascending
+    std::vector<uint8_t> reported;
+    std::string partial;                // bytes of a line the worker has not finished publishing
 
-    // Wait for response from the assigned worker
-    bool is_last = false;
-    bool client_disconnected = false;
-    while(!is_last) {
-        std::string chunk_data;
-        bool success = ipc_manager->wait_for_response_chunk(assigned_worker, task_id, chunk_data, is_last, chunk_callback, client_disconnected);
-        
-        if (!success) {
-            if (!client_disconnected) { // Only send error if client was still connected
-                chunk_callback("{\"error\": \"Failed to receive response from worker\"}");
+    void mark_reported(std::string_view lines) {
+        size_t start = 0;
+        while (start < lines.length()) {
+            size_t end = lines.find('\n', start);
+            uint32_t index;
+            if (HttpUtils::parse_batch_line_index(lines.substr(start, end - start), index)) {
+                auto it = std::lower_bound(indices.begin(), indices.end(), index);
+                if (it != indices.end() && *it == index) reported[it - indices.begin()] = 1;
             }
-            // ipc_manager->cancel_request(assigned_worker, task_id);
-            break;
+            start = end + 1;
+        }
+    }
+};
+
+void TaskDispatcher::process_batch(const std::vector<ProcessRequest>& items, std::function<bool(std::string_view)> on_lines,
+                                   std::function<void()> on_finished) {
+    auto progress = std::make_shared<BatchProgress>();
+    progress->on_lines = std::move(on_lines);
+    progress->on_finished = std::move(on_finished);
+
+    // As many tasks as there are workers to run them, unless that makes a task wider than a worker batches
+    size_t workers = static_cast<size_t>(std::max(1, worker_manager->get_active_worker_count()));
+    size_t per_task = std::min<size_t>(MAX_BATCH_TASK_ITEMS, (items.size() + workers - 1) / workers);
+    const size_t max_prompt_bytes = MAX_PAYLOAD_SIZE - sizeof(BatchPayloadHeader) - sizeof(BatchPayloadItem);
+
+    std::string rejected;
+    std::vector<uint32_t> group;
+    size_t group_bytes = sizeof(BatchPayloadHeader);
+    for (uint32_t i = 0; i < items.size(); ++i) {
+        size_t length = items[i].message.length();
+        if (length > max_prompt_bytes) {
+            HttpUtils::append_batch_error_line(rejected, i, "Prompt too long: " + std::to_string(length) + " bytes, limit is " + std::to_string(max_prompt_bytes));
+            continue;
+        }
+        size_t item_bytes = sizeof(BatchPayloadItem) + length;
+        if (!group.empty() && (group.size() == per_task || group_bytes + item_bytes > MAX_PAYLOAD_SIZE)) {
+            dispatch_batch_task(items, group, progress);
+            group.clear();
+            group_bytes = sizeof(BatchPayloadHeader);
+        }
+        group.push_back(i);
+        group_bytes += item_bytes;
+    }
+    if (!group.empty()) {
+        dispatch_batch_task(items, group, progress);
+    }
+    if (!rejected.empty() && !progress->client_gone.load()) {
+        progress->on_lines(rejected);
+    }
+    progress->task_done();
+}
+
+void TaskDispatcher::dispatch_batch_task(const std::vector<ProcessRequest>& items, const std::vector<uint32_t>& group,
+                                         const std::shared_ptr<BatchProgress>& progress) {
+    if (progress->client_gone.load()) return;       // nobody to answer anymore
+
+    // BatchPayloadHeader and the item table as the header, the prompts back to back as the body
+    std::string header(sizeof(BatchPayloadHeader) + group.size() * sizeof(BatchPayloadItem), '\0');
+    std::string body;
+    uint64_t deadline_ns = 0;       // the earliest of the items'
+    RequestPriority priority = RequestPriority::Low;
+    uint64_t cost = 0;
+    BatchPayloadHeader batch_header{static_cast<uint32_t>(group.size())};
+    std::memcpy(&header[0], &batch_header, sizeof(batch_header));
+    for (size_t k = 0; k < group.size(); ++k) {
+        const ProcessRequest& request = items[group[k]];
+        BatchPayloadItem item{group[k], static_cast<uint32_t>(std::max(request.max_tokens, 0)),
+                              static_cast<uint32_t>(header.length() + body.length()), static_cast<uint32_t>(request.message.length())};
+        std::memcpy(&header[sizeof(batch_header) + k * sizeof(item)], &item, sizeof(item));
+        body += request.message;
+        if (request.deadline_ns != 0 && (deadline_ns == 0 || request.deadline_ns < deadline_ns)) deadline_ns = request.deadline_ns;
+        priority = std::min(priority, request.priority);
+        cost += expected_cost(request);
+    }
+    // The batch is sampled as a whole, its tasks get the spans from the scheduler on
+    RequestTrace trace = items[group[0]].trace;
+    uint64_t submitted_ns = trace.sampled ? Trace::now_ns() : 0;
+    progress->pending.fetch_add(1);
+    scheduler->submit(priority, cost, [this, group, header, body, deadline_ns, progress, trace, submitted_ns](bool dispatch) {
+        enqueue_batch_task(group, header, body, deadline_ns, progress, trace, submitted_ns, dispatch);
+    });
+}
+
+void TaskDispatcher::enqueue_batch_task(const std::vector<uint32_t>& group, const std::string& header, const std::string& body,
+                                        uint64_t deadline_ns, const std::shared_ptr<BatchProgress>& progress, const RequestTrace& trace,
+                                        uint64_t submitted_ns, bool dispatch) {
+    auto fail = [&](const char* message) {
+        if (!progress->client_gone.load()) {
+            std::string lines;
+            for (uint32_t index : group) HttpUtils::append_batch_error_line(lines, index, message);
+            if (!progress->on_lines(lines)) progress->client_gone.store(true);
+        }
+        progress->task_done();
+    };
+    if (!dispatch) {
+        fail("Server shutting down");
+        return;
+    }
+    if (progress->client_gone.load()) {     // gone while the task waited in the scheduler
+        scheduler->release();
+        progress->task_done();
+        return;
+    }
+    int assigned_worker = worker_manager->assign_task_to_worker();
+    if (assigned_worker == -1) {
+        scheduler->release();
+        fail("No workers available");
+        return;
+    }
+    worker_manager->on_request_start(assigned_worker);
+
+    uint64_t dispatched_ns = trace.sampled ? Trace::now_ns() : 0;
+    uint64_t task_id;
+    uint32_t slot_idx;
+    if (!ipc_manager->enqueue_request(assigned_worker, header, body, task_id, slot_idx, PayloadKind::Batch, deadline_ns, 0, trace.sampled)) {
+        worker_manager->on_request_complete(assigned_worker);
+        scheduler->release();
+        fail("Failed to enqueue request - server may be overloaded");
+        return;
+    }
+    if (trace.sampled) record_dispatch_spans(task_id, trace, submitted_ns, dispatched_ns, Trace::now_ns());
+    DEBUG_COUT("Dispatched batch task " << task_id << " with " << group.size() << " items to worker " << assigned_worker);
+
+    ResponsePump::Stream stream;
+    stream.worker_idx = assigned_worker;
+    stream.slot_idx = slot_idx;
+    stream.task_id = task_id;
+    stream.traced = trace.sampled;
+    {
+        std::lock_guard<std::mutex> lock(progress->tasks_mutex);
+        progress->tasks.push_back({assigned_worker, slot_idx, task_id});
+        if (progress->client_gone.load()) {
+            ipc_manager->cancel_request(assigned_worker, slot_idx, task_id);    // gone while this one was being enqueued
         }
+    }
 
-        if(client_disconnected) {
-            continue; // Client is gone, just drain the queue until the worker is done
+    auto task = std::make_shared<BatchTask>();
+    task->indices = group;
+    task->reported.assign(group.size(), 0);
+
+    // Lines of the tasks of a batch share the connection, only whole lines are handed on so they never interleave
+    stream.on_data = [this, progress, task](struct iovec* parts, int part_count) -> bool {
+        for (int i = 0; i < part_count; ++i) task->partial.append(static_cast<const char*>(parts[i].iov_base), parts[i].iov_len);
+        size_t end = task->partial.rfind('\n');
+        std::string_view lines;
+        if (end != std::string::npos) lines = std::string_view(task->partial.data(), end + 1);
+        task->mark_reported(lines);
+        bool delivered = !progress->client_gone.load() && progress->on_lines(lines);
+        if (end != std::string::npos) task->partial.erase(0, end + 1);
+        if (!delivered && !progress->client_gone.exchange(true)) {
+            // The other tasks of the batch stop too, not only the one that noticed
+            std::lock_guard<std::mutex> lock(progress->tasks_mutex);
+            for (const BatchProgress::TaskRef& other : progress->tasks) {
+                ipc_manager->cancel_request(other.worker_idx, other.slot_idx, other.task_id);
+            }
+        }
+        return delivered;
+    };
+    stream.on_finished = [this, assigned_worker, progress, task](bool ok, bool client_disconnected) {
+        if (!client_disconnected && !progress->client_gone.load()) {
+            std::string lines;
+            for (size_t k = 0; k < task->indices.size(); ++k) {
+                if (!task->reported[k]) {
+                    HttpUtils::append_batch_error_line(lines, task->indices[k], ok ? "No result from worker" : "Failed to receive response from worker");
+                }
+            }
+            if (!lines.empty()) progress->on_lines(lines);
         }
+        worker_manager->on_request_complete(assigned_worker);
+        scheduler->release();
+        progress->task_done();
+    };
+    response_pump->add_stream(std::move(stream));
+}
+
 
-        std::string escaped_chunk_json_data = HttpUtils::build_json_response_chunk(chunk_data, is_last);
+void TaskDispatcher::append_metrics(std::string& out) const {
+    static const char* priority_names[PRIORITY_CLASSES] = {"high", "normal", "low"};
+    const int workers = ipc_manager->get_max_workers();
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t sum;
 
-        DEBUG_COUT("Received chunk for task " << task_id << " from worker " << assigned_worker << " (chunk: \"" << escaped_chunk_json_data << "\")");
-        if (!chunk_callback(escaped_chunk_json_data)) {
-            client_disconnected = true;
-            DEBUG_COUT("Client disconnected for task " << task_id << ". Attempting to cancel.");
-            // ipc_manager->cancel_request(assigned_worker, task_id);
-            // We will now continue the loop to drain remaining chunks from the worker,
-            // in case cancellation was too late and the worker is already processing.
+    // Recorded by the workers in shared memory, one series per worker slot
+    struct WorkerHistogram {
+        const char* name;
+        const char* help;
+        HistogramCounters WorkerMetrics::*counters;
+        const uint64_t* bounds;
+        double scale;
+    };
+    static const WorkerHistogram worker_histograms[] = {
+        {"tinyllm_time_to_first_token_seconds", "Time from the arrival of a /process request to its first generated token.",
+         &WorkerMetrics::time_to_first_token, LATENCY_BOUNDS_US, 1e6},
+        {"tinyllm_prefill_seconds", "Time from dequeue to the first token computed: tokenizing and the forward pass over the prompt.",
+         &WorkerMetrics::prefill, LATENCY_BOUNDS_US, 1e6},
+        {"tinyllm_inter_token_seconds", "Time between consecutive decode steps of a task.", &WorkerMetrics::inter_token, LATENCY_BOUNDS_US, 1e6},
+        {"tinyllm_tokens_generated", "Tokens generated per request (per item for /process_batch).", &WorkerMetrics::tokens_generated, TOKEN_COUNT_BOUNDS, 1.0},
+    };
+    for (const WorkerHistogram& histogram : worker_histograms) {
+        Metrics::append_family(out, histogram.name, "histogram", histogram.help);
+        for (int i = 0; i < workers; ++i) {
+            std::fill(buckets, buckets + HISTOGRAM_BUCKETS, 0);
+            sum = 0;
+            (ipc_manager->worker_metrics(i).*histogram.counters).add_to(buckets, sum);
+            Metrics::append_histogram(out, histogram.name, "worker=\"" + std::to_string(i) + "\"", histogram.bounds, buckets, sum, histogram.scale);
         }
     }
-    
-    // Notify worker manager about request completion
-    worker_manager->on_request_complete(assigned_worker);
+    Metrics::append_family(out, "tinyllm_generated_tokens_total", "counter", "Tokens generated.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_generated_tokens_total", "worker=\"" + std::to_string(i) + "\"", static_cast<double>(ipc_manager->get_generated_tokens(i)));
+    }
+    Metrics::append_family(out, "tinyllm_canceled_requests_total", "counter", "Tasks abandoned because their client went away.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_canceled_requests_total", "worker=\"" + std::to_string(i) + "\"", static_cast<double>(ipc_manager->get_canceled_count(i)));
+    }
+
+    // Live worker state, from the telemetry block each worker keeps in shared memory
+    uint64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    Metrics::append_family(out, "tinyllm_worker_state", "gauge", "What the worker does: 0 offline, 1 starting, 2 idle, 3 prefill, 4 decode, 5 waiting for output.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_worker_state", "worker=\"" + std::to_string(i) + "\"", ipc_manager->worker_telemetry(i).state.load(std::memory_order_relaxed));
+    }
+    Metrics::append_family(out, "tinyllm_worker_heartbeat_age_seconds", "gauge", "Time since the worker's last decode step or state change.");
+    for (int i = 0; i < workers; ++i) {
+        uint64_t heartbeat_ns = ipc_manager->worker_telemetry(i).heartbeat_ns.load(std::memory_order_relaxed);
+        double age_s = heartbeat_ns != 0 && now_ns > heartbeat_ns ? static_cast<double>(now_ns - heartbeat_ns) / 1e9 : 0.0;
+        Metrics::append_sample(out, "tinyllm_worker_heartbeat_age_seconds", "worker=\"" + std::to_string(i) + "\"", age_s);
+    }
+    Metrics::append_family(out, "tinyllm_worker_decode_step_seconds", "gauge", "Moving average of the worker's decode step, 1 over it is its tokens per second.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_worker_decode_step_seconds", "worker=\"" + std::to_string(i) + "\"",
+                               static_cast<double>(ipc_manager->worker_telemetry(i).step_ns_avg.load(std::memory_order_relaxed)) / 1e9);
+    }
+    Metrics::append_family(out, "tinyllm_worker_sequence_length", "gauge", "Tokens in the model context of the task the worker runs.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_worker_sequence_length", "worker=\"" + std::to_string(i) + "\"", ipc_manager->worker_telemetry(i).sequence_length.load(std::memory_order_relaxed));
+    }
+    Metrics::append_family(out, "tinyllm_worker_resident_bytes", "gauge", "Resident set size of the worker process.");
+    for (int i = 0; i < workers; ++i) {
+        Metrics::append_sample(out, "tinyllm_worker_resident_bytes", "worker=\"" + std::to_string(i) + "\"",
+                               static_cast<double>(ipc_manager->worker_telemetry(i).rss_bytes.load(std::memory_order_relaxed)));
+    }
+    Metrics::append_family(out, "tinyllm_worker_stalled_restarts_total", "counter", "Workers restarted because their heartbeat stalled mid-task.");
+    Metrics::append_sample(out, "tinyllm_worker_stalled_restarts_total", "", static_cast<double>(worker_manager->get_stalled_restarts()));
+
+    // Recorded on the server, global
+    Metrics::append_family(out, "tinyllm_queue_wait_seconds", "histogram", "Time a task waited in the scheduler for a worker, per priority class.");
+    for (int i = 0; i < PRIORITY_CLASSES; ++i) {
+        const Histogram& histogram = scheduler->class_stats(static_cast<RequestPriority>(i)).wait_us;
+        histogram.snapshot(buckets, sum);
+        Metrics::append_histogram(out, "tinyllm_queue_wait_seconds", std::string("priority=\"") + priority_names[i] + "\"", histogram.bounds(), buckets, sum, 1e6);
+    }
+    Metrics::append_family(out, "tinyllm_scheduler_waiting", "gauge", "Tasks waiting in the scheduler, per priority class.");
+    for (int i = 0; i < PRIORITY_CLASSES; ++i) {
+        Metrics::append_sample(out, "tinyllm_scheduler_waiting", std::string("priority=\"") + priority_names[i] + "\"",
+                               static_cast<double>(scheduler->class_stats(static_cast<RequestPriority>(i)).waiting.load(std::memory_order_relaxed)));
+    }
+    Metrics::append_family(out, "tinyllm_scheduler_in_flight", "gauge", "Tasks handed to the workers and not finished.");
+    Metrics::append_sample(out, "tinyllm_scheduler_in_flight", "", scheduler->in_flight());
+
+    uint64_t rejected = admission->rejected_count();
+    uint64_t rejected_deadline = admission->rejected_deadline_count();
+    Metrics::append_family(out, "tinyllm_rejected_requests_total", "counter", "Requests answered 429 by admission control, by the limit they would have exceeded.");
+    Metrics::append_sample(out, "tinyllm_rejected_requests_total", "reason=\"queue_wait\"", static_cast<double>(rejected - rejected_deadline));
+    Metrics::append_sample(out, "tinyllm_rejected_requests_total", "reason=\"deadline\"", static_cast<double>(rejected_deadline));
+    uint64_t expired_by_workers = 0;
+    for (int i = 0; i < workers; ++i) expired_by_workers += ipc_manager->get_expired_count(i);
+    Metrics::append_family(out, "tinyllm_expired_requests_total", "counter", "Admitted requests dropped because their deadline passed before generation started.");
+    Metrics::append_sample(out, "tinyllm_expired_requests_total", "stage=\"dispatch\"", static_cast<double>(expired_before_dispatch.load(std::memory_order_relaxed)));
+    Metrics::append_sample(out, "tinyllm_expired_requests_total", "stage=\"worker\"", static_cast<double>(expired_by_workers));
+    Metrics::append_family(out, "tinyllm_queued_tokens", "gauge", "Token budgets of the admitted requests not finished yet.");
+    Metrics::append_sample(out, "tinyllm_queued_tokens", "", static_cast<double>(admission->queued_tokens()));
+    Metrics::append_family(out, "tinyllm_estimated_tokens_per_second", "gauge", "Generation rate admission control estimates queue waits with.");
+    Metrics::append_sample(out, "tinyllm_estimated_tokens_per_second", "", admission->tokens_per_sec());
+    Metrics::append_family(out, "tinyllm_workers_active", "gauge", "Worker processes running.");
+    Metrics::append_sample(out, "tinyllm_workers_active", "", worker_manager->get_active_worker_count());
+}
+
+void TaskDispatcher::append_trace(std::string& out) const {
+    std::vector<TraceSpan> server_spans;
+    Trace::snapshot_threads(server_spans);
+    int workers = ipc_manager->get_max_workers();
+    std::vector<std::vector<TraceSpan>> worker_spans(workers);
+    std::vector<uint32_t> worker_pids(workers);
+    for (int i = 0; i < workers; ++i) {
+        ipc_manager->worker_trace(i).snapshot(worker_spans[i]);
+        worker_pids[i] = ipc_manager->worker_telemetry(i).pid.load(std::memory_order_relaxed);
+    }
+    Trace::append_chrome_json(out, static_cast<uint32_t>(getpid()), server_spans, worker_spans, worker_pids);
 }
 
+std::vector<std::string> TaskDispatcher::scheduler_stats_rows() const {
+    static const char* names[PRIORITY_CLASSES] = {"high", "normal", "low"};
+    std::vector<std::string> rows;
+    char row[96];
+    for (int i = 0; i < PRIORITY_CLASSES; ++i) {
+        const RequestScheduler::ClassStats& stats = scheduler->class_stats(static_cast<RequestPriority>(i));
+        uint64_t dispatched = stats.dispatched.load(std::memory_order_relaxed);
+        double avg_ms = dispatched ? stats.wait_ns_total.load(std::memory_order_relaxed) / 1e6 / dispatched : 0.0;
+        snprintf(row, sizeof(row), " %-6s Waiting: %4llu  Dispatched: %7llu  Avg: %7.1f ms  Max: %7.1f ms", names[i],
+                 static_cast<unsigned long long>(stats.waiting.load(std::memory_order_relaxed)), static_cast<unsigned long long>(dispatched),
+                 avg_ms, stats.wait_ns_max.load(std::memory_order_relaxed) / 1e6);
+        rows.push_back(row);
+    }
+    return rows;
+}
 
 void TaskDispatcher::monitor_thread_loop() {
     std::this_thread::sleep_for(std::chrono::seconds(2));
@@ -126,7 +583,7 @@ void TaskDispatcher::monitor_thread_loop() {
         if (!should_stop_monitoring.load()) {
             worker_manager->check_and_scale();
             worker_manager->restart_unhealthy_workers();
-            worker_manager->print_stats();
+            worker_manager->print_stats("QUEUE WAIT", scheduler_stats_rows());
         }
     }
 }
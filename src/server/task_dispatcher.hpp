@@ -1,22 +1,40 @@
 #pragma once
 
 #include "../ipc/ipc_utils.hpp"
+#include "../utils/http_utils.hpp"
 #include "worker_manager.hpp"
+#include "response_pump.hpp"
+#include "admission_control.hpp"
+#include "request_scheduler.hpp"
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <atomic>
 #include <thread>
 #include <functional>
 
+class HybridTokenizer; // Forward declaration
+
 // Task dispatcher manages worker pool and task assignment
 class TaskDispatcher {
 private:
     std::unique_ptr<IPCManager> ipc_manager;
     std::unique_ptr<WorkerManager> worker_manager;
+    std::unique_ptr<ResponsePump> response_pump;   // streams every in-flight response from one thread
+    std::unique_ptr<AdmissionController> admission;
+    std::unique_ptr<RequestScheduler> scheduler;    // orders the tasks waiting for a worker, see request_scheduler.hpp
+
+    // Server side tokenization (SERVER_TOKENIZATION=1): prompts are tokenized on the connection threads and workers receive token ids.
+    std::unique_ptr<HybridTokenizer> tokenizer;
+    bool server_tokenization;
+    int max_prompt_tokens;
     
     // Background monitoring thread
     std::unique_ptr<std::thread> monitor_thread;
     std::atomic<bool> should_stop_monitoring;
+
+    std::atomic<uint64_t> expired_before_dispatch{0};
 public:
     TaskDispatcher();
     ~TaskDispatcher();
@@ -24,10 +42,57 @@ public:
     // Initialize the dispatcher and shared memory
     bool initialize();
 
-    void process_message(std::function<bool(const std::string&)> chunk_callback, const std::string& message, int max_tokens);
+    // Tokenize the prompt on the calling thread when server side tokenization is on. Returns false with error_message set
+    // when the prompt is longer than MAX_PROMPT_TOKENS (or does not fit in a payload), so it can be rejected before it reaches a worker.
+    bool prepare_request(ProcessRequest& request, std::string& error_message) const;
+
+    // Admission control for count requests that arrived together (one /process, or the items of a /process_batch), before
+    // anything is queued for them. Sets their arrival_ns and deadline_ns. The ticket keeps their tokens counted as queued, hold it until
+    // the response is done. nullptr when they would wait longer than allowed: answer 429 with Retry-After retry_after_s.
+    std::shared_ptr<AdmissionController::Ticket> admit(ProcessRequest* requests, size_t count, uint32_t& retry_after_s);
+    // Seconds until the queue drains, for a Retry-After on requests dropped after admission
+    uint32_t retry_after_s() { return admission->retry_after_s(); }
+    // An admitted request whose deadline passed before it was handed to the scheduler
+    void record_expired_before_dispatch() { expired_before_dispatch.fetch_add(1, std::memory_order_relaxed); }
+
+    // Append the dispatcher's metrics in the Prometheus text format: the workers' latency histograms, queue wait per
+    // priority class, admission and scheduler state, rejected, expired and canceled requests
+    void append_metrics(std::string& out) const;
+    // Append the trace spans of this server and its workers as Chrome trace JSON, see utils/trace.hpp
+    void append_trace(std::string& out) const;
+
+    // Enqueue the request on a worker and hand its response stream to the response pump, returns without waiting for the generation.
+    // When the workers have as many tasks as SCHEDULER_TASKS_PER_WORKER allows it waits in the scheduler first, by priority and cost.
+    // stream_callback receives the worker's framed HTTP chunks in place, chunk_callback the JSON chunks produced on the server
+    // (prompt echo, errors). on_finished runs once at the end, with body_complete when the stream already carried the
+    // terminating chunk. All run on the pump thread, or on the calling thread when the request fails before reaching a worker.
+    void process_message(std::function<bool(const std::string&)> chunk_callback, std::function<bool(struct iovec*, int)> stream_callback,
+                         std::function<void(bool body_complete)> on_finished, const ProcessRequest& request);
+    // Split the prompts of a /process_batch request into batch tasks of at most MAX_BATCH_TASK_ITEMS (and one payload) and
+    // spread them over the workers (through the scheduler, as the highest priority among their items), each generating its share side by side. on_lines receives complete NDJSON lines as
+    // the items finish (HttpUtils::append_batch_result_line), and an error line for every item that gets no result. It
+    // returns false once the client is gone, all tasks of the batch are then canceled; it is also called with no lines
+    // to push out what the connection queued. on_finished runs once, after the last line. Both run on the pump thread,
+    // or on the calling thread for items that fail before reaching a worker.
+    void process_batch(const std::vector<ProcessRequest>& items, std::function<bool(std::string_view lines)> on_lines,
+                       std::function<void()> on_finished);
     void stop_monitor_thread();
     void start_monitor_thread();
     void monitor_thread_loop();
 private:
-
+    // Queue wait per priority class, for the monitor
+    std::vector<std::string> scheduler_stats_rows() const;
+    struct BatchProgress;
+    // The part of process_message that runs once the scheduler lets the request through. Releases its scheduler place
+    // when the stream ends or the request fails to reach a worker. submitted_ns is when it went to the scheduler, for a traced request.
+    void dispatch_message(std::function<bool(const std::string&)> chunk_callback, std::function<bool(struct iovec*, int)> stream_callback,
+                          std::function<void(bool body_complete)> on_finished, const ProcessRequest& request, uint64_t submitted_ns);
+    // Hand the items at indices group to the scheduler as one batch task
+    void dispatch_batch_task(const std::vector<ProcessRequest>& items, const std::vector<uint32_t>& group,
+                             const std::shared_ptr<BatchProgress>& progress);
+    // Enqueue it once the scheduler lets it through, or answer its items with error lines when that fails.
+    // submitted_ns is when it went to the scheduler, for a traced batch.
+    void enqueue_batch_task(const std::vector<uint32_t>& group, const std::string& header, const std::string& body,
+                            uint64_t deadline_ns, const std::shared_ptr<BatchProgress>& progress, const RequestTrace& trace,
+                            uint64_t submitted_ns, bool dispatch);
 };
\ No newline at end of file
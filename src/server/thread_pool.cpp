@@ -0,0 +1,49 @@
+#include "thread_pool.hpp"
+
+
+ThreadPool::ThreadPool(size_t thread_count, size_t max_queued) : max_queued(max_queued), stopping(false) {
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back([this]() { run(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    stop();
+}
+
+bool ThreadPool::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || jobs.size() >= max_queued) return false;
+        jobs.push_back(std::move(job));
+    }
+    job_ready.notify_one();
+    return true;
+}
+
+void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping) return;
+        stopping = true;
+        jobs.clear();
+    }
+    job_ready.notify_all();
+    for (std::thread& thread : threads) {
+        if (thread.joinable()) thread.join();
+    }
+}
+
+void ThreadPool::run() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
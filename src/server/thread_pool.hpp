@@ -0,0 +1,31 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads for the blocking part of a request (tokenization, waiting for ring space in enqueue_request),
+// so the event loops never block. The queue is bounded, submit refuses work instead of letting it pile up.
+class ThreadPool {
+public:
+    ThreadPool(size_t thread_count, size_t max_queued);
+    ~ThreadPool();
+
+    // Queue a job, false when max_queued jobs are already waiting or the pool is stopped
+    bool submit(std::function<void()> job);
+    // Finish the running jobs and join, jobs still queued are dropped
+    void stop();
+
+private:
+    size_t max_queued;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> threads;
+
+    void run();
+};
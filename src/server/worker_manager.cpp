@@ -9,7 +9,9 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <cstring>
+#include <cstdlib>
 #include <signal.h>
+#include <sys/eventfd.h>
 
 // #define DEBUG_PRINT
 
@@ -19,21 +21,40 @@
 #define DEBUG_COUT(x)
 #endif
 
+static uint64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 
-WorkerManager::WorkerManager(IPCManager* ipc, const std::string& worker_exec_path, int min_w, int max_w)
+WorkerManager::WorkerManager(IPCManager* ipc, const std::string& worker_exec_path, int min_w, int max_w, bool huge_page_weights,
+                             uint32_t stall_timeout_ms)
     : ipc_manager(ipc), active_worker_count(0), min_workers(min_w), max_workers(max_w), 
-      worker_executable_path(worker_exec_path), pending_requests(0), total_requests_processed(0) {
+      worker_executable_path(worker_exec_path), huge_page_weights(huge_page_weights), stall_timeout_ms(stall_timeout_ms), stalled_restarts(0),
+      pending_requests(0), total_requests_processed(0) {
     std::cout << "Building WorkerManager with: min=" << min_w << ", max=" << max_w 
               << ", executable=" << worker_exec_path << std::endl;
-    workers.resize(MAX_WORKERS);
+    workers.resize(std::max(max_w, 1));   // one slot per shared-memory worker queue, both sized from MAX_WORKERS_DYNAMIC
+    for (int i = 0; i < pool_size(); ++i) {
+        notify_fds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+    }
     last_scale_check = std::chrono::steady_clock::now();
 }
 
 WorkerManager::~WorkerManager() {
     cleanup();
+    for (int fd : notify_fds) {
+        if (fd != -1) close(fd);
+    }
 }
 
 bool WorkerManager::initialize() {
+    for (int fd : notify_fds) {
+        if (fd == -1) {
+            std::cerr << "Failed to create worker notification eventfd: " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+
     // Check if worker executable exists
     if (!std::filesystem::exists(worker_executable_path)) {
         std::cerr << "Worker executable not found: " << worker_executable_path << std::endl;
@@ -44,7 +65,7 @@ bool WorkerManager::initialize() {
     std::cout << "Starting initial " << min_workers.load() << " worker processes..." << std::endl;
     
     // Start minimum number of workers
-    for (int i = 0; i < min_workers.load() && i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < min_workers.load() && i < pool_size(); ++i) {
         if (!spawn_worker(i)) {
             std::cerr << "Failed to spawn initial worker " << i << std::endl;
             cleanup();
@@ -60,7 +81,7 @@ void WorkerManager::cleanup() {
     std::cout << "Cleaning up worker processes..." << std::endl;
     
     // Terminate all active workers
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < pool_size(); ++i) {
         if (workers[i] && is_worker_deployed(i)) {
             terminate_worker(i);
         }
@@ -70,7 +91,7 @@ void WorkerManager::cleanup() {
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
     
     // Force kill any remaining workers
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < pool_size(); ++i) {
         if (workers[i] && workers[i]->pid > 0) {
             kill(workers[i]->pid, SIGKILL);
             waitpid(workers[i]->pid, nullptr, WNOHANG);
@@ -83,7 +104,7 @@ void WorkerManager::cleanup() {
 }
 
 bool WorkerManager::spawn_worker(int worker_index) {
-    if (worker_index < 0 || worker_index >= MAX_WORKERS) {
+    if (worker_index < 0 || worker_index >= pool_size()) {
         DEBUG_COUT("Invalid worker index: " << worker_index);
         return false;
     }
@@ -94,6 +115,9 @@ bool WorkerManager::spawn_worker(int worker_index) {
     }
     
     DEBUG_COUT("Spawning worker " << worker_index << "...");
+    // Fresh telemetry before the process exists, it starts beating once its model is loaded
+    WorkerTelemetry& telemetry = ipc_manager->worker_telemetry(worker_index);
+    telemetry.reset(WorkerState::Starting, 0, steady_now_ns());
     
     pid_t pid = fork();
     if (pid == -1) {
@@ -104,6 +128,8 @@ bool WorkerManager::spawn_worker(int worker_index) {
     if (pid == 0) {
         // Child process - execute worker
         std::string index_arg = "--index=" + std::to_string(worker_index);
+        std::string notify_arg = "--notify_fd=" + std::to_string(notify_fds[worker_index]);
+        fcntl(notify_fds[worker_index], F_SETFD, 0);   // keep this worker's eventfd open across exec, the others stay close-on-exec
         
         // Redirect stdout/stderr to avoid cluttering server output
         // You can remove this if you want to see worker output
@@ -114,7 +140,14 @@ bool WorkerManager::spawn_worker(int worker_index) {
             close(devnull);
         }
         
-        execl(worker_executable_path.c_str(), "worker", index_arg.c_str(), nullptr);
+        // The weights are ordinary heap allocations, glibc's malloc can madvise(MADV_HUGEPAGE) them itself
+        if (huge_page_weights) {
+            const char* tunables = getenv("GLIBC_TUNABLES");
+            std::string value = std::string(tunables ? tunables : "") + (tunables ? ":" : "") + "glibc.malloc.hugetlb=1";
+            setenv("GLIBC_TUNABLES", value.c_str(), 1);
+        }
+
+        execl(worker_executable_path.c_str(), "worker", index_arg.c_str(), notify_arg.c_str(), nullptr);
         
         // If we reach here, exec failed
         std::cerr << "Failed to exec worker: " << strerror(errno) << std::endl;
@@ -122,6 +155,7 @@ bool WorkerManager::spawn_worker(int worker_index) {
     }
     
     // Parent process - store worker info
+    telemetry.pid.store(static_cast<uint32_t>(pid), std::memory_order_relaxed);
     workers[worker_index] = std::make_unique<WorkerInfo>(pid, worker_index);
     active_worker_count.fetch_add(1);
     
@@ -134,7 +168,7 @@ bool WorkerManager::spawn_worker(int worker_index) {
 }
 
 bool WorkerManager::terminate_worker(int worker_index) {
-    if (worker_index < 0 || worker_index >= MAX_WORKERS || !workers[worker_index]) {
+    if (worker_index < 0 || worker_index >= pool_size() || !workers[worker_index]) {
         return false;
     }
     
@@ -159,6 +193,15 @@ bool WorkerManager::terminate_worker(int worker_index) {
 
         DEBUG_COUT("Worker " << worker_index << " terminated");
     }
+
+    // The process is gone: a task it was still running would never get its last chunk, end it for its client
+    WorkerTelemetry& telemetry = ipc_manager->worker_telemetry(worker_index);
+    uint64_t task_id = telemetry.task_id.load(std::memory_order_relaxed);
+    if (task_id != 0) {
+        DEBUG_COUT("Worker " << worker_index << " left task " << task_id << " unfinished, ending its stream");
+        ipc_manager->abandon_task(telemetry.task_queue.load(std::memory_order_relaxed), telemetry.task_ring_pos.load(std::memory_order_relaxed), task_id);
+    }
+    telemetry.reset(WorkerState::Offline, 0, 0);
     
     workers[worker_index].reset();
     active_worker_count.fetch_sub(1);
@@ -168,7 +211,7 @@ bool WorkerManager::terminate_worker(int worker_index) {
 void WorkerManager::on_request_start(int worker_index) {
     pending_requests.fetch_add(1);
     
-    if (worker_index >= 0 && worker_index < MAX_WORKERS && workers[worker_index]) {
+    if (worker_index >= 0 && worker_index < pool_size() && workers[worker_index]) {
         workers[worker_index]->is_active.store(true);
         update_worker_activity(worker_index);
     }
@@ -178,7 +221,7 @@ void WorkerManager::on_request_complete(int worker_index) {
     pending_requests.fetch_sub(1);
     total_requests_processed.fetch_add(1);
     
-    if (worker_index >= 0 && worker_index < MAX_WORKERS && workers[worker_index]) {
+    if (worker_index >= 0 && worker_index < pool_size() && workers[worker_index]) {
         workers[worker_index]->is_active.store(false);
         workers[worker_index]->tasks_processed.fetch_add(1);
         update_worker_activity(worker_index);
@@ -189,7 +232,7 @@ int WorkerManager::find_least_loaded_worker() {
     int least_loaded_worker = -1;
     int min_queue_size = -1;
 
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < pool_size(); ++i) {
         if (is_worker_deployed(i)) {
             int current_queue_size = 0;
             if (ipc_manager->get_request_queue_size(i, current_queue_size)) {
@@ -206,8 +249,8 @@ int WorkerManager::find_least_loaded_worker() {
 int WorkerManager::assign_task_to_worker() {
     // 1. Find an idle worker (round-robin for fairness)
     static std::atomic<int> round_robin_counter(0);
-    for (int i = 0; i < MAX_WORKERS; ++i) {
-        int worker_idx = round_robin_counter.fetch_add(1) % MAX_WORKERS;
+    for (int i = 0; i < pool_size(); ++i) {
+        int worker_idx = round_robin_counter.fetch_add(1) % pool_size();
         if (is_worker_deployed(worker_idx) && !workers[worker_idx]->is_active.load()) {
             return worker_idx;
         }
@@ -215,7 +258,7 @@ int WorkerManager::assign_task_to_worker() {
 
     // 2. If no idle workers, try to scale up
     if (active_worker_count.load() < max_workers.load()) {
-        for (int i = 0; i < MAX_WORKERS; ++i) {
+        for (int i = 0; i < pool_size(); ++i) {
             if (!is_worker_deployed(i)) {
                 DEBUG_COUT("Scaling up on demand: adding worker " << i);
                 if (spawn_worker(i)) {
@@ -250,7 +293,7 @@ void WorkerManager::check_and_scale() {
     if (should_scale_down()) {
         // Find an idle worker to terminate
         auto now_idle = std::chrono::steady_clock::now();
-        for (int i = MAX_WORKERS - 1; i >= 0; --i) {  // Start from highest index
+        for (int i = pool_size() - 1; i >= 0; --i) {  // Start from highest index
             if (workers[i] && is_worker_deployed(i) && !workers[i]->is_active.load()) {
                 auto idle_time = now_idle - workers[i]->last_activity;
                 if (idle_time > WORKER_IDLE_TIMEOUT) {
@@ -276,10 +319,25 @@ bool WorkerManager::is_worker_healthy(int worker_index) {
     return result == 0;
 }
 
+bool WorkerManager::is_worker_stalled(int worker_index) const {
+    if (stall_timeout_ms == 0) return false;
+    const WorkerTelemetry& telemetry = ipc_manager->worker_telemetry(worker_index);
+    // State first: the worker moves the heartbeat before the state, so this heartbeat is at least as new as the state
+    WorkerState state = static_cast<WorkerState>(telemetry.state.load(std::memory_order_acquire));
+    if (state != WorkerState::Prefill && state != WorkerState::Decode) return false;   // parked or waiting for the server
+    uint64_t heartbeat_ns = telemetry.heartbeat_ns.load(std::memory_order_relaxed);
+    uint64_t now_ns = steady_now_ns();
+    return now_ns > heartbeat_ns && now_ns - heartbeat_ns > static_cast<uint64_t>(stall_timeout_ms) * 1000000;
+}
+
 void WorkerManager::restart_unhealthy_workers() {
-    for (int i = 0; i < MAX_WORKERS; ++i) {
-        if (workers[i] && !is_worker_healthy(i)) {
-            DEBUG_COUT("Restarting unhealthy worker " << i);
+    for (int i = 0; i < pool_size(); ++i) {
+        if (!workers[i]) continue;
+        // A live process whose heartbeat stopped mid-task is as good as dead, and its task waits forever otherwise
+        bool stalled = is_worker_stalled(i);
+        if (stalled || !is_worker_healthy(i)) {
+            if (stalled) stalled_restarts.fetch_add(1, std::memory_order_relaxed);
+            DEBUG_COUT("Restarting " << (stalled ? "stalled" : "unhealthy") << " worker " << i);
             terminate_worker(i);
             if (active_worker_count.load() < min_workers.load()) {
                 spawn_worker(i);
@@ -294,12 +352,12 @@ void WorkerManager::restart_unhealthy_workers() {
 
 // Private helper methods
 bool WorkerManager::is_worker_deployed(int worker_index) const {
-    return worker_index >= 0 && worker_index < MAX_WORKERS && 
+    return worker_index >= 0 && worker_index < pool_size() && 
            workers[worker_index] && workers[worker_index]->pid > 0;
 }
 
 void WorkerManager::update_worker_activity(int worker_index) {
-    if (worker_index >= 0 && worker_index < MAX_WORKERS && workers[worker_index]) {
+    if (worker_index >= 0 && worker_index < pool_size() && workers[worker_index]) {
         workers[worker_index]->last_activity = std::chrono::steady_clock::now();
     }
 }
@@ -315,7 +373,7 @@ bool WorkerManager::should_scale_down() const {
 
 int WorkerManager::count_idle_workers() const {
     int idle_count = 0;
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < pool_size(); ++i) {
         if (workers[i] && is_worker_deployed(i) && !workers[i]->is_active.load()) {
             idle_count++;
         }
@@ -325,7 +383,7 @@ int WorkerManager::count_idle_workers() const {
 
 
 
-void WorkerManager::print_stats() const {
+void WorkerManager::print_stats(const std::string& extra_title, const std::vector<std::string>& extra_rows) const {
     // ANSI color codes
     const std::string RESET = "\033[0m";
     const std::string BOLD = "\033[1m";
@@ -339,7 +397,8 @@ void WorkerManager::print_stats() const {
     const std::string BG_GREEN = "\033[42m";
     const std::string BG_RED = "\033[41m";
 
-    std::cout << "\033[24A";
+    int extra_lines = extra_rows.empty() ? 0 : static_cast<int>(extra_rows.size()) + 3;
+    std::cout << "\033[" << 20 + pool_size() + extra_lines << "A";    // 20 fixed lines plus one row per worker and the extra section
         
     std::cout << BG_BLUE << WHITE << BOLD << "  WORKER TASK MANAGER                                                             " << RESET << std::endl;
     std::cout << std::endl;
@@ -349,6 +408,12 @@ void WorkerManager::print_stats() const {
     int max_count = max_workers.load();
     int pending_count = pending_requests.load();
     int total_processed = total_requests_processed.load();
+    uint64_t total_canceled = 0;
+    uint64_t total_expired = 0;
+    for (int i = 0; i < pool_size(); ++i) {
+        total_canceled += ipc_manager->get_canceled_count(i);
+        total_expired += ipc_manager->get_expired_count(i);
+    }
     
     // Calculate utilization
     double worker_utilization = (active_count > 0) ? ((double)active_count / max_count * 100.0) : 0.0;
@@ -383,42 +448,58 @@ void WorkerManager::print_stats() const {
     std::cout << " Total Processed: " << GREEN << BOLD << std::setfill(' ') << std::setw(8) << total_processed << RESET;
     std::cout << "                                    ";
     std::cout << CYAN << " │" << RESET << std::endl;
+
+    std::cout << CYAN << "│" << RESET;
+    std::cout << " Total Canceled: " << RED << BOLD << std::setfill(' ') << std::setw(9) << total_canceled << RESET;
+    std::cout << " Expired: " << RED << BOLD << std::setw(9) << total_expired << RESET;
+    std::cout << " Stalled: " << RED << BOLD << std::setw(5) << stalled_restarts.load(std::memory_order_relaxed) << RESET;
+    std::cout << "  ";
+    std::cout << CYAN << " │" << RESET << std::endl;
     
     std::cout << CYAN << "└" << std::setfill('-') << std::setw(78) << "-┘" << RESET << std::endl;
     std::cout << std::endl;
     
-    // Worker details table
+    // Worker details table, live state from each worker's telemetry block
     std::cout << CYAN << BOLD << "┌─ WORKER PROCESSES " << std::setfill('-') << std::setw(59) << "-┐" << RESET << std::endl;
-    std::cout << CYAN << "│" << RESET << BOLD << " ID │   PID   │  STATUS  │ TASKS │ UPTIME │ ACTIVITY        │" << RESET << CYAN << " │" << RESET << std::endl;
-    std::cout << CYAN << "├" << std::setfill('-') << std::setw(4) << "-┼" << std::setw(9) << "-┼" << std::setw(10) << "-┼" 
-              << std::setw(7) << "-┼" << std::setw(8) << "-┼" << std::setw(17) << "-┤" << RESET << std::endl;
+    std::cout << CYAN << "│" << RESET << BOLD << " ID │   PID   │  STATUS  │ TASKS │ UPTIME │ TOK/S │ SEQ │ RSS MB │ BEAT  │" << RESET << CYAN << " │" << RESET << std::endl;
+    // setw counts the 3 bytes of a box drawing character, the "-┼" pieces need 2 more than the column width
+    std::cout << CYAN << "├" << std::setfill('-') << std::setw(7) << "-┼" << std::setw(12) << "-┼" << std::setw(13) << "-┼" << std::setw(10) << "-┼"
+              << std::setw(11) << "-┼" << std::setw(10) << "-┼" << std::setw(8) << "-┼" << std::setw(11) << "-┼" << std::setw(10) << "-┤" << RESET << std::endl;
     
-    // Display worker information
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    uint64_t now_ns = steady_now_ns();
+    for (int i = 0; i < pool_size(); ++i) {
         std::cout << CYAN << "│" << RESET;
         
         if (workers[i] && is_worker_deployed(i)) {
-            // Worker ID
+            const WorkerTelemetry& telemetry = ipc_manager->worker_telemetry(i);
+            WorkerState state = static_cast<WorkerState>(telemetry.state.load(std::memory_order_acquire));
+            uint64_t heartbeat_ns = telemetry.heartbeat_ns.load(std::memory_order_relaxed);
+            uint64_t step_ns = telemetry.step_ns_avg.load(std::memory_order_relaxed);
+            bool generating = state == WorkerState::Prefill || state == WorkerState::Decode;
+
             std::cout << " " << BLUE << BOLD << std::setfill(' ') << std::setw(2) << i << RESET << " │";
-            
-            // PID
-            std::cout << " " << WHITE << std::setfill(' ') << std::setw(7) << workers[i]->pid << RESET << " │";
+            std::cout << " " << WHITE << std::setw(7) << workers[i]->pid << RESET << " │";
             
             // Status with color
-            bool is_processing = workers[i]->is_active.load();
-            if (is_processing) {
-                std::cout << " " << BG_GREEN << WHITE << " ACTIVE " << RESET << "  │";
+            if (is_worker_stalled(i)) {
+                std::cout << " " << BG_RED << WHITE << "STALLED " << RESET << " │";
+            } else if (state == WorkerState::Decode) {
+                std::cout << " " << BG_GREEN << WHITE << " DECODE " << RESET << " │";
+            } else if (state == WorkerState::Prefill) {
+                std::cout << " " << BG_GREEN << WHITE << "PREFILL " << RESET << " │";
+            } else if (state == WorkerState::OutputWait) {
+                std::cout << " " << YELLOW << BOLD << " OUTPUT " << RESET << " │";
+            } else if (state == WorkerState::Starting) {
+                std::cout << " " << BLUE << "STARTING" << RESET << " │";
             } else {
-                std::cout << " " << YELLOW << " IDLE  " << RESET << "  │";
+                std::cout << " " << YELLOW << "  IDLE  " << RESET << " │";
             }
             
-            // Tasks processed
-            std::cout << " " << GREEN << std::setfill(' ') << std::setw(5) << workers[i]->tasks_processed.load() << RESET << " │";
+            std::cout << " " << GREEN << std::setw(5) << telemetry.tasks_done.load(std::memory_order_relaxed) << RESET << " │";
             
-            // Uptime calculation
-            auto uptime = std::chrono::steady_clock::now() - workers[i]->last_activity;
-            auto uptime_seconds = std::chrono::duration_cast<std::chrono::seconds>(uptime).count();
-            std::cout << " " << WHITE << std::setfill(' ') << std::setw(6);
+            // Uptime since spawn
+            uint64_t uptime_seconds = (now_ns - telemetry.started_ns.load(std::memory_order_relaxed)) / 1000000000ull;
+            std::cout << " " << WHITE << std::setw(5);
             if (uptime_seconds < 60) {
                 std::cout << uptime_seconds << "s" << RESET << " │";
             } else if (uptime_seconds < 3600) {
@@ -426,27 +507,31 @@ void WorkerManager::print_stats() const {
             } else {
                 std::cout << uptime_seconds/3600 << "h" << RESET << " │";
             }
-            
-            // Activity indicator with animation
-            std::cout << " ";
-            if (is_processing) {
-                // Animated processing indicator
-                static int anim_frame = 0;
-                const char* frames[] = {"⠋", "⠙", "⠹", "⠸", "⠼", "⠴", "⠦", "⠧", "⠇", "⠏"};
-                std::cout << GREEN << frames[anim_frame % 10] << " Processing..." << RESET;
-                anim_frame++;
+
+            // Decode rate and context of the running task, blank while it has none
+            if (generating && step_ns > 0) {
+                std::cout << " " << GREEN << std::fixed << std::setprecision(1) << std::setw(5) << 1e9 / static_cast<double>(step_ns) << RESET << " │";
+            } else {
+                std::cout << "     - │";
+            }
+            if (generating) {
+                std::cout << " " << std::setw(3) << telemetry.sequence_length.load(std::memory_order_relaxed) << " │";
             } else {
-                std::cout << BLUE << "● Waiting      " << RESET;
+                std::cout << "   - │";
             }
-            std::cout << " │" << CYAN << " │" << RESET << std::endl;
+            std::cout << " " << std::fixed << std::setprecision(1) << std::setw(6)
+                      << static_cast<double>(telemetry.rss_bytes.load(std::memory_order_relaxed)) / (1024.0 * 1024.0) << " │";
+            double beat_age_s = now_ns > heartbeat_ns ? static_cast<double>(now_ns - heartbeat_ns) / 1e9 : 0.0;
+            std::cout << " " << (generating && beat_age_s > 1.0 ? RED : WHITE) << std::fixed << std::setprecision(1) << std::setw(4) << beat_age_s << "s" << RESET
+                      << " │" << CYAN << " │" << RESET << std::endl;
         } else {
             // Empty worker slot
             std::cout << " " << std::setfill(' ') << std::setw(2) << i << " │";
-            std::cout << " " << RED << "   ---   " << RESET << " │";
-            std::cout << " " << RED << " OFFLINE " << RESET << " │";
-            std::cout << " " << RED << "  --- " << RESET << " │";
-            std::cout << " " << RED << "  --- " << RESET << " │";
-            std::cout << " " << RED << "● Not started   " << RESET << " │" << CYAN << " │" << RESET << std::endl;
+            std::cout << " " << RED << "  ---  " << RESET << " │";
+            std::cout << " " << RED << "OFFLINE " << RESET << " │";
+            std::cout << " " << RED << "  ---" << RESET << " │";
+            std::cout << " " << RED << "   ---" << RESET << " │";
+            std::cout << "     - │   - │      - │     - │" << CYAN << " │" << RESET << std::endl;
         }
     }
     
@@ -460,7 +545,7 @@ void WorkerManager::print_stats() const {
     // Calculate average tasks per worker
     double avg_tasks = 0.0;
     int active_workers_with_tasks = 0;
-    for (int i = 0; i < MAX_WORKERS; ++i) {
+    for (int i = 0; i < pool_size(); ++i) {
         if (workers[i] && is_worker_deployed(i)) {
             int tasks = workers[i]->tasks_processed.load();
             if (tasks > 0) {
@@ -486,6 +571,15 @@ void WorkerManager::print_stats() const {
     std::cout << CYAN << " │" << RESET << std::endl;
     std::cout << CYAN << "└" << std::setfill('-') << std::setw(78) << "-┘" << RESET << std::endl;
     
+    if (!extra_rows.empty()) {
+        std::cout << std::endl;
+        std::cout << CYAN << BOLD << "┌─ " << extra_title << " " << std::setfill('-') << std::setw(75 - static_cast<int>(extra_title.length())) << "-┐" << RESET << std::endl;
+        for (const std::string& row : extra_rows) {
+            std::cout << CYAN << "│" << RESET << std::setfill(' ') << std::left << std::setw(76) << row << std::right << CYAN << " │" << RESET << std::endl;
+        }
+        std::cout << CYAN << "└" << std::setfill('-') << std::setw(78) << "-┘" << RESET << std::endl;
+    }
+
     // Footer
     std::cout << std::endl;
     std::cout << WHITE << "Press " << CYAN << "Ctrl+C" << WHITE << " to stop monitoring" << RESET << std::endl;
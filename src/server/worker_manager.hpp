@@ -27,7 +27,10 @@ struct WorkerInfo {
 
 class WorkerManager {
 public:
-    WorkerManager(IPCManager* ipc, const std::string& worker_exec_path, int min_w, int max_w);
+    // stall_timeout_ms: a worker whose heartbeat (WorkerTelemetry) is older than this while it prefills or decodes is
+    // restarted like one whose process died, 0 = only process liveness counts
+    WorkerManager(IPCManager* ipc, const std::string& worker_exec_path, int min_w, int max_w, bool huge_page_weights = false,
+                  uint32_t stall_timeout_ms = 0);
     ~WorkerManager();
     
     bool initialize();
@@ -41,14 +44,23 @@ public:
     void restart_unhealthy_workers();
     
     int get_active_worker_count() const { return active_worker_count.load(); }
-    void print_stats() const;
+    // Workers restarted because their heartbeat stalled
+    uint64_t get_stalled_restarts() const { return stalled_restarts.load(std::memory_order_relaxed); }
+    // One eventfd per worker slot, kept across respawns. Workers signal published responses on it, the response pump epolls them.
+    const std::vector<int>& get_notify_fds() const { return notify_fds; }
+    // extra_rows (plain text, at most 76 columns) are shown in a section of their own titled extra_title
+    void print_stats(const std::string& extra_title = "", const std::vector<std::string>& extra_rows = {}) const;
 
 private:
     std::vector<std::unique_ptr<WorkerInfo>> workers;
+    std::vector<int> notify_fds;
     std::atomic<int> active_worker_count;
     std::atomic<int> min_workers;
     std::atomic<int> max_workers;
     std::string worker_executable_path;
+    bool huge_page_weights;     // HUGE_PAGES: workers start with glibc's malloc advising THP for their (model weight) allocations
+    uint32_t stall_timeout_ms;
+    std::atomic<uint64_t> stalled_restarts;
     std::atomic<int> pending_requests;
     std::atomic<int> total_requests_processed;
     std::chrono::steady_clock::time_point last_scale_check;
@@ -62,10 +74,12 @@ private:
     const std::chrono::seconds WORKER_IDLE_TIMEOUT{10};
 
     // Private helper methods
+    int pool_size() const { return static_cast<int>(workers.size()); }
     bool spawn_worker(int worker_index);
     bool terminate_worker(int worker_index);
     bool is_worker_deployed(int worker_index) const;
     bool is_worker_healthy(int worker_index);
+    bool is_worker_stalled(int worker_index) const;
     void update_worker_activity(int worker_index);
     bool should_scale_down() const;
     int count_idle_workers() const;
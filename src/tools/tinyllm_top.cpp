@@ -0,0 +1,151 @@
+// tinyllm-top: live view of the workers of a running server, read straight from the telemetry each worker keeps in shared
+// memory (WorkerTelemetry). The mapping is read-only and nothing is written or locked, so watching never slows the server.
+// Run it from the server's directory (SHM_NAME comes from config.txt) or pass --shm=/name.
+//
+// usage: tinyllm-top [--shm=/name] [--interval=ms] [--once]
+
+#include "ipc/shared_mem.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+static volatile sig_atomic_t keep_running = 1;
+
+static void signal_handler(int) {
+    keep_running = 0;
+}
+
+static uint64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char* state_name(WorkerState state) {
+    switch (state) {
+        case WorkerState::Offline: return "offline";
+        case WorkerState::Starting: return "starting";
+        case WorkerState::Idle: return "idle";
+        case WorkerState::Prefill: return "prefill";
+        case WorkerState::Decode: return "decode";
+        case WorkerState::OutputWait: return "output";
+    }
+    return "?";
+}
+
+// Map the server's shared memory read-only, nullptr (with a message) when there is no running server of this layout
+static SharedMem* map_shared_mem(const char* name, size_t& size) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        std::fprintf(stderr, "Failed to open shared memory %s: %s (is the server running?)\n", name, strerror(errno));
+        return nullptr;
+    }
+    struct stat shm_stat;
+    if (fstat(fd, &shm_stat) == -1 || static_cast<size_t>(shm_stat.st_size) < sizeof(SharedMem)) {
+        std::fprintf(stderr, "Shared memory %s is not initialized yet\n", name);
+        close(fd);
+        return nullptr;
+    }
+    size = static_cast<size_t>(shm_stat.st_size);
+    void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        std::fprintf(stderr, "Failed to map shared memory: %s\n", strerror(errno));
+        return nullptr;
+    }
+    SharedMem* shared_mem = static_cast<SharedMem*>(map);
+    if (shared_mem->magic != SHM_MAGIC || shared_mem->version != SHM_LAYOUT_VERSION || shared_mem->total_size > size) {
+        std::fprintf(stderr, "Shared memory layout mismatch: magic %x version %u, this tool reads version %u\n", shared_mem->magic,
+                     shared_mem->version, SHM_LAYOUT_VERSION);
+        munmap(map, size);
+        return nullptr;
+    }
+    return shared_mem;
+}
+
+int main(int argc, char* argv[]) {
+    std::string shm_name;
+    long interval_ms = 1000;
+    bool once = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strncmp(argv[i], "--shm=", 6) == 0) {
+            shm_name = argv[i] + 6;
+        } else if (std::strncmp(argv[i], "--interval=", 11) == 0) {
+            interval_ms = std::max(100L, std::strtol(argv[i] + 11, nullptr, 10));
+        } else if (std::strcmp(argv[i], "--once") == 0) {
+            once = true;
+        } else {
+            std::fprintf(stderr, "usage: %s [--shm=/name] [--interval=ms] [--once]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (shm_name.empty()) shm_name = get_shm_name();
+
+    size_t size = 0;
+    SharedMem* shared_mem = map_shared_mem(shm_name.c_str(), size);
+    if (!shared_mem) return 1;
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    const int workers = static_cast<int>(shared_mem->max_workers);
+    std::vector<uint64_t> last_tokens(workers, 0);
+    uint64_t last_ns = 0;
+    while (keep_running) {
+        uint64_t now_ns = steady_now_ns();
+        double elapsed_s = last_ns ? static_cast<double>(now_ns - last_ns) / 1e9 : 0.0;
+        if (!once) std::printf("\033[H\033[2J");
+        std::printf("tinyllm-top  %s  %d workers, %u slots each%s\n\n", shm_name.c_str(), workers, shared_mem->ring_capacity,
+                    shared_mem->shutdown_flag.load(std::memory_order_relaxed) ? "  (shutting down)" : "");
+        std::printf("%3s %8s %-9s %6s %6s %8s %9s %4s %5s %8s %9s %8s %6s\n", "ID", "PID", "STATE", "QUEUE", "TASKS", "UPTIME", "TASK",
+                    "SEQ", "BATCH", "STEP/S", "TOKENS", "RSS MB", "BEAT");
+
+        double total_rate = 0.0;
+        for (int i = 0; i < workers; ++i) {
+            RequestQueue& queue = shared_mem->worker_queue(i);
+            const WorkerTelemetry& telemetry = queue.telemetry;
+            WorkerState state = static_cast<WorkerState>(telemetry.state.load(std::memory_order_acquire));
+            uint64_t tokens = queue.generated_tokens.load(std::memory_order_relaxed);
+            double rate = elapsed_s > 0.0 && tokens >= last_tokens[i] ? static_cast<double>(tokens - last_tokens[i]) / elapsed_s : 0.0;
+            last_tokens[i] = tokens;
+            total_rate += rate;
+            if (state == WorkerState::Offline) {
+                std::printf("%3d %8s %-9s %6u\n", i, "-", state_name(state), queue.head.load() - queue.tail.load());
+                continue;
+            }
+
+            bool generating = state == WorkerState::Prefill || state == WorkerState::Decode || state == WorkerState::OutputWait;
+            uint64_t heartbeat_ns = telemetry.heartbeat_ns.load(std::memory_order_relaxed);
+            uint64_t step_ns = telemetry.step_ns_avg.load(std::memory_order_relaxed);
+            uint64_t started_ns = telemetry.started_ns.load(std::memory_order_relaxed);
+            char task[24] = "-";
+            if (generating) std::snprintf(task, sizeof(task), "%llu", static_cast<unsigned long long>(telemetry.task_id.load(std::memory_order_relaxed)));
+            std::printf("%3d %8u %-9s %6u %6u %7llus %9s %4u %5u %8.1f %9llu %8.1f %5.1fs\n", i, telemetry.pid.load(std::memory_order_relaxed),
+                        state_name(state), queue.head.load() - queue.tail.load(), telemetry.tasks_done.load(std::memory_order_relaxed),
+                        static_cast<unsigned long long>(now_ns > started_ns ? (now_ns - started_ns) / 1000000000ull : 0), task,
+                        generating ? telemetry.sequence_length.load(std::memory_order_relaxed) : 0u,
+                        generating ? telemetry.batch_size.load(std::memory_order_relaxed) : 0u,
+                        generating && step_ns ? 1e9 / static_cast<double>(step_ns) : 0.0, static_cast<unsigned long long>(tokens),
+                        static_cast<double>(telemetry.rss_bytes.load(std::memory_order_relaxed)) / (1024.0 * 1024.0),
+                        now_ns > heartbeat_ns ? static_cast<double>(now_ns - heartbeat_ns) / 1e9 : 0.0);
+        }
+        if (last_ns) std::printf("\n%.1f tokens/s over the last %.1f s\n", total_rate, elapsed_s);
+        std::fflush(stdout);
+        if (once) break;
+        last_ns = now_ns;
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    }
+
+    munmap(shared_mem, size);
+    return 0;
+}
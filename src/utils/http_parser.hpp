@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Limits enforced while parsing, a request over them is answered with the status in HttpRequestParser::error_status
+constexpr size_t HTTP_MAX_HEADER_BYTES = 8 * 1024;     // request line and headers, 431 beyond
+constexpr size_t HTTP_MAX_HEADERS = 32;                // header lines, 431 beyond
+constexpr size_t HTTP_MAX_BODY_BYTES = 1024 * 1024;    // Content-Length, 413 beyond
+
+struct HttpHeaderView {
+    std::string_view name;
+    std::string_view value;
+};
+
+// A parsed request, every field points into the connection's input buffer and is only valid until the buffer moves on
+// to the next request. Copy out what has to outlive the request handler.
+struct HttpRequestView {
+    std::string_view method;
+    std::string_view path;
+    std::string_view version;
+    std::string_view body;
+    HttpHeaderView headers[HTTP_MAX_HEADERS];
+    size_t header_count = 0;
+    bool keep_alive = false;    // HTTP/1.1 unless "Connection: close", HTTP/1.0 only with "Connection: keep-alive"
+
+    // Value of the first header with this name, compared case-insensitively. Empty when there is none.
+    std::string_view header(std::string_view name) const;
+};
+
+// Resumable HTTP/1.x request parser. parse is called with the bytes of the request received so far, always from its
+// first byte and growing between calls, and continues at the first byte it has not looked at yet: a request trickling in
+// over many reads is scanned once. Positions are kept as offsets, so the buffer may be moved or grown between calls.
+class HttpRequestParser {
+public:
+    enum class Status {
+        Incomplete,     // needs more bytes
+        Complete,       // request() and request_size() are valid
+        Error,          // error_status() and error_message() say why, the connection cannot be reused
+    };
+
+    HttpRequestParser() { reset(); }
+
+    Status parse(const char* data, size_t length);
+    // Start over for the next request, whose first byte is at the start of the buffer again
+    void reset();
+
+    // Bytes of the whole request, headers and body. 0 until the headers are parsed, the buffer has to hold this much.
+    size_t request_size() const { return state >= State::Body ? body_start + content_length : 0; }
+    // Views into data, the same buffer (moved or not) the request was parsed from. Only after Complete.
+    HttpRequestView request(const char* data) const;
+
+    int error_status() const { return error_code; }
+    const char* error_message() const { return error_text; }
+
+private:
+    enum class State : uint8_t { RequestLine, Headers, Body, Done, Failed };
+    struct Span {
+        uint16_t start;     // offsets into the header block, which is at most HTTP_MAX_HEADER_BYTES long
+        uint16_t length;
+    };
+    struct HeaderSpan {
+        Span name;
+        Span value;
+    };
+
+    State state;
+    bool has_content_length;
+    bool connection_close;
+    bool connection_keep_alive;
+    uint8_t header_count;
+    uint32_t scan_pos;          // next byte not looked at yet
+    uint32_t line_start;        // start of the line being scanned
+    uint32_t body_start;
+    uint32_t content_length;
+    Span method;
+    Span path;
+    Span version;
+    HeaderSpan header_spans[HTTP_MAX_HEADERS];
+    int error_code;
+    const char* error_text;
+
+    Status fail(int status, const char* message);
+    bool parse_request_line(const char* data, size_t start, size_t end);
+    bool parse_header_line(const char* data, size_t start, size_t end);
+    bool finish_headers(const char* data);
+};
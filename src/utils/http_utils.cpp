@@ -1,156 +1,371 @@
 #include "http_utils.hpp"
-#include <iomanip>
-
-bool HttpUtils::parseJsonMessage(const std::string& jsonBody, ProcessRequest& request) {
-    size_t maxTokensPos = jsonBody.find("\"max_tokens\"");
-    size_t colonPos = jsonBody.find(":", maxTokensPos);
-     try {
-        request.max_tokens = std::stoi(jsonBody.substr(colonPos + 1));
-    } catch (const std::exception&) {
-        request.max_tokens = 0;
-    }
-
-    size_t messagePos = jsonBody.find("\"message\"");
-    if (messagePos == std::string::npos) return false;
-    
-    colonPos = jsonBody.find(":", messagePos);
-    if (colonPos == std::string::npos) return false;
-    
-    size_t quoteStart = jsonBody.find("\"", colonPos);
-    if (quoteStart == std::string::npos) return false;
-    
-    size_t quoteEnd = jsonBody.find("\"", quoteStart + 1);
-    if (quoteEnd == std::string::npos) return false;
-    
-    request.message = jsonBody.substr(quoteStart + 1, quoteEnd - quoteStart - 1);
+#include "json_reader.hpp"
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+
+static bool field_error(std::string& error, std::string_view field, const char* requirement, size_t offset) {
+    error = "Field \"" + std::string(field) + "\" " + requirement + " (offset " + std::to_string(offset) + ")";
+    return false;
+}
+
+static bool read_integer_field(JsonReader& reader, std::string_view field, int64_t min, int64_t max, const char* requirement,
+                               int64_t& value, std::string& error) {
+    size_t offset = reader.offset();
+    if (reader.peek() != JsonType::Number || !reader.read_int(value) || value < min || value > max) {
+        return field_error(error, field, requirement, offset);
+    }
     return true;
 }
 
-bool HttpUtils::readAndParseHttpRequest(SOCKET clientSocket, HttpRequest& request) {
-    std::string headerBuffer;
-    char buffer[1024];
-    bool headersParsed = false;
-    int contentLength = 0;
+static bool read_number_field(JsonReader& reader, std::string_view field, double min, double max, bool min_exclusive,
+                              const char* requirement, double& value, std::string& error) {
+    size_t offset = reader.offset();
+    if (reader.peek() != JsonType::Number || !reader.read_double(value) || value > max || value < min ||
+        (min_exclusive && value == min)) {
+        return field_error(error, field, requirement, offset);
+    }
+    return true;
+}
 
-    while (true) {
-        int bytesReceived = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesReceived <= 0) {
-            return false; // Connection closed or error
-        }
+// "stop": "text" or ["text", ...]
+static bool read_stop_field(JsonReader& reader, std::string_view field, std::vector<std::string>& stop, std::string& scratch,
+                            std::string& error) {
+    static const char* requirement = "must be a string or an array of at most 4 strings of 1 to 64 bytes";
+    std::string_view text;
+    stop.clear();
+    size_t offset = reader.offset();
+    JsonType type = reader.peek();
+    if (type == JsonType::String) {
+        if (!reader.read_string(text, scratch)) return false;
+        if (text.empty() || text.size() > MAX_STOP_LENGTH) return field_error(error, field, requirement, offset);
+        stop.emplace_back(text);
+        return true;
+    }
+    if (type != JsonType::Array || !reader.begin_array()) return field_error(error, field, requirement, offset);
+    while (reader.next_element()) {
+        offset = reader.offset();
+        if (reader.peek() != JsonType::String || stop.size() == MAX_STOP_STRINGS) return field_error(error, field, requirement, offset);
+        if (!reader.read_string(text, scratch)) return false;
+        if (text.empty() || text.size() > MAX_STOP_LENGTH) return field_error(error, field, requirement, offset);
+        stop.emplace_back(text);
+    }
+    return reader.ok();
+}
 
-        headerBuffer.append(buffer, bytesReceived);
-
-        // Parse headers when we have them
-        if (!headersParsed && headerBuffer.find("\r\n\r\n") != std::string::npos) {
-            headersParsed = true;
-
-            // Parse request line and headers
-            std::istringstream stream(headerBuffer);
-            std::string line;
-
-            // Parse request line
-            if (!std::getline(stream, line)) return false;
-            std::istringstream requestLine(line);
-            requestLine >> request.method >> request.path;
-
-            // Parse headers
-            while (std::getline(stream, line) && line != "\r" && !line.empty()) {
-                size_t colonPos = line.find(':');
-                if (colonPos != std::string::npos) {
-                    std::string key = line.substr(0, colonPos);
-                    std::string value = line.substr(colonPos + 1);
-                    // Trim whitespace
-                    while (!value.empty() && (value[0] == ' ' || value[0] == '\t')) value.erase(0, 1);
-                    while (!value.empty() && (value.back() == '\r' || value.back() == '\n')) value.pop_back();
-                    request.headers[key] = value;
-                }
-            }
+// One member of a request object, the reader is on its value. On false error says what is wrong with the field, or is
+// left empty for a syntax error the reader recorded.
+static bool read_request_field(JsonReader& reader, std::string_view key, ProcessRequest& request, bool& has_message,
+                               std::string& scratch, std::string& error) {
+    std::string_view text;
+    size_t offset = reader.offset();
+    JsonType type = reader.peek();
+    bool is_message = key == "message" || key == "prompt";
+    if (type == JsonType::Null && !is_message) {
+        return reader.skip_value();     // same as leaving the field out
+    }
+    int64_t integer;
+    double number;
+    if (is_message) {
+        if (type != JsonType::String) return field_error(error, key, "must be a string", offset);
+        if (!reader.read_string(text, scratch)) return false;
+        request.message.assign(text.data(), text.size());
+        has_message = true;
+    } else if (key == "max_tokens") {
+        if (!read_integer_field(reader, key, 0, INT32_MAX, "must be a non-negative integer", integer, error)) return false;
+        request.max_tokens = static_cast<int>(integer);
+    } else if (key == "temperature") {
+        if (!read_number_field(reader, key, 0.0, 2.0, false, "must be a number from 0 to 2", number, error)) return false;
+        request.sampling.temperature = static_cast<float>(number);
+    } else if (key == "top_k") {
+        if (!read_integer_field(reader, key, 0, INT32_MAX, "must be a non-negative integer", integer, error)) return false;
+        request.sampling.top_k = static_cast<int>(integer);
+    } else if (key == "top_p") {
+        if (!read_number_field(reader, key, 0.0, 1.0, true, "must be a number above 0 and at most 1", number, error)) return false;
+        request.sampling.top_p = static_cast<float>(number);
+    } else if (key == "seed") {
+        if (!read_integer_field(reader, key, 0, INT64_MAX, "must be a non-negative integer", integer, error)) return false;
+        request.sampling.seed = static_cast<uint64_t>(integer);
+    } else if (key == "stop") {
+        return read_stop_field(reader, key, request.stop, scratch, error);
+    } else if (key == "deadline_ms") {
+        if (!read_integer_field(reader, key, 1, INT32_MAX, "must be a positive integer", integer, error)) return false;
+        request.deadline_ms = static_cast<int>(integer);
+    } else if (key == "priority") {
+        if (type != JsonType::String) return field_error(error, key, "must be \"high\", \"normal\" or \"low\"", offset);
+        if (!reader.read_string(text, scratch)) return false;
+        if (!HttpUtils::parsePriority(text, request.priority)) return field_error(error, key, "must be \"high\", \"normal\" or \"low\"", offset);
+    } else {
+        return reader.skip_value();     // unknown field, ignored
+    }
+    return true;
+}
 
-            // Check Content-Length
-            auto contentLengthIt = request.headers.find("Content-Length");
-            if (contentLengthIt != request.headers.end()) {
-                contentLength = std::stoi(contentLengthIt->second);
-            } else if (request.method == "POST") {
-                return false; // Require Content-Length for POST requests
+bool HttpUtils::parsePriority(std::string_view text, RequestPriority& priority) {
+    if (text == "high") priority = RequestPriority::High;
+    else if (text == "normal") priority = RequestPriority::Normal;
+    else if (text == "low") priority = RequestPriority::Low;
+    else return false;
+    return true;
+}
+
+bool HttpUtils::parseJsonMessage(std::string_view jsonBody, ProcessRequest& request, std::string& error) {
+    JsonReader reader(jsonBody);
+    std::string key_scratch, value_scratch;     // only touched by strings with escapes
+    std::string_view key;
+    bool has_message = false;
+
+    if (reader.begin_object()) {
+        while (reader.next_member(key, key_scratch)) {
+            if (!read_request_field(reader, key, request, has_message, value_scratch, error)) {
+                if (!error.empty()) return false;
+                break;
             }
+        }
+    }
+    if (!reader.at_end()) {
+        error = "Invalid JSON: " + reader.error();
+        return false;
+    }
+    if (!has_message) {
+        error = "Missing field \"message\"";
+        return false;
+    }
+    return true;
+}
 
-            // Read body if we have it already in buffer
-            size_t headerEnd = headerBuffer.find("\r\n\r\n");
-            size_t bodyStart = headerEnd + 4;
-            size_t availableBody = headerBuffer.size() - bodyStart;
-
-            if (availableBody >= (size_t)contentLength) {
-                // Body is already in buffer
-                request.body = headerBuffer.substr(bodyStart, contentLength);
-                return true;
-            } else {
-                // Need to read more for body
-                request.body.reserve(contentLength);
-                request.body = headerBuffer.substr(bodyStart);
-                int remaining = contentLength - request.body.size();
-                while (remaining > 0) {
-                    int toRead = remaining < (int)sizeof(buffer) ? remaining : (int)sizeof(buffer);
-                    bytesReceived = recv(clientSocket, buffer, toRead, 0);
-                    if (bytesReceived <= 0) return false;
-                    request.body.append(buffer, bytesReceived);
-                    remaining -= bytesReceived;
+bool HttpUtils::parseBatchRequest(std::string_view jsonBody, std::vector<ProcessRequest>& items, std::string& error,
+                                  RequestPriority default_priority) {
+    static const char* requirement = "must be an array of 1 to 256 request objects";
+    JsonReader reader(jsonBody);
+    std::string key_scratch, item_key_scratch, value_scratch;
+    std::string_view key, item_key;
+    bool has_items = false;
+    items.clear();
+
+    if (reader.begin_object()) {
+        while (reader.next_member(key, key_scratch)) {
+            if (key != "items") {
+                if (!reader.skip_value()) break;    // unknown field, ignored
+                continue;
+            }
+            size_t offset = reader.offset();
+            if (reader.peek() != JsonType::Array || !reader.begin_array()) return field_error(error, key, requirement, offset);
+            has_items = true;
+            items.clear();      // a repeated "items" replaces the earlier one
+            while (reader.next_element()) {
+                offset = reader.offset();
+                if (items.size() == MAX_BATCH_ITEMS || reader.peek() != JsonType::Object) return field_error(error, key, requirement, offset);
+                items.emplace_back();
+                items.back().priority = default_priority;
+                bool has_message = false;
+                if (!reader.begin_object()) break;
+                while (reader.next_member(item_key, item_key_scratch)) {
+                    if (!read_request_field(reader, item_key, items.back(), has_message, value_scratch, error)) break;
                 }
-                return true;
+                if (!error.empty() || !reader.ok()) break;
+                if (!has_message) {
+                    error = "Missing field \"message\"";
+                    break;
+                }
+            }
+            if (!error.empty()) {
+                error = "Item " + std::to_string(items.size() - 1) + ": " + error;
+                return false;
             }
+            if (!reader.ok()) break;
+            if (items.empty()) return field_error(error, key, requirement, offset);
         }
     }
+    if (!reader.at_end()) {
+        error = "Invalid JSON: " + reader.error();
+        return false;
+    }
+    if (!has_items) {
+        error = "Missing field \"items\"";
+        return false;
+    }
+    return true;
+}
+
+const char* HttpUtils::statusText(int statusCode) {
+    switch (statusCode) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 408: return "Request Timeout";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        case 505: return "HTTP Version Not Supported";
+        default: return "Error";
+    }
+}
+
+// Status line and the headers every response carries, appended in one go without a stream
+static void append_response_head(std::string& out, int statusCode, const std::string& statusText, bool keepAlive, const std::string& contentType) {
+    char code[12];
+    int code_length = std::snprintf(code, sizeof(code), "%d ", statusCode);
+    out.append("HTTP/1.1 ", 9).append(code, code_length).append(statusText).append("\r\nContent-Type: ", 16).append(contentType).append("\r\n", 2);
+    out.append(keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
 }
 
 std::string HttpUtils::buildHttpResponse(int statusCode, const std::string& statusText, 
-                             const std::string& body, const std::string& contentType) {
-    std::ostringstream response;
-    response << "HTTP/1.1 " << statusCode << " " << statusText << "\r\n";
-    response << "Content-Type: " << contentType << "\r\n";
-    response << "Content-Length: " << body.length() << "\r\n";
-    response << "Connection: close\r\n";
-    response << "\r\n";
-    response << body;
-    return response.str();
-}
-
-std::string HttpUtils::buildHttpChunkedResponseHeader(int statusCode, const std::string& statusText, const std::string& contentType) {
-    std::ostringstream response;
-    response << "HTTP/1.1 " << statusCode << " " << statusText << "\r\n";
-    response << "Content-Type: " << contentType << "\r\n";
-    response << "Transfer-Encoding: chunked\r\n";
-    response << "Connection: keep-alive\r\n";
-    response << "\r\n";
-    return response.str();
-}
-
-std::string HttpUtils::buildHttpChunk(const std::string& data) {
-    std::ostringstream chunk;
-    chunk << std::hex << data.length() << "\r\n";
-    chunk << data << "\r\n";
-    return chunk.str();
+                             const std::string& body, bool keepAlive, const std::string& contentType, const std::string& extraHeaders) {
+    char length[40];
+    int length_length = std::snprintf(length, sizeof(length), "Content-Length: %zu\r\n\r\n", body.length());
+    std::string response;
+    response.reserve(96 + statusText.length() + contentType.length() + extraHeaders.length() + body.length());
+    append_response_head(response, statusCode, statusText, keepAlive, contentType);
+    response.append(extraHeaders).append(length, length_length).append(body);
+    return response;
+}
+
+std::string HttpUtils::buildHttpChunkedResponseHeader(int statusCode, const std::string& statusText, bool keepAlive, const std::string& contentType) {
+    std::string response;
+    response.reserve(112 + statusText.length() + contentType.length());
+    append_response_head(response, statusCode, statusText, keepAlive, contentType);
+    response.append("Transfer-Encoding: chunked\r\n\r\n");
+    return response;
+}
+
+// JSON string escaping of s, written to out when given. Returns the escaped length either way.
+static size_t escape_json(std::string_view s, char* out) {
+    static const char hex_digits[] = "0123456789abcdef";
+    size_t n = 0;
+    for (char c : s) {
+        const char* escaped = nullptr;
+        switch (c) {
+            case '"': escaped = "\\\""; break;
+            case '\\': escaped = "\\\\"; break;
+            case '\b': escaped = "\\b"; break;
+            case '\f': escaped = "\\f"; break;
+            case '\n': escaped = "\\n"; break;
+            case '\r': escaped = "\\r"; break;
+            case '\t': escaped = "\\t"; break;
+            default: break;
+        }
+        if (escaped) {
+            if (out) { out[n] = escaped[0]; out[n + 1] = escaped[1]; }
+            n += 2;
+        } else if ('\x00' <= c && c <= '\x1f') {
+            if (out) {
+                std::memcpy(out + n, "\\u00", 4);
+                out[n + 4] = hex_digits[(c >> 4) & 0xf];
+                out[n + 5] = hex_digits[c & 0xf];
+            }
+            n += 6;
+        } else {
+            if (out) out[n] = c;
+            n += 1;
+        }
+    }
+    return n;
 }
 
+static const std::string_view JSON_CHUNK_PREFIX = "{\"chunk\": \"";
+static const std::string_view JSON_CHUNK_MORE = "\", \"is_last\": false}";
+static const std::string_view JSON_CHUNK_LAST = "\", \"is_last\": true}";
+
 std::string HttpUtils::build_json_response_chunk(const std::string &s, bool is_last) {
-    std::ostringstream o;
-    for (auto c = s.cbegin(); c != s.cend(); c++) {
-        switch (*c) {
-            case '"': o << "\\\""; break;
-            case '\\': o << "\\\\"; break;
-            case '\b': o << "\\b"; break;
-            case '\f': o << "\\f"; break;
-            case '\n': o << "\\n"; break;
-            case '\r': o << "\\r"; break;
-            case '\t': o << "\\t"; break;
-            default:
-                if ('\x00' <= *c && *c <= '\x1f') {
-                    o << "\\u"
-                      << std::hex << std::setw(4) << std::setfill('0') << (int)*c;
-                } else {
-                    o << *c;
-                }
+    std::string_view suffix = is_last ? JSON_CHUNK_LAST : JSON_CHUNK_MORE;
+    std::string json_chunk(JSON_CHUNK_PREFIX.length() + escape_json(s, nullptr) + suffix.length(), '\0');
+    std::memcpy(&json_chunk[0], JSON_CHUNK_PREFIX.data(), JSON_CHUNK_PREFIX.length());
+    size_t n = JSON_CHUNK_PREFIX.length() + escape_json(s, &json_chunk[JSON_CHUNK_PREFIX.length()]);
+    std::memcpy(&json_chunk[n], suffix.data(), suffix.length());
+    return json_chunk;
+}
+
+std::string HttpUtils::buildJsonError(std::string_view message) {
+    static constexpr std::string_view prefix = "{\"error\": \"";
+    std::string json(prefix.length() + escape_json(message, nullptr) + 2, '\0');
+    std::memcpy(&json[0], prefix.data(), prefix.length());
+    size_t n = prefix.length() + escape_json(message, &json[prefix.length()]);
+    std::memcpy(&json[n], "\"}", 2);
+    return json;
+}
+
+// Grow out by the escaped text, written in place
+static void append_escaped(std::string& out, std::string_view s) {
+    size_t pos = out.length();
+    out.resize(pos + escape_json(s, nullptr));
+    escape_json(s, &out[pos]);
+}
+
+void HttpUtils::append_batch_result_line(std::string& out, uint32_t index, std::string_view text, int tokens, std::string_view finish_reason) {
+    char number[16];
+    out.append("{\"index\": ").append(number, std::snprintf(number, sizeof(number), "%u", index)).append(", \"text\": \"");
+    append_escaped(out, text);
+    out.append("\", \"tokens\": ").append(number, std::snprintf(number, sizeof(number), "%d", tokens));
+    out.append(", \"finish_reason\": \"").append(finish_reason).append("\"}\n");
+}
+
+void HttpUtils::append_batch_error_line(std::string& out, uint32_t index, std::string_view message) {
+    char number[16];
+    out.append("{\"index\": ").append(number, std::snprintf(number, sizeof(number), "%u", index)).append(", \"error\": \"");
+    append_escaped(out, message);
+    out.append("\"}\n");
+}
+
+bool HttpUtils::parse_batch_line_index(std::string_view line, uint32_t& index) {
+    static constexpr std::string_view prefix = "{\"index\": ";
+    if (line.substr(0, prefix.length()) != prefix) return false;
+    const char* first = line.data() + prefix.length();
+    return std::from_chars(first, line.data() + line.length(), index).ec == std::errc();
+}
+
+void HttpUtils::append_json_chunk_frame(std::string& out, std::string_view piece, bool is_last) {
+    std::string_view suffix = is_last ? JSON_CHUNK_LAST : JSON_CHUNK_MORE;
+    size_t escaped_len = escape_json(piece, nullptr);
+    size_t json_len = JSON_CHUNK_PREFIX.length() + escaped_len + suffix.length();
+
+    char size_line[20];
+    int size_len = std::snprintf(size_line, sizeof(size_line), "%zx\r\n", json_len);
+
+    size_t pos = out.length();
+    out.resize(pos + size_len + json_len + 2 + (is_last ? 5 : 0));     // grows the caller's buffer, reused across pieces
+    char* p = &out[pos];
+    std::memcpy(p, size_line, size_len); p += size_len;
+    std::memcpy(p, JSON_CHUNK_PREFIX.data(), JSON_CHUNK_PREFIX.length()); p += JSON_CHUNK_PREFIX.length();
+    p += escape_json(piece, p);
+    std::memcpy(p, suffix.data(), suffix.length()); p += suffix.length();
+    std::memcpy(p, "\r\n", 2); p += 2;
+    if (is_last) {
+        std::memcpy(p, "0\r\n\r\n", 5);
+    }
+}
+
+void HttpUtils::append_json_error_frame(std::string& out, std::string_view message) {
+    std::string json = buildJsonError(message);
+    char size_line[20];
+    int size_len = std::snprintf(size_line, sizeof(size_line), "%zx\r\n", json.length());
+    out.append(size_line, size_len).append(json).append("\r\n0\r\n\r\n");
+}
+
+ssize_t HttpUtils::writeAvailable(SOCKET socket, struct iovec*& iov, int& iov_count) {
+    ssize_t total = 0;
+    while (iov_count > 0) {
+        ssize_t written = writev(socket, iov, iov_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        total += written;
+        // Partial write, skip what went out
+        while (iov_count > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iov_count;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
         }
     }
-    std::stringstream json_chunk;
-    json_chunk << "{\"chunk\": \"" << o.str() << "\", \"is_last\": " << (is_last ? "true" : "false") << "}";
-    return json_chunk.str();
+    return total;
 }
@@ -1,23 +1,59 @@
 #ifndef HTTP_UTILS_HPP
 #define HTTP_UTILS_HPP
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <map>
+#include <vector>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
 #define closesocket close
 
+constexpr size_t MAX_STOP_STRINGS = 4;
+constexpr size_t MAX_STOP_LENGTH = 64;     // bytes
+constexpr size_t MAX_BATCH_ITEMS = 256;    // prompts in one /process_batch request
+
+enum class RequestPriority : uint8_t { High, Normal, Low };
+
+// How the next token is picked. The defaults are greedy decoding.
+struct SamplingParams {
+    float temperature = 0.0f;   // 0 = greedy
+    int top_k = 0;              // 0 = no limit
+    float top_p = 1.0f;
+    uint64_t seed = 0;          // 0 = a seed of the server's choosing
+};
+
+// Stage times of a request sampled for tracing, steady_clock ns (0 = not reached). See utils/trace.hpp.
+struct RequestTrace {
+    bool sampled = false;
+    uint64_t read_start_ns = 0;         // connection accepted or first byte of the request read
+    uint64_t received_ns = 0;           // HTTP request parsed
+    uint64_t admitted_ns = 0;           // body parsed and admitted
+    uint64_t pool_start_ns = 0;         // picked up by a dispatch pool thread
+    uint64_t prepared_ns = 0;           // prompt checked and tokenized
+};
+
 // Structs for request/response data
 struct ProcessRequest {
-    std::string message;
-    int max_tokens;
+    std::string message;                // the prompt, "message" (or "prompt") in the request body
+    int max_tokens = 0;
+    SamplingParams sampling;
+    std::vector<std::string> stop;      // generation ends once the output ends with one of these
+    RequestPriority priority = RequestPriority::Normal;
+    int deadline_ms = 0;                // generation has to start within this of arrival, 0 = no deadline
+    uint64_t deadline_ns = 0;           // the same as a steady_clock time, set once the request is admitted
+    uint64_t arrival_ns = 0;            // steady_clock time of admission, the time to first token counts from it
+    std::vector<int> prompt_tokens;     // filled by TaskDispatcher::prepare_request when the server tokenizes, empty otherwise
+    RequestTrace trace;
 };
 
 struct ProcessResponse {
@@ -25,33 +61,58 @@ struct ProcessResponse {
     int status_code;
 };
 
-struct HttpRequest {
-    std::string method;
-    std::string path;
-    std::map<std::string, std::string> headers;
-    std::string body;
-};
-
 class HttpUtils {
 public:
-    // Simple JSON parsing - extract message field
-    static bool parseJsonMessage(const std::string& jsonBody, ProcessRequest& request);
-    
-    // Read and parse HTTP request directly from socket
-    static bool readAndParseHttpRequest(SOCKET clientSocket, HttpRequest& request);
+    // "high", "normal" or "low", false for anything else
+    static bool parsePriority(std::string_view text, RequestPriority& priority);
+
+    // Fill request from a /process body: {"message": "...", "max_tokens": 32, "temperature": 0.8, "top_k": 40, "top_p": 0.95,
+    // "seed": 7, "stop": ["\n"], "priority": "high", "deadline_ms": 2000}. Only message is required, unknown fields are ignored, null keeps
+    // what request held. On false error says what is wrong and where, for the 400 response.
+    static bool parseJsonMessage(std::string_view jsonBody, ProcessRequest& request, std::string& error);
+
+    // Fill items from a /process_batch body: {"items": [{"message": "...", "max_tokens": 16}, ...]}. Each item takes the
+    // fields of a /process body, at most MAX_BATCH_ITEMS of them. Errors in an item name its position. Items without a
+    // "priority" get default_priority.
+    static bool parseBatchRequest(std::string_view jsonBody, std::vector<ProcessRequest>& items, std::string& error,
+                                  RequestPriority default_priority = RequestPriority::Normal);
+
+    // {"error": "<message>"}, escaped
+    static std::string buildJsonError(std::string_view message);
+
+    // Reason phrase of a status code
+    static const char* statusText(int statusCode);
     
-    // Build HTTP response
+    // Build HTTP response, keepAlive tells the client whether the connection stays open after it. extraHeaders are
+    // complete "Name: value\r\n" lines.
     static std::string buildHttpResponse(int statusCode, const std::string& statusText, 
-                                       const std::string& body, const std::string& contentType = "application/json");
+                                       const std::string& body, bool keepAlive = false, const std::string& contentType = "application/json",
+                                       const std::string& extraHeaders = "");
 
     // Build HTTP chunked response header
-    static std::string buildHttpChunkedResponseHeader(int statusCode, const std::string& statusText, const std::string& contentType = "application/json");
-
-    // Build an HTTP chunk
-    static std::string buildHttpChunk(const std::string& data);
+    static std::string buildHttpChunkedResponseHeader(int statusCode, const std::string& statusText, bool keepAlive = false, const std::string& contentType = "application/json");
 
     // Build JSON response chunk with proper escaping
     static std::string build_json_response_chunk(const std::string &s, bool is_last);
+
+    // Append piece as one complete HTTP chunk carrying {"chunk": "<piece>", "is_last": ...}. With is_last the terminating
+    // zero-length chunk follows, so the frames of a task form the whole chunked body. Workers write these straight into
+    // their response stream and the server forwards the bytes untouched.
+    static void append_json_chunk_frame(std::string& out, std::string_view piece, bool is_last);
+    // Append {"error": "<message>"} as one HTTP chunk followed by the terminating chunk, a task's stream ending in an error
+    static void append_json_error_frame(std::string& out, std::string_view message);
+
+    // One NDJSON line of a /process_batch response: {"index": 0, "text": "...", "tokens": 12, "finish_reason": "eos"}.
+    // finish_reason is "eos" when the model ended the text, "length" when max_tokens did.
+    static void append_batch_result_line(std::string& out, uint32_t index, std::string_view text, int tokens, std::string_view finish_reason);
+    // {"index": 0, "error": "..."} for an item that got no result
+    static void append_batch_error_line(std::string& out, uint32_t index, std::string_view message);
+    // The index a line built by the two above starts with
+    static bool parse_batch_line_index(std::string_view line, uint32_t& index);
+
+    // writev on a non-blocking socket until every byte went out or it would block. iov and iov_count are advanced past
+    // what was written, so what is left is still described by them. Returns the bytes written, -1 on a socket error (client gone).
+    static ssize_t writeAvailable(SOCKET socket, struct iovec*& iov, int& iov_count);
 };
 
 #endif // HTTP_UTILS_HPP
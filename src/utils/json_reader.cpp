@@ -0,0 +1,500 @@
+#include "json_reader.hpp"
+#include <charconv>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// Offset of the first byte at or after pos that ends the plain run of a string: '"', '\\' or a control character. size when
+// there is none.
+static size_t find_string_special(const char* data, size_t pos, size_t size) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(0x1f);
+    while (pos + 16 <= size) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash));
+        // Unsigned byte <= 0x1f exactly when max(byte, 0x1f) == 0x1f, there is no unsigned byte compare in SSE2
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(bytes, control_max), control_max));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    for (; pos < size; ++pos) {
+        unsigned char c = static_cast<unsigned char>(data[pos]);
+        if (c == '"' || c == '\\' || c < 0x20) return pos;
+    }
+    return size;
+}
+
+static bool parse_hex4(const char* p, uint32_t& value) {
+    value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        uint32_t digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return false;
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+static void append_utf8(std::string& out, uint32_t code_point) {
+    if (code_point < 0x80) {
+        out += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+        out += static_cast<char>(0xc0 | (code_point >> 6));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    } else if (code_point < 0x10000) {
+        out += static_cast<char>(0xe0 | (code_point >> 12));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (code_point >> 18));
+        out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (code_point & 0x3f));
+    }
+}
+
+static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+JsonReader::JsonReader(std::string_view input)
+    : data(input.data()), size(input.size()), pos(0), depth(0), first_bits(0), error_text(nullptr), error_pos(0) {}
+
+bool JsonReader::fail(const char* message, size_t offset) {
+    if (error_text == nullptr) {
+        error_text = message;
+        error_pos = offset;
+    }
+    return false;
+}
+
+std::string JsonReader::error() const {
+    if (error_text == nullptr) return std::string();
+    return std::string(error_text) + " at offset " + std::to_string(error_pos);
+}
+
+void JsonReader::skip_whitespace() {
+    while (pos < size) {
+        char c = data[pos];
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t') break;
+        ++pos;
+    }
+}
+
+bool JsonReader::expect(char c, const char* message) {
+    if (!ok()) return false;
+    skip_whitespace();
+    if (pos >= size || data[pos] != c) {
+        return fail(pos >= size ? "unexpected end of input" : message, pos);
+    }
+    ++pos;
+    return true;
+}
+
+bool JsonReader::open_container(char open, const char* message) {
+    if (!expect(open, message)) return false;
+    if (depth >= JSON_MAX_DEPTH) {
+        return fail("nesting too deep", pos - 1);
+    }
+    first_bits |= uint64_t(1) << depth;
+    ++depth;
+    return true;
+}
+
+bool JsonReader::next_in_container(char close, const char* message) {
+    if (!ok()) return false;
+    if (depth == 0) {
+        return fail("no open object or array", pos);
+    }
+    skip_whitespace();
+    if (pos >= size) {
+        return fail("unexpected end of input", pos);
+    }
+    const uint64_t bit = uint64_t(1) << (depth - 1);
+    const bool first = (first_bits & bit) != 0;
+    first_bits &= ~bit;
+    if (data[pos] == close) {
+        ++pos;
+        --depth;
+        return false;
+    }
+    if (!first) {
+        if (data[pos] != ',') {
+            return fail(message, pos);
+        }
+        ++pos;
+    }
+    return true;
+}
+
+bool JsonReader::begin_object() {
+    return open_container('{', "expected '{'");
+}
+
+bool JsonReader::next_member(std::string_view& key, std::string& scratch) {
+    if (!next_in_container('}', "expected ',' or '}' after an object member")) return false;
+    skip_whitespace();
+    if (pos >= size || data[pos] != '"') {
+        return fail(pos >= size ? "unexpected end of input" : "expected a member name in double quotes", pos);
+    }
+    if (!scan_string(key, &scratch)) return false;
+    return expect(':', "expected ':' after a member name");
+}
+
+bool JsonReader::begin_array() {
+    return open_container('[', "expected '['");
+}
+
+bool JsonReader::next_element() {
+    return next_in_container(']', "expected ',' or ']' after an array element");
+}
+
+JsonType JsonReader::peek() {
+    if (!ok()) return JsonType::Invalid;
+    skip_whitespace();
+    if (pos >= size) return JsonType::Invalid;
+    switch (data[pos]) {
+        case '{': return JsonType::Object;
+        case '[': return JsonType::Array;
+        case '"': return JsonType::String;
+        case 't': case 'f': return JsonType::Bool;
+        case 'n': return JsonType::Null;
+        default: return (data[pos] == '-' || is_digit(data[pos])) ? JsonType::Number : JsonType::Invalid;
+    }
+}
+
+// On the opening quote. Plain runs between escapes are found with find_string_special and copied in one piece. Without
+// scratch the string is only validated, as for skip_value.
+bool JsonReader::scan_string(std::string_view& value, std::string* scratch) {
+    const size_t quote = pos;
+    const size_t start = pos + 1;
+    size_t end = find_string_special(data, start, size);
+    if (end >= size) {
+        return fail("unterminated string", quote);
+    }
+    if (data[end] == '"') {
+        value = std::string_view(data + start, end - start);   // no escapes, the common case
+        pos = end + 1;
+        return true;
+    }
+    if (scratch) scratch->assign(data + start, end - start);
+    pos = end;
+    for (;;) {
+        if (data[pos] == '"') {
+            ++pos;
+            value = scratch ? std::string_view(*scratch) : std::string_view();
+            return true;
+        }
+        if (data[pos] != '\\') {
+            return fail("unescaped control character in string", pos);
+        }
+        if (!decode_escape(scratch)) return false;
+        size_t next = find_string_special(data, pos, size);
+        if (next >= size) {
+            return fail("unterminated string", quote);
+        }
+        if (scratch) scratch->append(data + pos, next - pos);
+        pos = next;
+    }
+}
+
+// On a backslash, appends the character it stands for to out (when given) and moves past the escape
+bool JsonReader::decode_escape(std::string* out) {
+    const size_t escape = pos;
+    if (pos + 1 >= size) {
+        return fail("unterminated string", escape);
+    }
+    char c = data[pos + 1];
+    pos += 2;
+    char plain;
+    switch (c) {
+        case '"': plain = '"'; break;
+        case '\\': plain = '\\'; break;
+        case '/': plain = '/'; break;
+        case 'b': plain = '\b'; break;
+        case 'f': plain = '\f'; break;
+        case 'n': plain = '\n'; break;
+        case 'r': plain = '\r'; break;
+        case 't': plain = '\t'; break;
+        case 'u': {
+            uint32_t code_point;
+            if (pos + 4 > size || !parse_hex4(data + pos, code_point)) {
+                return fail("invalid \\u escape, expected 4 hex digits", escape);
+            }
+            pos += 4;
+            if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+                return fail("unpaired low surrogate in \\u escape", escape);
+            }
+            if (code_point >= 0xd800 && code_point <= 0xdbff) {
+                // Characters beyond the BMP come as a surrogate pair, U+1F600 is d83d followed by de00
+                uint32_t low;
+                if (pos + 6 > size || data[pos] != '\\' || data[pos + 1] != 'u' || !parse_hex4(data + pos + 2, low) ||
+                    low < 0xdc00 || low > 0xdfff) {
+                    return fail("unpaired high surrogate in \\u escape", escape);
+                }
+                pos += 6;
+                code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+            }
+            if (out) append_utf8(*out, code_point);
+            return true;
+        }
+        default:
+            return fail("invalid escape sequence", escape);
+    }
+    if (out) *out += plain;
+    return true;
+}
+
+bool JsonReader::read_string(std::string_view& value, std::string& scratch) {
+    if (!ok()) return false;
+    skip_whitespace();
+    if (pos >= size || data[pos] != '"') {
+        return fail(pos >= size ? "unexpected end of input" : "expected a string", pos);
+    }
+    return scan_string(value, &scratch);
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+bool JsonReader::scan_number(size_t& start, size_t& length, bool& integral) {
+    if (!ok()) return false;
+    skip_whitespace();
+    start = pos;
+    if (pos < size && data[pos] == '-') ++pos;
+    if (pos >= size || !is_digit(data[pos])) {
+        return fail(pos == start ? (pos >= size ? "unexpected end of input" : "expected a number") : "invalid number", start);
+    }
+    if (data[pos] == '0') {
+        ++pos;
+    } else {
+        while (pos < size && is_digit(data[pos])) ++pos;
+    }
+    integral = true;
+    if (pos < size && data[pos] == '.') {
+        ++pos;
+        if (pos >= size || !is_digit(data[pos])) {
+            return fail("invalid number, expected a digit after '.'", start);
+        }
+        while (pos < size && is_digit(data[pos])) ++pos;
+        integral = false;
+    }
+    if (pos < size && (data[pos] == 'e' || data[pos] == 'E')) {
+        ++pos;
+        if (pos < size && (data[pos] == '+' || data[pos] == '-')) ++pos;
+        if (pos >= size || !is_digit(data[pos])) {
+            return fail("invalid number, expected a digit in the exponent", start);
+        }
+        while (pos < size && is_digit(data[pos])) ++pos;
+        integral = false;
+    }
+    length = pos - start;
+    return true;
+}
+
+bool JsonReader::read_int(int64_t& value) {
+    size_t start, length;
+    bool integral;
+    if (!scan_number(start, length, integral)) return false;
+    if (!integral) {
+        return fail("expected an integer", start);
+    }
+    auto result = std::from_chars(data + start, data + start + length, value);
+    if (result.ec != std::errc()) {
+        return fail("integer out of range", start);
+    }
+    return true;
+}
+
+bool JsonReader::read_double(double& value) {
+    size_t start, length;
+    bool integral;
+    if (!scan_number(start, length, integral)) return false;
+    auto result = std::from_chars(data + start, data + start + length, value);
+    if (result.ec != std::errc()) {
+        return fail("number out of range", start);
+    }
+    return true;
+}
+
+bool JsonReader::read_bool(bool& value) {
+    if (!ok()) return false;
+    skip_whitespace();
+    if (size - pos >= 4 && std::memcmp(data + pos, "true", 4) == 0) {
+        value = true;
+        pos += 4;
+        return true;
+    }
+    if (size - pos >= 5 && std::memcmp(data + pos, "false", 5) == 0) {
+        value = false;
+        pos += 5;
+        return true;
+    }
+    return fail("expected true or false", pos);
+}
+
+bool JsonReader::skip_value() {
+    std::string_view ignored;
+    size_t start, length;
+    bool integral, flag;
+    switch (peek()) {
+        case JsonType::Object:
+        case JsonType::Array:
+            return skip_container();
+        case JsonType::String:
+            return scan_string(ignored, nullptr);
+        case JsonType::Number:
+            return scan_number(start, length, integral);
+        case JsonType::Bool:
+            return read_bool(flag);
+        case JsonType::Null:
+            if (size - pos >= 4 && std::memcmp(data + pos, "null", 4) == 0) {
+                pos += 4;
+                return true;
+            }
+            return fail("invalid literal", pos);
+        case JsonType::Invalid:
+        default:
+            if (!ok()) return false;
+            return fail(pos >= size ? "unexpected end of input" : "expected a value", pos);
+    }
+}
+
+// Walks the nested containers in a loop rather than by recursion, so a hostile document cannot run the stack out
+bool JsonReader::skip_container() {
+    const int base = depth;
+    uint64_t object_bits = 0;       // bit d: the container at depth d is an object
+    std::string_view ignored;
+    for (;;) {
+        // On the opening bracket of a container (peek left the reader there)
+        const bool object = data[pos] == '{';
+        if (!open_container(data[pos], "expected a value")) return false;
+        if (object) object_bits |= uint64_t(1) << (depth - 1);
+        else object_bits &= ~(uint64_t(1) << (depth - 1));
+
+        // Members or elements until one opens a container, closing the containers that end on the way
+        for (;;) {
+            if (depth == base) return true;
+            const bool in_object = (object_bits >> (depth - 1)) & 1;
+            bool more = in_object ? next_in_container('}', "expected ',' or '}' after an object member")
+                                  : next_in_container(']', "expected ',' or ']' after an array element");
+            if (!more) {
+                if (!ok()) return false;
+                continue;
+            }
+            if (in_object) {
+                skip_whitespace();
+                if (pos >= size || data[pos] != '"') {
+                    return fail(pos >= size ? "unexpected end of input" : "expected a member name in double quotes", pos);
+                }
+                if (!scan_string(ignored, nullptr) || !expect(':', "expected ':' after a member name")) return false;
+            }
+            JsonType type = peek();
+            if (type == JsonType::Object || type == JsonType::Array) break;
+            if (!skip_value()) return false;
+        }
+    }
+}
+
+bool JsonReader::at_end() {
+    if (!ok()) return false;
+    skip_whitespace();
+    if (pos != size) {
+        return fail("unexpected characters after the JSON value", pos);
+    }
+    return true;
+}
+
+#ifdef JSON_READER_BENCHMARK
+// Compares HttpUtils::parseJsonMessage on the reader with the find-based parse the server used before, which read only
+// message and max_tokens and cut the message at the first quote, escaped or not.
+#include "http_utils.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+static bool legacy_parse(std::string_view jsonBody, ProcessRequest& request) {
+    size_t maxTokensPos = jsonBody.find("\"max_tokens\"");
+    size_t colonPos = jsonBody.find(":", maxTokensPos);
+    try {
+        request.max_tokens = std::stoi(std::string(jsonBody.substr(colonPos + 1)));
+    } catch (const std::exception&) {
+        request.max_tokens = 0;
+    }
+    size_t messagePos = jsonBody.find("\"message\"");
+    if (messagePos == std::string_view::npos) return false;
+    colonPos = jsonBody.find(":", messagePos);
+    if (colonPos == std::string_view::npos) return false;
+    size_t quoteStart = jsonBody.find("\"", colonPos);
+    if (quoteStart == std::string_view::npos) return false;
+    size_t quoteEnd = jsonBody.find("\"", quoteStart + 1);
+    if (quoteEnd == std::string_view::npos) return false;
+    request.message = jsonBody.substr(quoteStart + 1, quoteEnd - quoteStart - 1);
+    return true;
+}
+
+// ns per body, message bytes of the last parse in message_length
+template <typename Parse>
+static double bench(const std::string& body, int iterations, size_t& message_length, Parse parse) {
+    ProcessRequest request;     // reused like the server's would be, so the message buffer is not reallocated
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        if (parse(body, request)) checksum += request.message.size() + request.max_tokens;
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (checksum == 0) std::cerr << "parse failed" << std::endl;
+    message_length = request.message.size();
+    return elapsed / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    std::string small_body = "{\"message\": \"Once upon a time there was a little dog\", \"max_tokens\": 32}";
+    std::string full_body = "{\"message\": \"Once upon a time there was a little dog\", \"max_tokens\": 32, \"temperature\": 0.8, "
+                            "\"top_k\": 40, \"top_p\": 0.95, \"seed\": 1234, \"stop\": [\"\\n\\n\", \"The end\"], \"priority\": \"high\", "
+                            "\"metadata\": {\"user\": \"u-1234\", \"tags\": [\"story\", \"kids\"], \"trace\": null}}";
+    std::string story;
+    while (story.size() < 4096) story += "She said \\\"hello\\\" to the dog.\\nThe dog wagged its tail and ran off. ";
+    std::string escaped_body = "{\"max_tokens\": 32, \"message\": \"" + story + "\"}";
+    std::string plain;
+    while (plain.size() < 64 * 1024) plain += "Once upon a time there was a little dog who liked to run in the park. ";
+    std::string plain_body = "{\"max_tokens\": 32, \"message\": \"" + plain + "\"}";
+
+    std::cout << std::fixed << std::setprecision(0) << iterations << " bodies per case (large ones /64)" << std::endl;
+    struct Case { const char* name; const std::string* body; int iterations; };
+    Case cases[] = {
+        {"message and max_tokens", &small_body, iterations},
+        {"all fields and unknown nested", &full_body, iterations},
+        {"4 KB prompt with escapes", &escaped_body, iterations / 64},
+        {"64 KB plain prompt", &plain_body, iterations / 64},
+    };
+    for (const Case& c : cases) {
+        size_t reader_length = 0, legacy_length = 0;
+        std::string error;
+        double reader_ns = bench(*c.body, c.iterations, reader_length, [&error](const std::string& body, ProcessRequest& request) {
+            return HttpUtils::parseJsonMessage(body, request, error);
+        });
+        double legacy_ns = bench(*c.body, c.iterations, legacy_length, [](const std::string& body, ProcessRequest& request) {
+            return legacy_parse(body, request);
+        });
+        std::cout << std::left << std::setw(32) << c.name << std::right << " reader " << std::setw(6) << reader_ns << " ns ("
+                  << std::setw(5) << c.body->size() * 1000.0 / reader_ns << " MB/s), legacy " << std::setw(6) << legacy_ns << " ns";
+        if (legacy_length != reader_length) {
+            std::cout << ", legacy message " << legacy_length << " of " << reader_length << " bytes";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+constexpr int JSON_MAX_DEPTH = 64;      // nesting of skipped values, deeper documents are rejected
+
+enum class JsonType { Object, Array, String, Number, Bool, Null, Invalid };
+
+// Pull reader over a JSON document held in memory. The caller walks the structure it expects (begin_object/next_member,
+// begin_array/next_element, the read_* calls) and skips what it does not know with skip_value. Nothing is allocated:
+// strings without escapes come back as views into the input, escaped ones are decoded into a scratch string the caller
+// keeps around. String scanning looks at 16 bytes at a time with SSE2 where available.
+//
+// The first syntax or type error sticks: every later call returns false, error_message and error_offset say what and
+// where. A reader is used for one document.
+class JsonReader {
+public:
+    explicit JsonReader(std::string_view input);
+
+    // '{' of an object. Then next_member until it returns false: at the closing '}' (ok() stays true) or on an error.
+    bool begin_object();
+    // Key of the next member, the reader is left on its value, which has to be read or skipped before the next call.
+    // key may point into scratch, valid until scratch is used again.
+    bool next_member(std::string_view& key, std::string& scratch);
+    // '[' of an array. Then next_element until it returns false, at the closing ']' or on an error.
+    bool begin_array();
+    bool next_element();
+
+    // Type of the value the reader is on, Invalid at the end of the input or on a character no value starts with
+    JsonType peek();
+    // value points into the input, or into scratch when the string has escapes (decoded to UTF-8)
+    bool read_string(std::string_view& value, std::string& scratch);
+    // A number without fraction or exponent that fits an int64_t
+    bool read_int(int64_t& value);
+    bool read_double(double& value);
+    bool read_bool(bool& value);
+    bool skip_value();
+
+    // Only whitespace left, call once the top-level value is read
+    bool at_end();
+
+    bool ok() const { return error_text == nullptr; }
+    const char* error_message() const { return error_text; }
+    size_t error_offset() const { return error_pos; }
+    // "<message> at offset <n>", for error responses
+    std::string error() const;
+    // Record a type or range error found by the caller on the value that starts at offset. Keeps an earlier error.
+    bool fail(const char* message, size_t offset);
+    size_t offset() const { return pos; }
+
+private:
+    const char* data;
+    size_t size;
+    size_t pos;
+    int depth;                  // containers opened by begin_object/begin_array and not closed yet
+    uint64_t first_bits;        // bit d: the container at depth d has not produced a member/element yet
+    const char* error_text;
+    size_t error_pos;
+
+    void skip_whitespace();
+    bool expect(char c, const char* message);
+    bool open_container(char open, const char* message);
+    // ',' before anything but the first member, false at close (consumed)
+    bool next_in_container(char close, const char* message);
+    // Scan a number, start and length of its text
+    bool scan_number(size_t& start, size_t& length, bool& integral);
+    bool scan_string(std::string_view& value, std::string* scratch);
+    bool decode_escape(std::string* out);
+    bool skip_container();
+};
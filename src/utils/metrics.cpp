@@ -0,0 +1,93 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <cstdio>
+
+
+// Index of the bucket value falls in: the first bound it does not exceed, or the +Inf bucket
+static size_t bucket_index(const uint64_t* bounds, uint64_t value) {
+    return std::lower_bound(bounds, bounds + HISTOGRAM_BUCKETS - 1, value) - bounds;
+}
+
+void HistogramCounters::reset() {
+    for (auto& bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+}
+
+void HistogramCounters::record_single_writer(const uint64_t* bounds, uint64_t value) {
+    std::atomic<uint64_t>& bucket = buckets[bucket_index(bounds, value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void HistogramCounters::record(const uint64_t* bounds, uint64_t value) {
+    buckets[bucket_index(bounds, value)].fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void HistogramCounters::add_to(uint64_t out_buckets[HISTOGRAM_BUCKETS], uint64_t& out_sum) const {
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) out_buckets[i] += buckets[i].load(std::memory_order_relaxed);
+    out_sum += sum.load(std::memory_order_relaxed);
+}
+
+
+Histogram::Histogram(const uint64_t* bounds) : bucket_bounds(bounds) {
+    for (Shard& shard : shards) shard.counters.reset();
+}
+
+void Histogram::record(uint64_t value) {
+    static std::atomic<size_t> next_shard{0};
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+    shards[shard].counters.record(bucket_bounds, value);
+}
+
+void Histogram::snapshot(uint64_t out_buckets[HISTOGRAM_BUCKETS], uint64_t& out_sum) const {
+    std::fill(out_buckets, out_buckets + HISTOGRAM_BUCKETS, 0);
+    out_sum = 0;
+    for (const Shard& shard : shards) shard.counters.add_to(out_buckets, out_sum);
+}
+
+
+namespace Metrics {
+
+void append_family(std::string& out, std::string_view name, std::string_view type, std::string_view help) {
+    out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+    out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+}
+
+static void append_value(std::string& out, double value) {
+    char text[32];
+    int length = std::snprintf(text, sizeof(text), "%.9g", value);
+    out.append(text, length);
+}
+
+void append_sample(std::string& out, std::string_view name, std::string_view labels, double value) {
+    out.append(name);
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    out.append(" ");
+    append_value(out, value);
+    out.append("\n");
+}
+
+void append_histogram(std::string& out, std::string_view name, std::string_view labels, const uint64_t* bounds,
+                      const uint64_t buckets[HISTOGRAM_BUCKETS], uint64_t sum, double scale) {
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        cumulative += buckets[i];
+        out.append(name).append("_bucket{");
+        if (!labels.empty()) out.append(labels).append(",");
+        out.append("le=\"");
+        if (i + 1 < HISTOGRAM_BUCKETS) append_value(out, static_cast<double>(bounds[i]) / scale);
+        else out.append("+Inf");
+        out.append("\"} ").append(std::to_string(cumulative)).append("\n");
+    }
+    out.append(name).append("_sum");
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    out.append(" ");
+    append_value(out, static_cast<double>(sum) / scale);
+    out.append("\n");
+    out.append(name).append("_count");
+    if (!labels.empty()) out.append("{").append(labels).append("}");
+    out.append(" ").append(std::to_string(cumulative)).append("\n");
+}
+
+}
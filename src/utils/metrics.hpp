@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Histograms for the /metrics endpoint (Prometheus text format). Every histogram has HISTOGRAM_BUCKETS buckets, the
+// upper bounds of all but the last one come from one of the bound tables below, the last one is +Inf.
+constexpr size_t HISTOGRAM_BUCKETS = 16;
+
+// Microseconds, from 100 us to 10 s
+constexpr uint64_t LATENCY_BOUNDS_US[HISTOGRAM_BUCKETS - 1] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+                                                               250000, 500000, 1000000, 2500000, 10000000};
+// Tokens of one request, at most 50 are generated
+constexpr uint64_t TOKEN_COUNT_BOUNDS[HISTOGRAM_BUCKETS - 1] = {0, 1, 2, 4, 8, 12, 16, 20, 25, 30, 35, 40, 45, 49, 50};
+
+// Bucket counts and the sum of the recorded values. Plain memory with atomics, so it can sit in shared memory (zeroed).
+struct HistogramCounters {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];   // not cumulative, the exposition adds them up
+    std::atomic<uint64_t> sum;
+
+    void reset();
+    // For a histogram with a single writer (a worker's own): relaxed load and store, no read-modify-write
+    void record_single_writer(const uint64_t* bounds, uint64_t value);
+    // For a histogram with several writers
+    void record(const uint64_t* bounds, uint64_t value);
+    // Add the counts to out, which may be another snapshot in progress
+    void add_to(uint64_t out_buckets[HISTOGRAM_BUCKETS], uint64_t& out_sum) const;
+};
+
+// Histogram recorded from many threads. Each thread adds to its own shard of counters (threads beyond SHARDS share),
+// so a record is two uncontended relaxed adds on a cache line no other thread writes. A scrape sums the shards.
+class Histogram {
+public:
+    static constexpr size_t SHARDS = 16;
+
+    explicit Histogram(const uint64_t* bounds);
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t value);
+    void snapshot(uint64_t out_buckets[HISTOGRAM_BUCKETS], uint64_t& out_sum) const;
+    const uint64_t* bounds() const { return bucket_bounds; }
+
+private:
+    struct alignas(64) Shard {
+        HistogramCounters counters;
+    };
+    const uint64_t* bucket_bounds;
+    Shard shards[SHARDS];
+};
+
+// Prometheus text exposition. labels is the inside of the braces ("worker=\"0\""), empty for none.
+namespace Metrics {
+    // "# HELP" and "# TYPE" lines of a metric family, once before its samples
+    void append_family(std::string& out, std::string_view name, std::string_view type, std::string_view help);
+    void append_sample(std::string& out, std::string_view name, std::string_view labels, double value);
+    // _bucket (cumulative, with le), _sum and _count samples. Bounds and sum are divided by scale, 1e6 for
+    // LATENCY_BOUNDS_US histograms reported in seconds.
+    void append_histogram(std::string& out, std::string_view name, std::string_view labels, const uint64_t* bounds,
+                          const uint64_t buckets[HISTOGRAM_BUCKETS], uint64_t sum, double scale);
+}
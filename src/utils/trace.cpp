@@ -0,0 +1,150 @@
+#include "trace.hpp"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+
+
+static constexpr const char* EVENT_NAMES[] = {"http_read", "parse", "pool_wait", "prepare", "scheduler_wait", "enqueue", "wakeup",
+                                              "prefill", "decode", "socket_write", "request"};
+// Name of the event's arg in the trace, nullptr when it has none
+static constexpr const char* EVENT_ARGS[] = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                                             "sequence_length", "batch", "bytes", "completed"};
+static_assert(sizeof(EVENT_NAMES) / sizeof(EVENT_NAMES[0]) == static_cast<size_t>(TraceEvent::Count), "one name per trace event");
+static_assert(sizeof(EVENT_ARGS) / sizeof(EVENT_ARGS[0]) == static_cast<size_t>(TraceEvent::Count), "one arg name per trace event");
+
+void TraceRing::reset() {
+    written.store(0, std::memory_order_relaxed);
+    for (TraceRecord& record : records) record.seq.store(0, std::memory_order_relaxed);
+}
+
+void TraceRing::record(TraceEvent event, uint64_t task_id, uint64_t start_ns, uint64_t end_ns, uint32_t arg) {
+    uint64_t position = written.load(std::memory_order_relaxed);
+    TraceRecord& record = records[position % TRACE_RING_RECORDS];
+    record.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.task_id.store(task_id, std::memory_order_relaxed);
+    record.start_ns.store(start_ns, std::memory_order_relaxed);
+    record.duration_ns.store(end_ns > start_ns ? end_ns - start_ns : 0, std::memory_order_relaxed);
+    record.event.store(static_cast<uint32_t>(event), std::memory_order_relaxed);
+    record.arg.store(arg, std::memory_order_relaxed);
+    record.seq.store(position + 1, std::memory_order_release);
+    written.store(position + 1, std::memory_order_release);
+}
+
+void TraceRing::snapshot(std::vector<TraceSpan>& out) const {
+    uint64_t end = written.load(std::memory_order_acquire);
+    uint64_t begin = end > TRACE_RING_RECORDS ? end - TRACE_RING_RECORDS : 0;
+    for (uint64_t position = begin; position < end; ++position) {
+        const TraceRecord& record = records[position % TRACE_RING_RECORDS];
+        if (record.seq.load(std::memory_order_acquire) != position + 1) continue;
+        TraceSpan span{record.task_id.load(std::memory_order_relaxed), record.start_ns.load(std::memory_order_relaxed),
+                       record.duration_ns.load(std::memory_order_relaxed), static_cast<TraceEvent>(record.event.load(std::memory_order_relaxed)),
+                       record.arg.load(std::memory_order_relaxed)};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (record.seq.load(std::memory_order_relaxed) != position + 1) continue;     // overwritten while copied
+        if (span.event >= TraceEvent::Count) continue;
+        out.push_back(span);
+    }
+}
+
+
+namespace Trace {
+
+static std::atomic<uint32_t> sample_rate{0};
+
+// Rings of the server threads, allocated on a thread's first span and kept for the life of the process
+static std::mutex rings_mutex;
+static std::vector<std::unique_ptr<TraceRing>> rings;
+
+void set_sample_rate(uint32_t rate) {
+    sample_rate.store(rate, std::memory_order_relaxed);
+}
+
+bool sample() {
+    uint32_t rate = sample_rate.load(std::memory_order_relaxed);
+    if (rate == 0) return false;
+    thread_local uint32_t count = 0;
+    if (++count < rate) return false;
+    count = 0;
+    return true;
+}
+
+uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void record(TraceEvent event, uint64_t task_id, uint64_t start_ns, uint64_t end_ns, uint32_t arg) {
+    thread_local TraceRing* ring = nullptr;
+    if (!ring) {
+        auto owned = std::make_unique<TraceRing>();
+        owned->reset();
+        ring = owned.get();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.push_back(std::move(owned));
+    }
+    ring->record(event, task_id, start_ns, end_ns, arg);
+}
+
+void snapshot_threads(std::vector<TraceSpan>& out) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (const auto& ring : rings) ring->snapshot(out);
+}
+
+static void append_event(std::string& out, const TraceSpan& span, uint32_t pid, uint64_t tid) {
+    char text[320];
+    size_t event = static_cast<size_t>(span.event);
+    int length = std::snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%llu,\"args\":{\"task_id\":%llu",
+                               EVENT_NAMES[event], static_cast<double>(span.start_ns) / 1000.0, static_cast<double>(span.duration_ns) / 1000.0, pid,
+                               static_cast<unsigned long long>(tid), static_cast<unsigned long long>(span.task_id));
+    out.append(text, length);
+    if (EVENT_ARGS[event]) {
+        length = std::snprintf(text, sizeof(text), ",\"%s\":%u", EVENT_ARGS[event], span.arg);
+        out.append(text, length);
+    }
+    out.append("}}");
+}
+
+static void append_name(std::string& out, const char* kind, uint32_t pid, uint64_t tid, const std::string& name) {
+    char text[160];
+    int length = std::snprintf(text, sizeof(text), ",\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%llu,\"args\":{\"name\":\"%s\"}}", kind, pid,
+                               static_cast<unsigned long long>(tid), name.c_str());
+    out.append(text, length);
+}
+
+void append_chrome_json(std::string& out, uint32_t server_pid, const std::vector<TraceSpan>& server_spans,
+                        const std::vector<std::vector<TraceSpan>>& worker_spans, const std::vector<uint32_t>& worker_pids) {
+    // Small made-up pids keep the processes in order: 1 is the server, 2 + i worker i. The real pids are in the names.
+    const uint32_t SERVER = 1;
+    out.append("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    out.append("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"server (pid ")
+       .append(std::to_string(server_pid)).append(")\"}}");
+
+    std::set<uint64_t> tasks;
+    for (const TraceSpan& span : server_spans) {
+        append_event(out, span, SERVER, span.task_id);
+        tasks.insert(span.task_id);
+    }
+    for (size_t i = 0; i < worker_spans.size(); ++i) {
+        uint32_t pid = SERVER + 1 + static_cast<uint32_t>(i);
+        if (!worker_spans[i].empty()) {
+            uint32_t real_pid = i < worker_pids.size() ? worker_pids[i] : 0;
+            append_name(out, "process_name", pid, 0, "worker " + std::to_string(i) + (real_pid ? " (pid " + std::to_string(real_pid) + ")" : ""));
+            append_name(out, "thread_name", pid, 1, "worker " + std::to_string(i));
+        }
+        for (const TraceSpan& span : worker_spans[i]) {
+            // Waiting for the worker is part of the task's timeline, the worker may be busy with another task meanwhile
+            if (span.event == TraceEvent::Wakeup) {
+                append_event(out, span, SERVER, span.task_id);
+                tasks.insert(span.task_id);
+            } else {
+                append_event(out, span, pid, 1);
+            }
+        }
+    }
+    for (uint64_t task_id : tasks) append_name(out, "thread_name", SERVER, task_id, "task " + std::to_string(task_id));
+    out.append("\n]}\n");
+}
+
+}
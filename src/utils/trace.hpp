@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Request tracing. A sampled request (one in TRACE_SAMPLE_RATE, or any with "X-Trace: 1") records a span per stage, from
+// the first byte on its connection to the last write of its response, on the server and on the worker that runs it. The
+// spans carry the task_id and sit in single-writer rings, one per server thread and one per worker in shared memory, that
+// keep the latest TRACE_RING_RECORDS each. GET /trace dumps them as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+// Timestamps are steady_clock, which is CLOCK_MONOTONIC and so the same in every process.
+
+enum class TraceEvent : uint32_t {
+    HttpRead,       // accept (first request of a connection) or first byte, to the parsed HTTP request
+    Parse,          // JSON body and admission control, on the event loop
+    PoolWait,       // waiting for a dispatch pool thread
+    Prepare,        // prompt checks and server side tokenization
+    SchedulerWait,  // waiting in the RequestScheduler for a worker
+    Enqueue,        // picking a worker and copying into its ring, including waits for ring or arena space
+    Wakeup,         // from the enqueue to a worker claiming the task
+    Prefill,        // worker: claim to the first token, arg = sequence length
+    Decode,         // worker: one decode step, arg = sequences in the step
+    SocketWrite,    // server: one write of response bytes to the client, arg = bytes from the worker
+    Request,        // server: the whole request, arg = 1 when the response completed
+    Count
+};
+
+constexpr size_t TRACE_RING_RECORDS = 4096;
+
+// One span. seq makes it readable while the writer may be overwriting it: position + 1 once complete, 0 meanwhile.
+struct TraceRecord {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> task_id;
+    std::atomic<uint64_t> start_ns;
+    std::atomic<uint64_t> duration_ns;
+    std::atomic<uint32_t> event;        // TraceEvent
+    std::atomic<uint32_t> arg;
+};
+
+// A span copied out of a ring
+struct TraceSpan {
+    uint64_t task_id;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    TraceEvent event;
+    uint32_t arg;
+};
+
+// The latest spans of one writer. Plain atomics, so it can sit in shared memory (zeroed). Recording is a handful of
+// relaxed stores on the writer's own lines, reading never blocks it: records overwritten while copied are skipped.
+struct TraceRing {
+    std::atomic<uint64_t> written;      // spans recorded so far, the next one goes to written % TRACE_RING_RECORDS
+    TraceRecord records[TRACE_RING_RECORDS];
+
+    void reset();
+    void record(TraceEvent event, uint64_t task_id, uint64_t start_ns, uint64_t end_ns, uint32_t arg = 0);
+    // Append the spans still in the ring, oldest first
+    void snapshot(std::vector<TraceSpan>& out) const;
+};
+
+namespace Trace {
+    // 1 in sample_rate requests is traced, 0 traces only the ones asking for it
+    void set_sample_rate(uint32_t sample_rate);
+    // Whether the next request is traced. Counts per thread, so the event loops never share a line for it.
+    bool sample();
+    uint64_t now_ns();
+    // Record a span in the calling thread's ring, registered on its first span
+    void record(TraceEvent event, uint64_t task_id, uint64_t start_ns, uint64_t end_ns, uint32_t arg = 0);
+    // The spans of every server thread
+    void snapshot_threads(std::vector<TraceSpan>& out);
+
+    // Chrome trace JSON of the server spans and of each worker's (worker_pids[i] labels worker i, 0 when offline). Server
+    // spans and the worker's Wakeup are laid out on a track per task, the workers' prefill and decode on one track each.
+    void append_chrome_json(std::string& out, uint32_t server_pid, const std::vector<TraceSpan>& server_spans,
+                            const std::vector<std::vector<TraceSpan>>& worker_spans, const std::vector<uint32_t>& worker_pids);
+}
@@ -1,8 +1,18 @@
 #include "../ipc/ipc_utils.hpp"
 #include "../llm/tiny_llm_inference.hpp"
+#include "../llm/simple_tokenizer.hpp"
+#include "../utils/http_utils.hpp"
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 #include <signal.h>
 
 
@@ -24,72 +34,373 @@ void signal_handler(int signal) {
     keep_running = false;
 }
 
+static uint64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Resident set size of this process, 0 when /proc cannot be read
+static uint64_t resident_bytes() {
+    FILE* file = std::fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+    unsigned long pages = 0, resident = 0;
+    int fields = std::fscanf(file, "%lu %lu", &pages, &resident);
+    std::fclose(file);
+    return fields == 2 ? static_cast<uint64_t>(resident) * static_cast<uint64_t>(sysconf(_SC_PAGESIZE)) : 0;
+}
+
+static constexpr uint64_t RSS_SAMPLE_NS = 1000ull * 1000 * 1000;     // /proc is read at most once per this
+static uint64_t rss_sampled_ns = 0;
+
+static void sample_rss(WorkerTelemetry& telemetry, uint64_t now_ns) {
+    if (rss_sampled_ns != 0 && now_ns - rss_sampled_ns < RSS_SAMPLE_NS) return;
+    rss_sampled_ns = now_ns;
+    telemetry.rss_bytes.store(resident_bytes(), std::memory_order_relaxed);
+}
+
+// Times the decode steps of one task into the worker's histograms (WorkerMetrics) and keeps its live state (WorkerTelemetry)
+// up to date, every step is a heartbeat. The task counts as running from construction to destruction.
+struct StepTimer {
+    WorkerMetrics& metrics;
+    WorkerTelemetry& telemetry;
+    TraceRing* trace;           // the worker's trace ring when the task is traced
+    uint64_t task_id;
+    uint64_t arrival_ns;        // 0 when the time to first token is not recorded
+    bool per_request;           // the task is one request, its token count is recorded at the end
+    uint64_t last_ns;           // dequeue, then the end of the last step
+    int steps = 0;
+    int tokens = 0;
+
+    StepTimer(IPCManager& ipc_manager, int worker_index, const RequestView& request, bool per_request)
+        : metrics(ipc_manager.worker_metrics(worker_index)), telemetry(ipc_manager.worker_telemetry(worker_index)),
+          trace(request.traced ? &ipc_manager.worker_trace(worker_index) : nullptr), task_id(request.task_id),
+          arrival_ns(per_request ? request.arrival_ns : 0), per_request(per_request), last_ns(steady_now_ns()) {
+        if (trace && request.enqueued_ns) trace->record(TraceEvent::Wakeup, task_id, request.enqueued_ns, last_ns);
+        telemetry.task_id.store(request.task_id, std::memory_order_relaxed);
+        telemetry.task_queue.store(request.queue_idx, std::memory_order_relaxed);
+        telemetry.task_ring_pos.store(request.ring_pos, std::memory_order_relaxed);
+        telemetry.sequence_length.store(0, std::memory_order_relaxed);
+        telemetry.batch_size.store(0, std::memory_order_relaxed);
+        telemetry.heartbeat_ns.store(last_ns, std::memory_order_relaxed);
+        telemetry.state.store(static_cast<uint32_t>(WorkerState::Prefill), std::memory_order_release);
+    }
+    ~StepTimer() {
+        if (per_request) metrics.tokens_generated.record_single_writer(TOKEN_COUNT_BOUNDS, static_cast<uint64_t>(tokens));
+        uint64_t now_ns = steady_now_ns();
+        sample_rss(telemetry, now_ns);
+        telemetry.tasks_done.store(telemetry.tasks_done.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        telemetry.task_id.store(0, std::memory_order_relaxed);
+        telemetry.batch_size.store(0, std::memory_order_relaxed);
+        telemetry.heartbeat_ns.store(now_ns, std::memory_order_relaxed);
+        telemetry.state.store(static_cast<uint32_t>(WorkerState::Idle), std::memory_order_release);
+    }
+
+    // A decode step finished, is_token unless it only produced the end of sequence. sequence_length is the context of the
+    // (longest) sequence, batch_size the sequences in the forward pass.
+    void step(bool is_token, size_t sequence_length, size_t batch_size = 1) {
+        uint64_t now_ns = steady_now_ns();
+        uint64_t step_ns = now_ns - last_ns;
+        if (trace) {
+            trace->record(steps == 0 ? TraceEvent::Prefill : TraceEvent::Decode, task_id, last_ns, now_ns,
+                          static_cast<uint32_t>(steps == 0 ? sequence_length : batch_size));
+        }
+        if (steps++ == 0) {
+            metrics.prefill.record_single_writer(LATENCY_BOUNDS_US, step_ns / 1000);
+            if (arrival_ns != 0 && now_ns > arrival_ns) metrics.time_to_first_token.record_single_writer(LATENCY_BOUNDS_US, (now_ns - arrival_ns) / 1000);
+        } else {
+            metrics.inter_token.record_single_writer(LATENCY_BOUNDS_US, step_ns / 1000);
+            uint64_t average = telemetry.step_ns_avg.load(std::memory_order_relaxed);
+            telemetry.step_ns_avg.store(average ? average - average / 8 + step_ns / 8 : step_ns, std::memory_order_relaxed);
+        }
+        last_ns = now_ns;
+        if (is_token) ++tokens;
+
+        sample_rss(telemetry, now_ns);
+        telemetry.sequence_length.store(static_cast<uint16_t>(std::min<size_t>(sequence_length, UINT16_MAX)), std::memory_order_relaxed);
+        telemetry.batch_size.store(static_cast<uint16_t>(std::min<size_t>(batch_size, UINT16_MAX)), std::memory_order_relaxed);
+        telemetry.heartbeat_ns.store(now_ns, std::memory_order_relaxed);
+        if (steps == 1) telemetry.state.store(static_cast<uint32_t>(WorkerState::Decode), std::memory_order_release);
+    }
+};
+
+// Send a piece of the response as the framed HTTP chunk the server forwards to the client untouched.
+// The frame buffer is reused, so framing allocates nothing per token once it has grown.
+static bool send_response_piece(IPCManager& ipc_manager, uint32_t slot_idx, const RequestView& request, std::string_view piece, bool is_last) {
+    static std::string frame;
+    frame.clear();
+    HttpUtils::append_json_chunk_frame(frame, piece, is_last);
+    return ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, frame, is_last);
+}
 
 
-void llm_process_and_send_chunked_response(IPCManager& ipc_manager, int worker_index, ReqSlot& request, TinyLLM& llm){
-    std::string payload(request.data, request.len);
+
+// Load a PayloadKind::Text request ("max_tokens\x01prompt"), tokenizing the prompt here. The prompt is echoed back as the first chunk.
+bool load_text_request(IPCManager& ipc_manager, int worker_index, uint32_t slot_idx, const RequestView& request, TinyLLM& llm, int& max_tokens) {
+    std::string_view payload = request.payload;
     size_t separator_pos = payload.find('\x01');
-    if (separator_pos == std::string::npos) {
+    if (separator_pos == std::string_view::npos) {
         DEBUG_CERR("Worker " << worker_index << " could not find separator in payload for task " << request.task_id << std::endl);
-        ipc_manager.signal_request_handled(worker_index);
-        return;
+        return false;
     }
 
-    int max_tokens;
-    std::string current_input;
-    try {
-        max_tokens = std::stoi(payload.substr(0, separator_pos));
-        current_input = payload.substr(separator_pos + 1);
-    } catch (const std::exception& e) {
-        DEBUG_CERR("Worker " << worker_index << " failed to parse payload for task " << request.task_id << ": " << e.what() << std::endl);
-        ipc_manager.signal_request_handled(worker_index);
-        return;
+    auto parsed = std::from_chars(payload.data(), payload.data() + separator_pos, max_tokens);
+    if (parsed.ec != std::errc()) {
+        DEBUG_CERR("Worker " << worker_index << " failed to parse max_tokens for task " << request.task_id << std::endl);
+        return false;
+    }
+    std::string_view current_input = payload.substr(separator_pos + 1);
+
+    send_response_piece(ipc_manager, slot_idx, request, current_input, false); // optional, send back the promt
+    llm.init(current_input);
+    return true;
+}
+
+// Load a PayloadKind::Tokens request. The server already tokenized the prompt and echoes it to the client itself.
+bool load_token_request(int worker_index, const RequestView& request, TinyLLM& llm, int& max_tokens) {
+    TokenPayloadHeader header;
+    if (request.payload.length() < sizeof(header)) {
+        DEBUG_CERR("Worker " << worker_index << " received truncated token payload for task " << request.task_id << std::endl);
+        return false;
+    }
+    std::memcpy(&header, request.payload.data(), sizeof(header));
+    if (header.n_tokens == 0 || header.n_tokens > MAX_PAYLOAD_TOKENS || sizeof(header) + header.n_tokens * sizeof(int32_t) > request.payload.length()) {
+        DEBUG_CERR("Worker " << worker_index << " received invalid token count " << header.n_tokens << " for task " << request.task_id << std::endl);
+        return false;
     }
 
-    ipc_manager.send_response_chunk(worker_index, request.task_id, current_input, false); // optional, send back the promt
+    max_tokens = static_cast<int>(header.max_tokens);
+    llm.init(reinterpret_cast<const int32_t*>(request.payload.data() + sizeof(header)), header.n_tokens);   // arena payloads are PAYLOAD_ALIGN aligned
+    return true;
+}
+
+void llm_process_and_send_chunked_response(IPCManager& ipc_manager, int worker_index, uint32_t slot_idx, const RequestView& request, TinyLLM& llm){
+    StepTimer timer(ipc_manager, worker_index, request, true);
+    int max_tokens = 0;
+    bool loaded = (request.kind == PayloadKind::Tokens) ? load_token_request(worker_index, request, llm, max_tokens)
+                                                        : load_text_request(ipc_manager, worker_index, slot_idx, request, llm, max_tokens);
+    ipc_manager.release_request_payload(request);   // the prompt is tokenized (or echoed) by now, give the arena space back
     
     if (max_tokens > 50) {
         max_tokens = 50;
     }
+    // Prompt and generated tokens together must fit the model context
+    int context_room = TransformerParameters::max_context - static_cast<int>(llm.context_length());
+    if (max_tokens > context_room) {
+        max_tokens = context_room;
+    }
+    if (!loaded || max_tokens <= 0) {
+        send_response_piece(ipc_manager, slot_idx, request, "", true);   // end the stream, otherwise the server thread waits forever
+        return;
+    }
 
-    
-    llm.init(current_input);
     const int eos_token_id = 3;
     int generated_tokens = 0;
     int next_token = -1; // Start with -1 to indicate first inference
 
     while (generated_tokens < max_tokens) { // for now the model only supports max 50 tokens
+        // Client gone: stop before spending another decode step, and end the stream so the server can release the slot
+        if (ipc_manager.is_task_canceled(request.queue_idx, slot_idx)) {
+            DEBUG_COUT("Worker #" << worker_index << " canceled task " << request.task_id << " after " << generated_tokens << " tokens");
+            ipc_manager.record_cancellation(worker_index);
+            send_response_piece(ipc_manager, slot_idx, request, "", true);
+            return;
+        }
         next_token = llm.inference(next_token);
+        ipc_manager.record_generated_tokens(worker_index, 1);
+        timer.step(next_token != eos_token_id, llm.context_length());
         if (next_token == eos_token_id) {
-            if (!ipc_manager.send_response_chunk(worker_index, request.task_id, "", true)) {
+            if (!send_response_piece(ipc_manager, slot_idx, request, "", true)) {
                 DEBUG_CERR("Worker " << worker_index << " failed to send final EOS response chunk for task " << request.task_id << std::endl);
             }
             break;
         }
 
         bool is_last_iteration = (generated_tokens == max_tokens - 1);
-        std::string result_piece = llm.decode(next_token);
+        std::string_view result_piece = llm.decode_next(next_token);   // view into the tokenizer's table, no allocation per step
 
-        if (!ipc_manager.send_response_chunk(worker_index, request.task_id, result_piece, is_last_iteration)) {
-            DEBUG_CERR("Worker " << worker_index << " failed to send response chunk for task " << request.task_id << std::endl);
-            ipc_manager.signal_request_handled(worker_index);
-            return;
+        // <CHAR_START>/<CHAR_END> markers carry no text, skip them unless the server still needs the last piece
+        if (!result_piece.empty() || is_last_iteration) {
+            if (!send_response_piece(ipc_manager, slot_idx, request, result_piece, is_last_iteration)) {
+                DEBUG_CERR("Worker " << worker_index << " failed to send response chunk for task " << request.task_id << std::endl);
+                return;
+            }
         }
         if (ipc_manager.is_shutdown_requested()){
             return;
         }
         generated_tokens++;
     }
-    ipc_manager.signal_request_handled(worker_index);
 }
 
 
 
-int main(int argc, char* argv[]) {  // argc is argument count(including program name). argv is argument vector. format : executable --index=process_index
+// Prompts of a PayloadKind::Batch request share one forward pass, at most this many at a time. A finished prompt is
+// replaced by the next waiting one before the following step, so the pass stays full until the batch runs dry.
+static constexpr size_t BATCH_WIDTH = 8;
+
+// A prompt of a batch request while it generates
+struct BatchSequence {
+    uint32_t index;
+    int max_tokens;
+    int generated;
+    std::vector<int> token_ids;     // prompt, then the generated tokens
+    std::string text;               // generated so far
+    StreamingDetokenizer detokenizer;
+
+    BatchSequence(uint32_t index, int max_tokens, const HybridTokenizer& vocabulary)
+        : index(index), max_tokens(max_tokens), generated(0), detokenizer(vocabulary) {
+        detokenizer.reset(false);   // the text is returned on its own, without the prompt in front
+    }
+};
+
+// Send one NDJSON line of a batch response, published right away: the item is complete, nothing follows it
+static bool send_batch_line(IPCManager& ipc_manager, uint32_t slot_idx, const RequestView& request, const std::string& line) {
+    return ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, line, false, true);
+}
+
+// An error line for every item of a PayloadKind::Batch request, for a task dropped as a whole
+static void append_batch_error_lines(const RequestView& request, std::string_view message, std::string& out) {
+    BatchPayloadHeader header;
+    if (request.payload.length() < sizeof(header)) return;      // the server reports the items itself
+    std::memcpy(&header, request.payload.data(), sizeof(header));
+    for (uint32_t i = 0; i < header.n_items && sizeof(header) + (i + 1) * sizeof(BatchPayloadItem) <= request.payload.length(); ++i) {
+        BatchPayloadItem item;
+        std::memcpy(&item, request.payload.data() + sizeof(header) + i * sizeof(item), sizeof(item));
+        HttpUtils::append_batch_error_line(out, item.index, message);
+    }
+}
+
+// Tokenize the prompts of a PayloadKind::Batch request. A prompt that does not fit the model context is answered with an
+// error line here, its max_tokens are capped like those of a single request.
+bool load_batch_request(IPCManager& ipc_manager, int worker_index, uint32_t slot_idx, const RequestView& request, TinyLLM& llm,
+                        std::vector<BatchSequence>& sequences) {
+    std::string_view payload = request.payload;
+    BatchPayloadHeader header;
+    if (payload.length() < sizeof(header)) {
+        DEBUG_CERR("Worker " << worker_index << " received truncated batch payload for task " << request.task_id << std::endl);
+        return false;
+    }
+    std::memcpy(&header, payload.data(), sizeof(header));
+    if (header.n_items == 0 || header.n_items > MAX_BATCH_TASK_ITEMS || sizeof(header) + header.n_items * sizeof(BatchPayloadItem) > payload.length()) {
+        DEBUG_CERR("Worker " << worker_index << " received invalid batch size " << header.n_items << " for task " << request.task_id << std::endl);
+        return false;
+    }
+
+    std::string line;
+    sequences.reserve(header.n_items);
+    for (uint32_t i = 0; i < header.n_items; ++i) {
+        BatchPayloadItem item;
+        std::memcpy(&item, payload.data() + sizeof(header) + i * sizeof(item), sizeof(item));
+        if (item.prompt_offset > payload.length() || item.prompt_length > payload.length() - item.prompt_offset) {
+            DEBUG_CERR("Worker " << worker_index << " received batch item " << item.index << " outside the payload for task " << request.task_id << std::endl);
+            return false;
+        }
+        // Prompt and generated tokens together must fit the model context
+        std::vector<int> prompt = llm.encode(payload.substr(item.prompt_offset, item.prompt_length));
+        int context_room = TransformerParameters::max_context - static_cast<int>(prompt.size());
+        if (prompt.empty() || context_room <= 0) {
+            line.clear();
+            HttpUtils::append_batch_error_line(line, item.index, prompt.empty() ? std::string("Empty prompt") :
+                "Prompt too long: " + std::to_string(prompt.size()) + " tokens, the model context is " + std::to_string(TransformerParameters::max_context));
+            send_batch_line(ipc_manager, slot_idx, request, line);
+            continue;
+        }
+        int max_tokens = std::min<int>(std::min<uint32_t>(item.max_tokens, 50), context_room);
+        sequences.emplace_back(item.index, max_tokens, llm.vocabulary());
+        sequences.back().token_ids = std::move(prompt);
+    }
+    return true;
+}
+
+// Generate the prompts of a batch request side by side, one forward pass per step for every sequence still running.
+// Each prompt is answered with its NDJSON line as soon as it finishes, the stream ends once all of them did.
+void llm_process_batch(IPCManager& ipc_manager, int worker_index, uint32_t slot_idx, const RequestView& request, TinyLLM& llm) {
+    WorkerMetrics& metrics = ipc_manager.worker_metrics(worker_index);
+    StepTimer timer(ipc_manager, worker_index, request, false);     // the items leave as whole lines, there is no first token to time
+    std::vector<BatchSequence> sequences;
+    bool loaded = load_batch_request(ipc_manager, worker_index, slot_idx, request, llm, sequences);
+    ipc_manager.release_request_payload(request);   // every prompt is tokenized by now
+    if (!loaded) {
+        ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, "", true);    // the server reports the missing items
+        return;
+    }
+
+    const int eos_token_id = 3;
+    std::string line;
+    auto finish = [&](BatchSequence& sequence, std::string_view finish_reason) {
+        metrics.tokens_generated.record_single_writer(TOKEN_COUNT_BOUNDS, static_cast<uint64_t>(sequence.generated));
+        line.clear();
+        HttpUtils::append_batch_result_line(line, sequence.index, sequence.text, sequence.generated, finish_reason);
+        if (!send_batch_line(ipc_manager, slot_idx, request, line)) {
+            DEBUG_CERR("Worker " << worker_index << " failed to send batch item " << sequence.index << " of task " << request.task_id << std::endl);
+        }
+    };
+
+    std::vector<size_t> active;     // into sequences, in the order of the forward pass rows
+    std::vector<const std::vector<int>*> inputs;
+    std::vector<int> next_tokens;
+    size_t next_waiting = 0;
+    while (true) {
+        while (active.size() < BATCH_WIDTH && next_waiting < sequences.size()) {
+            if (sequences[next_waiting].max_tokens > 0) {
+                active.push_back(next_waiting);
+            } else {
+                finish(sequences[next_waiting], "length");
+            }
+            ++next_waiting;
+        }
+        if (active.empty()) break;
+        // Client gone: stop before spending another decode step, the items still running get no line
+        if (ipc_manager.is_task_canceled(request.queue_idx, slot_idx)) {
+            DEBUG_COUT("Worker #" << worker_index << " canceled batch task " << request.task_id);
+            ipc_manager.record_cancellation(worker_index);
+            break;
+        }
+        if (ipc_manager.is_shutdown_requested()) {
+            return;
+        }
+
+        inputs.clear();
+        size_t longest = 0;
+        for (size_t i : active) {
+            inputs.push_back(&sequences[i].token_ids);
+            longest = std::max(longest, sequences[i].token_ids.size());
+        }
+        llm.inference_batch(inputs, next_tokens);
+        ipc_manager.record_generated_tokens(worker_index, static_cast<uint32_t>(active.size()));
+        timer.step(true, longest, active.size());
+
+        size_t kept = 0;
+        for (size_t k = 0; k < active.size(); ++k) {
+            BatchSequence& sequence = sequences[active[k]];
+            int token = next_tokens[k];
+            if (token == eos_token_id) {
+                finish(sequence, "eos");
+                continue;
+            }
+            sequence.token_ids.push_back(token);
+            sequence.text.append(sequence.detokenizer.step(token));
+            if (++sequence.generated == sequence.max_tokens) {
+                finish(sequence, "length");
+                continue;
+            }
+            active[kept++] = active[k];
+        }
+        active.resize(kept);
+    }
+    ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, "", true);
+}
+
+
+
+int main(int argc, char* argv[]) {  // argc is argument count(including program name). argv is argument vector. format : executable --index=process_index [--notify_fd=fd]
     TinyLLM llm;
 
     std::string arg = argv[1];
     int worker_index = std::atoi(arg.substr(8).c_str());   // extract process index from argument vector
+    int notify_fd = -1;    // eventfd inherited from the server, signals the response pump
+    if (argc > 2 && std::strncmp(argv[2], "--notify_fd=", 12) == 0) {
+        notify_fd = std::atoi(argv[2] + 12);
+    }
 
     // // Set up signal handlers
     // signal(SIGINT, signal_handler);
@@ -103,16 +414,24 @@ int main(int argc, char* argv[]) {  // argc is argument count(including program
         DEBUG_CERR("Failed to initialize IPC" << std::endl);
         return 1;
     }
+    ipc_manager.set_response_notify_fd(notify_fd);
+    // Model loaded and shared memory mapped: from here on the worker beats
+    WorkerTelemetry& telemetry = ipc_manager.worker_telemetry(worker_index);
+    telemetry.pid.store(static_cast<uint32_t>(getpid()), std::memory_order_relaxed);
+    sample_rss(telemetry, steady_now_ns());
+    telemetry.heartbeat_ns.store(steady_now_ns(), std::memory_order_relaxed);
+    telemetry.state.store(static_cast<uint32_t>(WorkerState::Idle), std::memory_order_release);
     
     std::cout << "Worker #" << worker_index << " initialized, waiting for tasks..." << std::endl;
     
     // Main worker loop
-    ReqSlot request;
+    RequestView request;
+    uint32_t slot_idx = 0;
     int processed_count = 0;
     
     while (keep_running && !ipc_manager.is_shutdown_requested()) {
-        // Try to dequeue a request from this worker's queue
-        if (!ipc_manager.dequeue_request(worker_index, request)) {
+        // Take a request from this worker's queue, or steal one queued behind a busy worker
+        if (!ipc_manager.dequeue_request(worker_index, request, slot_idx)) {
             if (ipc_manager.is_shutdown_requested()) {
                 DEBUG_COUT("Shutdown requested, worker " << worker_index << " exiting..." << std::endl);
                 break;
@@ -122,15 +441,41 @@ int main(int argc, char* argv[]) {  // argc is argument count(including program
         }
         
         // Check if the task has been canceled by the server
-        if (request.is_canceled.load()) {
+        if (request.is_canceled) {
             DEBUG_COUT("Worker #" << worker_index << " skipping canceled task " << request.task_id);
-            ipc_manager.signal_request_handled(worker_index); // Still need to signal that we are done with this slot
+            ipc_manager.release_request_payload(request);
+            ipc_manager.record_cancellation(worker_index);
+            // Still need to end the stream so the server releases this slot, a batch stream carries no HTTP framing
+            if (request.kind == PayloadKind::Batch) {
+                ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, "", true);
+            } else {
+                send_response_piece(ipc_manager, slot_idx, request, "", true);
+            }
             continue;
         }
 
-        DEBUG_COUT("Worker #" << worker_index << " processing task " << request.task_id << " (message: \"" << std::string(request.data, request.len) << "\")" << std::endl);
+        // Waited past its deadline: the client was promised a start within it, answer without spending a decode step
+        if (request.deadline_ns != 0 && steady_now_ns() > request.deadline_ns) {
+            DEBUG_COUT("Worker #" << worker_index << " dropping expired task " << request.task_id);
+            ipc_manager.record_expiry(worker_index);
+            std::string frame;
+            if (request.kind == PayloadKind::Batch) {
+                append_batch_error_lines(request, "Deadline exceeded before generation started", frame);
+            } else {
+                HttpUtils::append_json_error_frame(frame, "Deadline exceeded before generation started");
+            }
+            ipc_manager.release_request_payload(request);
+            ipc_manager.send_response_chunk(request.queue_idx, slot_idx, request.task_id, frame, true);
+            continue;
+        }
+
+        DEBUG_COUT("Worker #" << worker_index << " processing task " << request.task_id << " (payload: " << request.payload.length() << " bytes)" << std::endl);
         
-        llm_process_and_send_chunked_response(ipc_manager, worker_index, request, llm);
+        if (request.kind == PayloadKind::Batch) {
+            llm_process_batch(ipc_manager, worker_index, slot_idx, request, llm);
+        } else {
+            llm_process_and_send_chunked_response(ipc_manager, worker_index, slot_idx, request, llm);
+        }
         processed_count++;
         DEBUG_COUT("Worker #" << worker_index << " completed task " << request.task_id << std::endl);
     }